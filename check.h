@@ -0,0 +1,48 @@
+#ifndef TIKL_CHECK_H
+#define TIKL_CHECK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "subst.h"
+
+/* FileCheck-style matcher shared by tikl-check and the tikl driver, which
+ * runs a trailing `%check` in-process. */
+
+typedef struct {
+    const char **prefixes;  /* borrowed; CHECK when empty */
+    size_t nprefixes;
+    bool print_output_on_fail;
+    const char *testfile;   /* borrowed */
+} tikl_check_options;
+
+/* CHECK candidate lines of one test file, loaded once and reusable for any
+ * prefix set. */
+typedef struct tikl_check_source tikl_check_source;
+/* %name values from a TIKL_CHECK_SUBSTS blob ("key=value" lines). */
+typedef struct tikl_check_substs tikl_check_substs;
+
+/* Parses tikl-check's command line (argv[0] included).  Returns 0, or 2 after
+ * printing a diagnostic. */
+int tikl_check_parse_args(int argc, char *const argv[],
+                          tikl_check_options *opts);
+void tikl_check_options_free(tikl_check_options *opts);
+
+tikl_check_substs *tikl_check_substs_parse(const char *blob);
+const char *tikl_check_substs_lookup(void *substs, const char *key,
+                                     size_t len);
+void tikl_check_substs_free(tikl_check_substs *substs);
+
+/* Returns NULL after printing a diagnostic when path cannot be read. */
+tikl_check_source *tikl_check_source_load(const char *path);
+const char *tikl_check_source_path(const tikl_check_source *src);
+void tikl_check_source_free(tikl_check_source *src);
+
+/* Matches output against the directives in src, reporting failures on
+ * stderr.  Returns 0 on success and 1 on any failure. */
+int tikl_check_verify(const tikl_check_source *src,
+                      const tikl_check_options *opts, bool lit_compat,
+                      const tikl_check_substs *substs, const char *output,
+                      size_t len);
+
+#endif /* TIKL_CHECK_H */
@@ -0,0 +1,89 @@
+#define _POSIX_C_SOURCE 200809L
+/* the feature macros tikl.c itself sets, before any system header */
+#define _DARWIN_C_SOURCE
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define main tikl_main
+#include "../../tikl.c"
+#undef main
+
+/* The fork() + execl() path run_shell() used before it switched to
+ * posix_spawn(), kept here as the baseline. */
+static int
+fork_exec_shell(const char *script)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+        return 127;
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_RDWR);
+        if (devnull >= 0) {
+            dup2(devnull, STDIN_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            dup2(devnull, STDERR_FILENO);
+        }
+        execl(run_shell_path, run_shell_path, "-c", script, (char *)0);
+        _exit(127);
+    }
+    int st = 0;
+    while (waitpid(pid, &st, 0) < 0)
+        if (errno != EINTR)
+            return 127;
+    return WIFEXITED(st) ? WEXITSTATUS(st) : 127;
+}
+
+static int
+posix_spawn_shell(const char *script)
+{
+    pid_t pid;
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int err = spawn_shell(&pid, run_shell_path, script, environ, devnull);
+    if (devnull >= 0)
+        close(devnull);
+    if (err != 0)
+        return 127;
+    int st = 0;
+    while (waitpid(pid, &st, 0) < 0)
+        if (errno != EINTR)
+            return 127;
+    return WIFEXITED(st) ? WEXITSTATUS(st) : 127;
+}
+
+static double
+bench(const char *name, int (*spawn)(const char *), unsigned n)
+{
+    unsigned long long start = monotonic_ms();
+    for (unsigned i = 0; i < n; i++) {
+        if (spawn("exit 0") != 0) {
+            fprintf(stderr, "%s: spawn failed\n", name);
+            exit(1);
+        }
+    }
+    double us = (double)(monotonic_ms() - start) * 1000.0 / n;
+    printf("%-12s %6u spawns %9.1f us/spawn\n", name, n, us);
+    return us;
+}
+
+/* The parent carries a large heap, as tikl does after loading a big suite,
+ * so fork() has page tables to copy while posix_spawn() does not. */
+int
+main(int argc, char **argv)
+{
+    unsigned n = argc > 1 ? (unsigned)strtoul(argv[1], NULL, 10) : 2000;
+    size_t ballast_mb = argc > 2 ? strtoul(argv[2], NULL, 10) : 256;
+    if (n == 0)
+        n = 1;
+    char *ballast = malloc(ballast_mb << 20);
+    if (ballast)
+        memset(ballast, 1, ballast_mb << 20);
+    init_run_shell();
+    printf("shell %s, %zu MiB resident\n", run_shell_path,
+           ballast ? ballast_mb : (size_t)0);
+    double old_us = bench("fork+exec", fork_exec_shell, n);
+    double new_us = bench("posix_spawn", posix_spawn_shell, n);
+    printf("speedup      %.2fx\n", old_us / new_us);
+    free(ballast);
+    return 0;
+}
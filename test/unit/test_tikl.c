@@ -1,4 +1,10 @@
 #define _POSIX_C_SOURCE 200809L
+/* the feature macros tikl.c itself sets, before any system header */
+#define _DARWIN_C_SOURCE
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#define _DEFAULT_SOURCE
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
@@ -15,9 +21,184 @@ main(void)
     map_source_to_bin("/src/a/b/c.c", out, sizeof(out));
     assert(strcmp(out, "bin/a/b/c") == 0);
     source_root = NULL;
-    char r[256];
-    assert(parse_comment_run("// RUN: echo hi", r, sizeof(r))
-           && strcmp(r, "echo hi") == 0);
+    const char *run_line = "// RUN: echo hi";
+    const char *body = comment_run_body(run_line, run_line + strlen(run_line));
+    assert(body && strcmp(body, "echo hi") == 0);
+    static char src[20000];
+    strcpy(src, "# REQUIRES: a, b\n# XFAIL: why \n# RUN: echo \\\n# more\n# RUN: ");
+    size_t off = strlen(src);
+    memset(src + off, 'x', 10000);
+    strcpy(src + off + 10000, "\n# ALLOW_RETRIES: 2x\n");
+    test_directives d = {0};
+    scan_test_directives(src, strlen(src), &d);
+    assert(d.reqs.n == 2 && strcmp(d.reqs.v[1], "b") == 0);
+    assert(d.xfail && strcmp(d.xfail_reason, "why") == 0);
+    assert(d.runs.n == 2 && strcmp(d.runs.v[0], "echo  # more") == 0);
+    assert(strlen(d.runs.v[1]) == 10000 && d.bad_allow_retries == 1);
+    test_directives_free(&d);
+    const char *budgets = "# STEP_TIMEOUT: 2\n# TIMEOUT: 5m \n";
+    scan_test_directives(budgets, strlen(budgets), &d);
+    assert(strcmp(d.step_timeout, "2") == 0 && strcmp(d.timeout, "5m") == 0);
+    test_directives_free(&d);
+    test_env te = { .step_timeout_ms = 100 };
+    assert(step_deadline(&te, 1000) == 1100);
+    te.deadline = 1050;
+    assert(step_deadline(&te, 1000) == 1050);
+    te.step_timeout_ms = 0;
+    assert(step_deadline(&te, 2000) == 1050);
+    pipeline pl;
+    assert(parse_simple_pipeline("a 'b c' \"d\\\"e\" | f -x=1 >out 2>&1", &pl));
+    assert(pl.n == 2 && pl.v[0].argv.n == 3 && strcmp(pl.v[0].argv.v[2], "d\"e") == 0);
+    assert(pl.v[1].nredirs == 2 && pl.v[1].redirs[1].kind == REDIR_DUP);
+    pipeline_free(&pl);
+    assert(!parse_simple_pipeline("a && b", &pl));
+    assert(!parse_simple_pipeline("a $HOME", &pl));
+    assert(!parse_simple_pipeline("cd x", &pl));
+    assert(!parse_simple_pipeline("X=1 a", &pl));
+    assert(!parse_simple_pipeline("ls *.c", &pl));
+    assert(!parse_simple_pipeline("a 3>x", &pl));
+    assert(!parse_simple_pipeline("a |", &pl));
+    vecstr feats = {0};
+    vecstr_push(&feats, "linux");
+    assert(eval_feature_expr("linux && !(x86 || arm)", &feats) == 1);
+    assert(eval_feature_expr("!linux || false", &feats) == 0);
+    assert(eval_feature_expr("linux &&", &feats) == -1);
+    vecstr_push(&feats, "os/linux");
+    assert(eval_feature_expr("os/linux && !arch/x86", &feats) == 1);
+    vecstr_free(&feats);
+    strmap_free(&feature_expr_cache);
+    unsigned long ms = 0;
+    assert(parse_duration_ms("2", &ms) && ms == 2000);
+    assert(parse_duration_ms("0.25", &ms) && ms == 250);
+    assert(parse_duration_ms("250ms", &ms) && ms == 250);
+    assert(!parse_duration_ms("5x", &ms));
+    assert(!parse_duration_ms("-1", &ms));
+    char dbuf[32];
+    assert(strcmp(format_duration(dbuf, sizeof(dbuf), 1234), "1.23 s") == 0);
+    assert(strcmp(format_duration(dbuf, sizeof(dbuf), 99949), "99.9 s") == 0);
+    assert(strcmp(format_duration(dbuf, sizeof(dbuf), 2123456), "2123 s") == 0);
+    step_limits lim = {{0}};
+    assert(parse_limits("mem=512M, cpu=1.5 fsize=4k,nproc=64", &lim));
+    assert(lim.v[LIMIT_MEM] == 512ull << 20 && lim.v[LIMIT_CPU] == 2);
+    assert(lim.v[LIMIT_FSIZE] == 4096 && lim.v[LIMIT_NPROC] == 64);
+    assert(parse_limits("cpu=none", &lim) && lim.v[LIMIT_CPU] == 0);
+    assert(!parse_limits("disk=1G", &lim) && lim.v[LIMIT_MEM] == 512ull << 20);
+    assert(!parse_limits("nproc=4k", &lim) && !parse_limits("mem", &lim));
+    char lbuf[32];
+    assert(strcmp(format_limit(lbuf, sizeof(lbuf), LIMIT_MEM, 3ull << 30),
+                  "3 GiB") == 0);
+    assert(strcmp(format_limit(lbuf, sizeof(lbuf), LIMIT_FSIZE, 1000),
+                  "1000 bytes") == 0);
+    sched_entry order[] = {
+        { .index = 0, .ms = 10, .known = true },
+        { .index = 1, .ms = 0, .known = false },
+        { .index = 2, .ms = 500, .known = true },
+        { .index = 3, .ms = 10, .known = true },
+    };
+    qsort(order, 4, sizeof(order[0]), sched_entry_cmp);
+    assert(order[0].index == 1 && order[1].index == 2);
+    assert(order[2].index == 0 && order[3].index == 3);
+    test_result res = { .status = TEST_SKIP, .failed_step = 2, .exit_code = 7,
+                        .retries = 1, .total_ms = 42
+                      };
+    res.step_ms = xrealloc(NULL, 2 * sizeof(*res.step_ms));
+    res.step_ms[0] = 5;
+    res.step_ms[1] = 37;
+    res.nsteps = 2;
+    res.usage.user_ms = 11;
+    res.usage.majflt = 3;
+    res.step_usage = xrealloc(NULL, 2 * sizeof(*res.step_usage));
+    memset(res.step_usage, 0, 2 * sizeof(*res.step_usage));
+    res.step_usage[1].maxrss_kb = 2048;
+    res.skip_reason = xstrdup("missing feature: x");
+    int rfd = open_report_file();
+    assert(rfd >= 0);
+    assert(write(rfd, "out\n", 4) == 4);
+    write_worker_result(rfd, &res);
+    test_result back = {0};
+    char *rtext;
+    size_t rlen;
+    assert(read_worker_report(rfd, &rtext, &rlen, &back));
+    assert(rlen == 4 && memcmp(rtext, "out\n", 4) == 0);
+    free(rtext);
+    assert(back.status == TEST_SKIP && back.failed_step == 2 && back.exit_code == 7);
+    assert(back.nsteps == 2 && back.step_ms[1] == 37 && back.total_ms == 42);
+    assert(strcmp(back.skip_reason, "missing feature: x") == 0);
+    assert(back.usage.user_ms == 11 && back.usage.majflt == 3);
+    assert(back.step_usage[1].maxrss_kb == 2048);
+    result_reset(&back);
+    res.status = TEST_LIMIT;
+    res.limit = LIMIT_FSIZE;
+    rfd = open_report_file();
+    assert(rfd >= 0);
+    write_worker_result(rfd, &res);
+    assert(read_worker_report(rfd, &rtext, &rlen, &back));
+    assert(rlen == 0);
+    free(rtext);
+    assert(back.status == TEST_LIMIT && back.limit == LIMIT_FSIZE);
+    rfd = open_report_file();
+    assert(rfd >= 0);
+    assert(write(rfd, "no result\n", 10) == 10);
+    assert(!read_worker_report(rfd, &rtext, &rlen, &back) && rlen == 10);
+    free(rtext);
+    result_reset(&back);
+    result_reset(&res);
+    auto_timeout_options ao = {0};
+    assert(parse_auto_timeout("auto", &ao) && ao.on && ao.factor == 3.0);
+    assert(ao.floor_ms == 1000 && ao.cap_ms == 0);
+    assert(parse_auto_timeout("auto,factor=2.5,floor=50ms,cap=1m", &ao));
+    assert(ao.factor == 2.5 && ao.floor_ms == 50 && ao.cap_ms == 60000);
+    assert(!parse_auto_timeout("auto,factor=0.5", &ao));
+    assert(!parse_auto_timeout("auto,cap=1,floor=2", &ao));
+    assert(!parse_auto_timeout("auto,bogus=1", &ao));
+    assert(!parse_auto_timeout("automatic", &ao));
+    unsigned long hist_a[] = { 10, 40 }, hist_b[] = { 20, 400 }, hist_c[] = { 30 };
+    history_run hruns[] = {
+        { TEST_OK, 50, hist_a, 2 },
+        { TEST_FAIL, 420, hist_b, 2 },
+        { TEST_OK, 30, hist_c, 1 },
+        { TEST_OK, 50, hist_a, 2 },
+    };
+    history_test ht = { "/x/t.c", hruns, 4, 4 };
+    ao = (auto_timeout_options) { .on = true, .factor = 3.0 };
+    assert(derive_step_timeout(&ht, 0, &ao) == 90);
+    assert(derive_step_timeout(&ht, 1, &ao) == 0);
+    ao.floor_ms = 100;
+    assert(derive_step_timeout(&ht, 0, &ao) == 100);
+    ao.floor_ms = 0;
+    ao.cap_ms = 60;
+    assert(derive_step_timeout(&ht, 0, &ao) == 60);
+    slow_entry slow[2];
+    size_t nslow = 0;
+    slowest_insert(slow, &nslow, 2, "a", 0, 5);
+    slowest_insert(slow, &nslow, 2, "b", 0, 9);
+    slowest_insert(slow, &nslow, 2, "c", 0, 1);
+    slowest_insert(slow, &nslow, 2, "d", 2, 7);
+    assert(nslow == 2 && slow[0].ms == 9 && strcmp(slow[1].test, "d") == 0);
+    assert(slow[1].step == 2);
+    free(slow[0].test);
+    free(slow[1].test);
+    const char *deps = "# DEPENDS: a.txt, ../b c\n";
+    scan_test_directives(deps, strlen(deps), &d);
+    assert(d.depends.n == 3 && strcmp(d.depends.v[1], "../b") == 0);
+    test_directives_free(&d);
+    assert(fnv1a64(FNV64_OFFSET, "a", 1) == 0xaf63dc4c8601ec8cull);
+    assert(fnv1a64_str(FNV64_OFFSET, "ab") !=
+           fnv1a64_str(fnv1a64_str(FNV64_OFFSET, "a"), "b"));
+    char wpath[] = "/tmp/tikl-unit-XXXXXX";
+    int wfd = mkstemp(wpath);
+    assert(wfd >= 0 && write(wfd, "notes\n", 6) == 6);
+    assert(!file_mentions_run(wpath));
+    assert(write(wfd, "# RUN: true\n", 12) == 12);
+    assert(file_mentions_run(wpath));
+    assert(ftruncate(wfd, 0) == 0 && pwrite(wfd, "x\0RUN: y\n", 10, 0) == 10);
+    assert(!file_mentions_run(wpath));
+    close(wfd);
+    unlink(wpath);
+    strbuf js = {0};
+    append_json_string(&js, "a\"b\\c\n");
+    assert(strcmp(js.v, "\"a\\\"b\\\\c\\u000a\"") == 0);
+    free(js.v);
     puts("unit: OK");
     return 0;
 }
@@ -1,26 +1,54 @@
 #define _POSIX_C_SOURCE 200809L
+/* CMSG_SPACE and CMSG_LEN are hidden on macOS in strict POSIX mode, wait4()
+ * on glibc, struct ucred (SO_PEERCRED) without _GNU_SOURCE */
+#define _DARWIN_C_SOURCE
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <regex.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "version.h"
+#include "check.h"
 #include "subst.h"
 
 typedef struct {
     char **v;
     size_t n, cap;
 } vecstr;
+typedef struct {
+    char *v;
+    size_t n, cap;
+} strbuf;
 typedef struct {
     char *key;
     char *val;
@@ -30,6 +58,8 @@ typedef struct {
     size_t n, cap;
 } mapkv;
 
+extern char **environ;
+
 static const char *const default_bin_root = "bin";
 static const char *bin_root = "bin";
 static const char *const default_scratch_root = "/tmp";
@@ -37,17 +67,122 @@ static const char *scratch_root = "/tmp";
 static bool scratch_root_forced = false;
 static const char *source_root = NULL;
 static char source_root_buf[PATH_MAX];
-static unsigned timeout_secs = 0;
+static unsigned long timeout_ms = 0;
+static unsigned long kill_grace_ms = 0;
+/* --max-time: the run's budget, and the monotonic time run_tests() turned
+ * it into (0 when there is none). */
+static unsigned long max_time_ms = 0;
+static unsigned long long suite_deadline = 0;
 static const char tikl_version[] = TIKL_VERSION;
 static bool lit_compat = false;
 static const char *run_shell_path = "/bin/sh";
 static bool run_shell_has_pipefail = false;
 typedef struct {
-    pid_t *v;
+    pid_t pid;
+    char *path;
+    unsigned long long start_ms;
+    unsigned long long expected_end;
+    size_t index;
+    unsigned slot;
+    int report_fd;
+    bool cancelled;         /* killed by the scheduler, not by its test */
+} worker;
+typedef struct {
+    worker *v;
+    size_t n, cap;
+} vecworker;
+static vecworker workers = {0};
+typedef struct {
+    char *key;
+    unsigned long val;
+} strmap_slot;
+typedef struct {
+    strmap_slot *v;
     size_t n, cap;
-} vecpid;
-static vecpid worker_pids = {0};
+} strmap;
+typedef struct {
+    vecstr runs;
+    vecstr reqs;
+    vecstr uns;
+    vecstr limits;
+    vecstr depends;
+    char *timeout;
+    char *step_timeout;
+    bool xfail;
+    char *xfail_reason;
+    unsigned allow_retries;
+    bool have_allow_retries;
+    unsigned bad_allow_retries;
+} test_directives;
+typedef enum {
+    TEST_OK,
+    TEST_FAIL,
+    TEST_SKIP,
+    TEST_XFAIL,
+    TEST_XPASS,
+    TEST_TIME,
+    TEST_LIMIT,
+    TEST_NORUN,
+    TEST_NSTATUS
+} test_status;
+static const char *const test_status_names[TEST_NSTATUS] = {
+    "OK", "FAIL", "SKIP", "XFAIL", "XPASS", "TIME", "LIMIT", "NORUN",
+};
+/* Resource limits applied to each RUN step, from --limit and LIMIT:
+ * directives.  Sizes are in bytes, cpu in seconds; 0 means no limit. */
+typedef enum {
+    LIMIT_MEM,
+    LIMIT_CPU,
+    LIMIT_FSIZE,
+    LIMIT_NPROC,
+    LIMIT_NKINDS
+} limit_kind;
+static const char *const limit_names[LIMIT_NKINDS] = {
+    "mem", "cpu", "fsize", "nproc",
+};
+typedef struct {
+    unsigned long long v[LIMIT_NKINDS];
+} step_limits;
+static step_limits default_limits = {{0}};
+static const char *cgroup_dir = NULL;
+/* What wait4() reports for a step's processes, summed over its stages
+ * (maxrss is the largest of them). */
+typedef struct {
+    unsigned long user_ms;
+    unsigned long sys_ms;
+    unsigned long maxrss_kb;
+    unsigned long nvcsw;
+    unsigned long nivcsw;
+    unsigned long minflt;
+    unsigned long majflt;
+} resource_usage;
+/* How a step ended beyond its exit code. */
+typedef struct {
+    bool timed_out;
+    bool leaked;
+    int limit;              /* the limit_kind it ran into, or -1 */
+    resource_usage usage;
+} step_outcome;
+typedef struct {
+    test_status status;
+    size_t failed_step;
+    int exit_code;
+    unsigned retries;
+    unsigned long total_ms;
+    unsigned long *step_ms;
+    size_t nsteps;
+    char *skip_reason;
+    limit_kind limit;
+    resource_usage usage;
+    resource_usage *step_usage;
+    bool cached;            /* reported from --cache without running */
+} test_result;
+static const char *state_dir = NULL;
+static char state_dir_buf[PATH_MAX];
+static strmap test_times = {0};
+static bool test_times_dirty = false;
 static volatile sig_atomic_t abort_requested = 0;
+static int sigchld_pipe[2] = { -1, -1 };
 
 static void
 die(const char *fmt, ...)
@@ -143,30 +278,19 @@ prepend_own_dir_to_path(const char *arg0)
     free(path);
 }
 
-static void
-join_with_space(char *dst, size_t cap, const char *lhs,
-                const char *rhs, const char *what)
-{
-    size_t nl = strlen(lhs);
-    size_t nr = strlen(rhs);
-    size_t needed = nl + 1 + nr + 1;
-    if (needed > cap)
-        die("%s too long", what);
-    memcpy(dst, lhs, nl);
-    dst[nl] = ' ';
-    memcpy(dst + nl + 1, rhs, nr + 1);
-}
-
-static void
-ensure_dir(const char *path)
+/* mkdir -p.  Returns false with errno set when a directory cannot be
+ * created. */
+static bool
+make_dirs(const char *path)
 {
     if (!path || *path == '\0')
-        return;
+        return true;
     if (path[0] == '.' && path[1] == '\0')
-        return;
+        return true;
     char buf[PATH_MAX];
     if (snprintf(buf, sizeof(buf), "%s", path) >= (int)sizeof(buf)) {
-        die("path too long: %s", path);
+        errno = ENAMETOOLONG;
+        return false;
     }
     char *p = buf;
     if (*p == '/')
@@ -174,15 +298,19 @@ ensure_dir(const char *path)
     for (; *p; p++) {
         if (*p == '/') {
             *p = '\0';
-            if (buf[0] != '\0' && mkdir(buf, 0755) != 0 && errno != EEXIST) {
-                die("mkdir %s: %s", buf, strerror(errno));
-            }
+            if (buf[0] != '\0' && mkdir(buf, 0755) != 0 && errno != EEXIST)
+                return false;
             *p = '/';
         }
     }
-    if (mkdir(buf, 0755) != 0 && errno != EEXIST) {
-        die("mkdir %s: %s", buf, strerror(errno));
-    }
+    return mkdir(buf, 0755) == 0 || errno == EEXIST;
+}
+
+static void
+ensure_dir(const char *path)
+{
+    if (!make_dirs(path))
+        die("mkdir %s: %s", path, strerror(errno));
 }
 
 static void *
@@ -202,6 +330,16 @@ xstrdup(const char *s)
     return d;
 }
 
+/* Returns a NUL-terminated copy of the n bytes at s. */
+static char *
+xmemdup(const char *s, size_t n)
+{
+    char *d = xrealloc(NULL, n + 1);
+    memcpy(d, s, n);
+    d[n] = '\0';
+    return d;
+}
+
 static void
 vecstr_push(vecstr *vv, const char *s)
 {
@@ -212,6 +350,15 @@ vecstr_push(vecstr *vv, const char *s)
     vv->v[vv->n++] = xstrdup(s);
 }
 static void
+vecstr_push_n(vecstr *vv, const char *s, size_t n)
+{
+    if (vv->n == vv->cap) {
+        vv->cap = vv->cap ? vv->cap * 2 : 8;
+        vv->v = xrealloc(vv->v, vv->cap * sizeof(*vv->v));
+    }
+    vv->v[vv->n++] = xmemdup(s, n);
+}
+static void
 vecstr_free(vecstr *vv)
 {
     for (size_t i = 0; i < vv->n; i++)
@@ -219,46 +366,445 @@ vecstr_free(vecstr *vv)
     free(vv->v);
 }
 static void
-vecpid_push(vecpid *vp, pid_t p)
+strbuf_append(strbuf *sb, const char *s, size_t n)
+{
+    if (sb->n + n + 1 > sb->cap) {
+        sb->cap = (sb->n + n + 1) * 2;
+        sb->v = xrealloc(sb->v, sb->cap);
+    }
+    memcpy(sb->v + sb->n, s, n);
+    sb->n += n;
+    sb->v[sb->n] = '\0';
+}
+static void
+strbuf_puts(strbuf *sb, const char *s)
+{
+    strbuf_append(sb, s, strlen(s));
+}
+static void
+strbuf_printf(strbuf *sb, const char *fmt, ...)
 {
-    if (vp->n == vp->cap) {
-        vp->cap = vp->cap ? vp->cap * 2 : 8;
-        vp->v = xrealloc(vp->v, vp->cap * sizeof(*vp->v));
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n <= 0)
+        return;
+    if ((size_t)n < sizeof(buf)) {
+        strbuf_append(sb, buf, (size_t)n);
+        return;
     }
-    vp->v[vp->n++] = p;
+    char *big = xrealloc(NULL, (size_t)n + 1);
+    va_start(ap, fmt);
+    vsnprintf(big, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    strbuf_append(sb, big, (size_t)n);
+    free(big);
 }
 static void
-vecpid_remove(vecpid *vp, pid_t p)
+write_all(int fd, const char *s, size_t n)
 {
-    for (size_t i = 0; i < vp->n; i++) {
-        if (vp->v[i] == p) {
-            vp->v[i] = vp->v[vp->n - 1];
-            vp->n--;
+    while (n > 0) {
+        ssize_t w = write(fd, s, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
             return;
+        s += w;
+        n -= (size_t)w;
+    }
+}
+static void
+vecworker_push(vecworker *vw, worker w)
+{
+    if (vw->n == vw->cap) {
+        vw->cap = vw->cap ? vw->cap * 2 : 8;
+        vw->v = xrealloc(vw->v, vw->cap * sizeof(*vw->v));
+    }
+    vw->v[vw->n++] = w;
+}
+static bool
+vecworker_take(vecworker *vw, pid_t p, worker *out)
+{
+    for (size_t i = 0; i < vw->n; i++) {
+        if (vw->v[i].pid == p) {
+            *out = vw->v[i];
+            vw->v[i] = vw->v[vw->n - 1];
+            vw->n--;
+            return true;
         }
     }
+    return false;
 }
 static void
-vecpid_free(vecpid *vp)
+vecworker_free(vecworker *vw)
+{
+    for (size_t i = 0; i < vw->n; i++) {
+        free(vw->v[i].path);
+        if (vw->v[i].report_fd >= 0)
+            close(vw->v[i].report_fd);
+    }
+    free(vw->v);
+    vw->v = NULL;
+    vw->n = vw->cap = 0;
+}
+/* The lowest --trace slot no running worker holds. */
+static unsigned
+free_worker_slot(void)
 {
-    free(vp->v);
-    vp->v = NULL;
-    vp->n = vp->cap = 0;
+    for (unsigned slot = 1;; slot++) {
+        size_t i = 0;
+        while (i < workers.n && workers.v[i].slot != slot)
+            i++;
+        if (i == workers.n)
+            return slot;
+    }
 }
+
 static void
 kill_active_workers(int sig)
 {
-    for (size_t i = 0; i < worker_pids.n; i++) {
-        pid_t p = worker_pids.v[i];
-        if (p > 0)
+    for (size_t i = 0; i < workers.n; i++) {
+        pid_t p = workers.v[i].pid;
+        if (p > 0) {
             kill(-p, sig);
+            workers.v[i].cancelled = true;
+        }
+    }
+}
+
+static size_t
+strmap_hash(const char *key)
+{
+    size_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+static strmap_slot *
+strmap_slot_for(const strmap *m, const char *key)
+{
+    size_t mask = m->cap - 1;
+    for (size_t i = strmap_hash(key) & mask;; i = (i + 1) & mask) {
+        if (!m->v[i].key || strcmp(m->v[i].key, key) == 0)
+            return &m->v[i];
+    }
+}
+static unsigned long *
+strmap_get(const strmap *m, const char *key)
+{
+    if (m->cap == 0)
+        return NULL;
+    strmap_slot *slot = strmap_slot_for(m, key);
+    return slot->key ? &slot->val : NULL;
+}
+/* Returns the value slot for key, inserting a zero value when absent. */
+static unsigned long *
+strmap_put(strmap *m, const char *key)
+{
+    if ((m->n + 1) * 4 > m->cap * 3) {
+        strmap old = *m;
+        m->cap = old.cap ? old.cap * 2 : 64;
+        m->v = calloc(m->cap, sizeof(*m->v));
+        if (!m->v)
+            die("OOM");
+        m->n = 0;
+        for (size_t i = 0; i < old.cap; i++) {
+            if (old.v[i].key) {
+                *strmap_slot_for(m, old.v[i].key) = old.v[i];
+                m->n++;
+            }
+        }
+        free(old.v);
     }
+    strmap_slot *slot = strmap_slot_for(m, key);
+    if (!slot->key) {
+        slot->key = xstrdup(key);
+        slot->val = 0;
+        m->n++;
+    }
+    return &slot->val;
+}
+static void
+strmap_free(strmap *m)
+{
+    for (size_t i = 0; i < m->cap; i++)
+        free(m->v[i].key);
+    free(m->v);
+    m->v = NULL;
+    m->n = m->cap = 0;
 }
 static void
 handle_sig(int sig)
 {
     abort_requested = sig;
 }
+static void
+handle_sigchld(int sig)
+{
+    (void)sig;
+    int saved_errno = errno;
+    if (sigchld_pipe[1] >= 0) {
+        char c = 0;
+        ssize_t w = write(sigchld_pipe[1], &c, 1);
+        (void)w;
+    }
+    errno = saved_errno;
+}
+
+/* Self-pipe written from the SIGCHLD handler so waits can poll() with a
+ * deadline instead of sleeping.  Forked workers call this again to get a
+ * pipe of their own. */
+static void
+init_child_wait(void)
+{
+    for (int i = 0; i < 2; i++) {
+        if (sigchld_pipe[i] >= 0)
+            close(sigchld_pipe[i]);
+        sigchld_pipe[i] = -1;
+    }
+    int fds[2];
+    if (pipe(fds) != 0)
+        die("pipe: %s", strerror(errno));
+    for (int i = 0; i < 2; i++) {
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+    }
+    sigchld_pipe[0] = fds[0];
+    sigchld_pipe[1] = fds[1];
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+}
+static void
+drain_child_wait(void)
+{
+    char buf[64];
+    while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+}
+
+/* When tikl runs the steps of one test at a time it becomes a subreaper
+ * (Linux), so a process that escapes its step's group by daemonizing is
+ * re-parented to tikl instead of init and can be found and stopped. */
+static bool adopt_orphans = false;
+
+static void
+become_subreaper(void)
+{
+#ifdef __linux__
+    adopt_orphans = prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0) == 0;
+#endif
+}
+
+/* A -j parent holds a report file per worker and --async a few descriptors
+ * per running test, more than the usual soft limit of 1024 allows at a high
+ * -j, so tikl takes what the hard limit grants. */
+static void
+raise_fd_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur >= rl.rlim_max)
+        return;
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+#ifdef __linux__
+/* Writes s to dir/file, as cgroup control files want it: one write(). */
+static bool
+cgroup_write(const char *dir, const char *file, const char *s)
+{
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, file) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, s, strlen(s)) == (ssize_t)strlen(s);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return ok;
+}
+#endif
+
+/* With --cgroup DIR (cgroup v2, Linux only) each step limited in mem or
+ * nproc runs in a leaf of DIR of its own, where memory.max and pids.max
+ * cover the step's whole process tree and memory.events/pids.events tell a
+ * limit hit from an ordinary failure.  DIR must be writable and hold no
+ * processes itself, e.g. a delegated systemd scope. */
+static void
+setup_cgroup(void)
+{
+#ifdef __linux__
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/cgroup.controllers", cgroup_dir) >=
+        (int)sizeof(path) || access(path, R_OK) != 0)
+        die("--cgroup %s: not a cgroup v2 directory", cgroup_dir);
+    static const char *const controllers[] = { "+memory", "+pids" };
+    for (size_t i = 0; i < sizeof(controllers) / sizeof(controllers[0]); i++)
+        if (!cgroup_write(cgroup_dir, "cgroup.subtree_control", controllers[i]))
+            fprintf(stderr, "tikl: cannot enable the %s controller in %s: %s\n",
+                    controllers[i] + 1, cgroup_dir, strerror(errno));
+#else
+    die("--cgroup is only supported on Linux");
+#endif
+}
+
+static unsigned long long
+monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000ull +
+           (unsigned long long)ts.tv_nsec / 1000000ull;
+}
+
+static unsigned long long
+monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000ull +
+           (unsigned long long)ts.tv_nsec / 1000ull;
+}
+
+/* Accepts plain or fractional seconds ("2", "0.25", "1.5s") and
+ * milliseconds ("250ms"). */
+static bool
+parse_duration_ms(const char *s, unsigned long *out)
+{
+    if (!s || !*s)
+        return false;
+    errno = 0;
+    char *end = NULL;
+    double v = strtod(s, &end);
+    if (errno || end == s || !(v >= 0))
+        return false;
+    double scale = 1000.0;
+    if (strcmp(end, "ms") == 0)
+        scale = 1.0;
+    else if (strcmp(end, "m") == 0)
+        scale = 60000.0;
+    else if (*end != '\0' && strcmp(end, "s") != 0)
+        return false;
+    double ms = v * scale + 0.5;
+    if (ms >= (double)ULONG_MAX)
+        return false;
+    *out = (unsigned long)ms;
+    if (*out == 0 && v > 0)
+        *out = 1;
+    return true;
+}
+static const char *
+format_duration(char *buf, size_t cap, unsigned long ms)
+{
+    if (ms % 1000 == 0)
+        snprintf(buf, cap, "%lu s", ms / 1000);
+    else if (ms < 1000)
+        snprintf(buf, cap, "%lu ms", ms);
+    else if (ms < 100000)
+        snprintf(buf, cap, "%.3g s", (double)ms / 1000.0);
+    else
+        snprintf(buf, cap, "%lu s", ms / 1000 + (ms % 1000 >= 500));
+    return buf;
+}
+
+/* Parses a limit spec such as "mem=512M cpu=10 fsize=1G nproc=64" into lim,
+ * leaving limits it does not mention alone.  Entries are separated by
+ * spaces or commas; sizes take K, M, G or T suffixes, cpu takes a duration
+ * rounded up to whole seconds, and "none" or 0 lifts a limit. */
+static bool
+parse_limits(const char *spec, step_limits *lim)
+{
+    step_limits out = *lim;
+    const char *p = spec;
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (!*p)
+            break;
+        const char *key = p;
+        while (*p && *p != '=' && *p != ' ' && *p != '\t' && *p != ',')
+            p++;
+        if (*p != '=')
+            return false;
+        size_t klen = (size_t)(p - key);
+        int k = 0;
+        while (k < LIMIT_NKINDS && (strlen(limit_names[k]) != klen ||
+                                    strncmp(limit_names[k], key, klen) != 0))
+            k++;
+        if (k == LIMIT_NKINDS)
+            return false;
+        char val[64];
+        size_t vlen = strcspn(++p, " \t,");
+        if (vlen == 0 || vlen >= sizeof(val))
+            return false;
+        memcpy(val, p, vlen);
+        val[vlen] = '\0';
+        p += vlen;
+        if (strcmp(val, "none") == 0) {
+            out.v[k] = 0;
+            continue;
+        }
+        if (k == LIMIT_CPU) {
+            unsigned long ms;
+            if (!parse_duration_ms(val, &ms))
+                return false;
+            out.v[k] = (ms + 999) / 1000;
+            continue;
+        }
+        if (!isdigit((unsigned char)val[0]))
+            return false;
+        errno = 0;
+        char *end = NULL;
+        unsigned long long v = strtoull(val, &end, 10);
+        unsigned shift = 0;
+        if (k != LIMIT_NPROC && *end) {
+            const char *units = "KMGT";
+            const char *u = strchr(units, toupper((unsigned char)*end));
+            if (u) {
+                shift = 10 * (unsigned)(u - units + 1);
+                end++;
+            }
+        }
+        if (errno || *end || (shift && v > (ULLONG_MAX >> shift)))
+            return false;
+        out.v[k] = v << shift;
+    }
+    *lim = out;
+    return true;
+}
+
+static const char *
+format_limit(char *buf, size_t cap, limit_kind k, unsigned long long v)
+{
+    static const char *const units[] = { "bytes", "KiB", "MiB", "GiB", "TiB" };
+    if (k == LIMIT_CPU) {
+        snprintf(buf, cap, "%llu s", v);
+    } else if (k == LIMIT_NPROC) {
+        snprintf(buf, cap, "%llu processes", v);
+    } else {
+        size_t u = 0;
+        while (u + 1 < sizeof(units) / sizeof(units[0]) && v >= 1024 &&
+               v % 1024 == 0) {
+            v /= 1024;
+            u++;
+        }
+        snprintf(buf, cap, "%llu %s", v, units[u]);
+    }
+    return buf;
+}
 
 static void
 mapkv_put(mapkv *m, const char *key, const char *val)
@@ -344,6 +890,105 @@ has_feature(vecstr *features, const char *name)
     return false;
 }
 
+/* lit-style feature expressions: identifiers, true, false, !, &&, || and
+ * parentheses.  Features are fixed for the whole run, so each distinct
+ * expression is evaluated once and the result remembered. */
+typedef struct {
+    const char *p;
+    vecstr *features;
+    bool bad;
+} feature_expr;
+static strmap feature_expr_cache = {0};
+
+static bool feature_expr_or(feature_expr *x);
+
+static void
+feature_expr_skip(feature_expr *x)
+{
+    while (isspace((unsigned char)*x->p))
+        x->p++;
+}
+
+static bool
+feature_expr_atom(feature_expr *x)
+{
+    feature_expr_skip(x);
+    if (*x->p == '!') {
+        x->p++;
+        return !feature_expr_atom(x);
+    }
+    if (*x->p == '(') {
+        x->p++;
+        bool v = feature_expr_or(x);
+        feature_expr_skip(x);
+        if (*x->p == ')')
+            x->p++;
+        else
+            x->bad = true;
+        return v;
+    }
+    /* a name is anything up to an operator, parenthesis, comma or space */
+    const char *start = x->p;
+    while (*x->p && !isspace((unsigned char)*x->p) && !strchr("!&|(),", *x->p))
+        x->p++;
+    size_t len = (size_t)(x->p - start);
+    if (len == 0) {
+        x->bad = true;
+        return false;
+    }
+    if (len == 4 && memcmp(start, "true", 4) == 0)
+        return true;
+    if (len == 5 && memcmp(start, "false", 5) == 0)
+        return false;
+    char *name = xmemdup(start, len);
+    bool v = has_feature(x->features, name);
+    free(name);
+    return v;
+}
+
+static bool
+feature_expr_and(feature_expr *x)
+{
+    bool v = feature_expr_atom(x);
+    for (;;) {
+        feature_expr_skip(x);
+        if (x->p[0] != '&' || x->p[1] != '&')
+            return v;
+        x->p += 2;
+        bool rhs = feature_expr_atom(x);
+        v = v && rhs;
+    }
+}
+
+static bool
+feature_expr_or(feature_expr *x)
+{
+    bool v = feature_expr_and(x);
+    for (;;) {
+        feature_expr_skip(x);
+        if (x->p[0] != '|' || x->p[1] != '|')
+            return v;
+        x->p += 2;
+        bool rhs = feature_expr_and(x);
+        v = v || rhs;
+    }
+}
+
+/* Returns 1 when expr holds, 0 when it does not and -1 when it is malformed. */
+static int
+eval_feature_expr(const char *expr, vecstr *features)
+{
+    unsigned long *cached = strmap_get(&feature_expr_cache, expr);
+    if (cached)
+        return (int)*cached - 1;
+    feature_expr x = { .p = expr, .features = features };
+    bool v = feature_expr_or(&x);
+    feature_expr_skip(&x);
+    int r = (x.bad || *x.p) ? -1 : v;
+    *strmap_put(&feature_expr_cache, expr) = (unsigned long)(r + 1);
+    return r;
+}
+
 static char *
 ltrim(char *s)
 {
@@ -528,7 +1173,8 @@ pick_test_path(const char *path, const char *path_abs,
     path_dirname(out, dir_out, dir_cap);
     return out;
 }
-static void
+/* Returns false when the %b path would not fit in cap. */
+static bool
 map_source_to_bin(const char *src, char *out, size_t cap)
 {
     char noext[PATH_MAX];
@@ -550,15 +1196,15 @@ map_source_to_bin(const char *src, char *out, size_t cap)
     bool need_slash = nroot && root[nroot - 1] != '/';
     size_t nrel = strlen(rel);
     size_t needed = nroot + (need_slash ? 1 : 0) + nrel + 1;
-    if (cap == 0 || needed > cap) {
-        die("output path too long: %s", src);
-    }
+    if (cap == 0 || needed > cap)
+        return false;
     char *p = out;
     memcpy(p, root, nroot);
     p += nroot;
     if (need_slash)
         *p++ = '/';
     memcpy(p, rel, nrel + 1);
+    return true;
 }
 
 static bool
@@ -638,779 +1284,6636 @@ parse_config(const char *path, mapkv *subs, vecstr *config_args)
     fclose(f);
 }
 
+static bool
+state_path(char *out, size_t cap, const char *leaf)
+{
+    if (!state_dir)
+        return false;
+    return build_temp_path(out, cap, state_dir, leaf);
+}
+
+/* Durations of earlier runs live in STATE/times, one "MILLISECONDS PATH"
+ * line per test, keyed by the resolved test path. */
 static void
-parse_env_options(vecstr *out, const char *env)
+load_test_times(void)
 {
-    if (!env || !*env)
+    char path[PATH_MAX];
+    if (!state_path(path, sizeof(path), "times"))
         return;
-    char tok[8192];
-    size_t len = 0;
-    char quote = 0;
-    for (const char *p = env;; p++) {
-        char c = *p;
-        if (c == '\0') {
-            if (quote)
-                die("unterminated quote in TIKL_OPTIONS");
-            if (len) {
-                tok[len] = '\0';
-                vecstr_push(out, tok);
-            }
-            break;
-        }
-        if (quote == 0) {
-            if (isspace((unsigned char)c)) {
-                if (len) {
-                    tok[len] = '\0';
-                    vecstr_push(out, tok);
-                    len = 0;
-                }
-                continue;
-            }
-            if (c == '\'' || c == '"') {
-                quote = c;
-                continue;
-            }
-            if (c == '\\' && p[1] != '\0') {
-                c = *++p;
-            }
-        } else {
-            if (c == quote) {
-                quote = 0;
-                continue;
-            }
-            if (quote == '"' && c == '\\' && p[1] != '\0') {
-                c = *++p;
-            }
-        }
-        if (len + 1 >= sizeof(tok))
-            die("TIKL_OPTIONS token too long");
-        tok[len++] = c;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return;
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, f) != -1) {
+        rtrim_inplace(line);
+        errno = 0;
+        char *end = NULL;
+        unsigned long ms = strtoul(line, &end, 10);
+        if (errno || end == line || *end != ' ' || end[1] != '/')
+            continue;
+        *strmap_put(&test_times, end + 1) = ms;
     }
+    free(line);
+    fclose(f);
 }
 
-static char *
-apply_config_substitutions(const char *input, mapkv *subs)
+static bool
+lookup_test_time(const char *test, unsigned long *ms)
 {
-    char *current = xstrdup(input);
-    for (int pass = 0; pass < 8; pass++) {
-        int status = 0;
-        char *next = tikl_expand_placeholders(current, true, false,
-                                              lookup_mapkv_cb, subs,
-                                              "tikl", &status);
-        if (status != 0) {
-            free(current);
-            free(next);
-            die("invalid placeholder in configuration");
-        }
-        if (!next)
-            return current;
-        bool changed = strcmp(current, next) != 0;
-        free(current);
-        current = next;
-        if (!changed)
-            break;
+    char abs_path[PATH_MAX];
+    if (test_times.n == 0 ||
+        !resolve_test_path(test, abs_path, sizeof(abs_path)))
+        return false;
+    unsigned long *v = strmap_get(&test_times, abs_path);
+    if (!v)
+        return false;
+    *ms = *v;
+    return true;
+}
+
+static void
+record_test_time(const char *test, unsigned long ms)
+{
+    char abs_path[PATH_MAX];
+    if (!state_dir || !resolve_test_path(test, abs_path, sizeof(abs_path)))
+        return;
+    if (strchr(abs_path, '\n'))
+        return;
+    *strmap_put(&test_times, abs_path) = ms;
+    test_times_dirty = true;
+}
+
+static void
+save_test_times(int verbosity)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    if (!test_times_dirty || !state_path(path, sizeof(path), "times"))
+        return;
+    if (snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path,
+                 (long)getpid()) >= (int)sizeof(tmp))
+        return;
+    ensure_dir(state_dir);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        if (verbosity >= 1)
+            fprintf(stderr, "tikl: cannot write %s: %s\n", tmp, strerror(errno));
+        return;
+    }
+    for (size_t i = 0; i < test_times.cap; i++) {
+        if (test_times.v[i].key)
+            fprintf(f, "%lu %s\n", test_times.v[i].val, test_times.v[i].key);
+    }
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        if (verbosity >= 1)
+            fprintf(stderr, "tikl: cannot write %s: %s\n", path, strerror(errno));
+        unlink(tmp);
     }
-    return current;
 }
 
-static char *
-perform_substitutions(const char *cmd_in, mapkv *subs,
-                      const char *testpath,
-                      const char *testpath_abs,
-                      const char *shared_tfile,
-                      const char *shared_T)
+static void
+result_reset(test_result *res)
 {
-    char s_path[PATH_MAX];
-    char s_dir[PATH_MAX];
-    const char *path_for_s = pick_test_path(testpath, testpath_abs,
-                                            s_path, sizeof(s_path),
-                                            s_dir, sizeof(s_dir));
-    char bmap[PATH_MAX];
-    map_source_to_bin(path_for_s, bmap, sizeof(bmap));
-    char bdir[PATH_MAX];
-    path_dirname(bmap, bdir, sizeof(bdir));
-    ensure_dir(bdir);
+    free(res->step_ms);
+    free(res->skip_reason);
+    free(res->step_usage);
+    memset(res, 0, sizeof(*res));
+}
 
-    char *cmd = apply_config_substitutions(cmd_in, subs);
+static void
+usage_merge(resource_usage *dst, const resource_usage *src)
+{
+    dst->user_ms += src->user_ms;
+    dst->sys_ms += src->sys_ms;
+    if (src->maxrss_kb > dst->maxrss_kb)
+        dst->maxrss_kb = src->maxrss_kb;
+    dst->nvcsw += src->nvcsw;
+    dst->nivcsw += src->nivcsw;
+    dst->minflt += src->minflt;
+    dst->majflt += src->majflt;
+}
 
-    const char *scratch_for_T = shared_T ? shared_T : ((scratch_root &&
-                                *scratch_root) ? scratch_root :
-                                default_scratch_root);
+#ifndef TIKL_FUZZ
+static void
+usage_add_rusage(resource_usage *u, const struct rusage *ru)
+{
+    u->user_ms += (unsigned long)ru->ru_utime.tv_sec * 1000 +
+                  (unsigned long)ru->ru_utime.tv_usec / 1000;
+    u->sys_ms += (unsigned long)ru->ru_stime.tv_sec * 1000 +
+                 (unsigned long)ru->ru_stime.tv_usec / 1000;
+#ifdef __APPLE__
+    unsigned long rss = (unsigned long)ru->ru_maxrss / 1024;
+#else
+    unsigned long rss = (unsigned long)ru->ru_maxrss;
+#endif
+    if (rss > u->maxrss_kb)
+        u->maxrss_kb = rss;
+    u->nvcsw += (unsigned long)ru->ru_nvcsw;
+    u->nivcsw += (unsigned long)ru->ru_nivcsw;
+    u->minflt += (unsigned long)ru->ru_minflt;
+    u->majflt += (unsigned long)ru->ru_majflt;
+}
 
-    builtin_substs builtins = {
-        .s = path_for_s,
-        .S = s_dir,
-        .t = shared_tfile,
-        .T = scratch_for_T,
-        .b = bmap,
-        .B = bdir,
-    };
+static void
+report_step_usage(const resource_usage *u)
+{
+    fprintf(stderr, "    usage: user %lu ms, sys %lu ms, max rss %lu KiB, "
+            "csw %lu vol %lu invol, faults %lu minor %lu major\n",
+            u->user_ms, u->sys_ms, u->maxrss_kb, u->nvcsw, u->nivcsw,
+            u->minflt, u->majflt);
+}
+#endif
 
-    int status = 0;
-    char *expanded = tikl_expand_placeholders(cmd, true, true,
-                     lookup_builtin_cb, &builtins,
-                     "tikl", &status);
-    free(cmd);
-    if (status != 0) {
-        free(expanded);
-        die("invalid placeholder expansion");
+static bool
+parse_test_status(const char *name, test_status *out)
+{
+    for (int i = 0; i < TEST_NSTATUS; i++) {
+        if (strcmp(test_status_names[i], name) == 0) {
+            *out = (test_status)i;
+            return true;
+        }
     }
-    return expanded;
+    return false;
 }
 
+/* Every finished test appends one line to STATE/history:
+ *
+ *   TIME STATUS TOTAL_MS FAILED_STEP EXIT RETRIES STEP_MS[,STEP_MS...] PATH
+ *
+ * fields separated by tabs, PATH last.  The file is opened O_APPEND once
+ * before workers fork and each record goes out in a single write(), so
+ * parallel workers never interleave partial lines. */
+static int history_fd = -1;
+
 static void
-push_sub_line(vecstr *lines, const char *key, const char *val)
+open_history(void)
 {
-    size_t nk = strlen(key);
-    size_t nv = strlen(val);
-    char *buf = malloc(nk + 1 + nv + 1);
-    if (!buf)
-        die("OOM");
-    memcpy(buf, key, nk);
-    buf[nk] = '=';
-    memcpy(buf + nk + 1, val, nv + 1);
-    vecstr_push(lines, buf);
-    free(buf);
+    char path[PATH_MAX];
+    if (!state_path(path, sizeof(path), "history"))
+        return;
+    ensure_dir(state_dir);
+    history_fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (history_fd >= 0)
+        fcntl(history_fd, F_SETFD, FD_CLOEXEC);
 }
 
-static char *
-expand_for_check_value(const char *input, mapkv *subs,
-                       const char *path_for_s,
-                       const char *s_dir,
-                       const char *bmap,
-                       const char *bdir)
+/* Appends STATUS TOTAL_MS FAILED_STEP EXIT RETRIES STEP_MS[,STEP_MS...],
+ * tab separated, as history records and -j workers carry them. */
+static void
+format_result_fields(strbuf *sb, const test_result *res)
 {
-    char *cmd = apply_config_substitutions(input, subs);
-    builtin_substs builtins = {
-        .s = path_for_s,
-        .S = s_dir,
-        .b = bmap,
-        .B = bdir,
-    };
-    int status = 0;
-    char *out = tikl_expand_placeholders(cmd, true, true,
-                                         lookup_builtin_cb, &builtins,
-                                         "tikl", &status);
-    free(cmd);
-    if (status != 0) {
-        free(out);
-        die("invalid placeholder in configuration");
+    char num[96];
+    int n = snprintf(num, sizeof(num), "%s\t%lu\t%zu\t%d\t%u\t",
+                     test_status_names[res->status], res->total_ms,
+                     res->failed_step, res->exit_code, res->retries);
+    strbuf_append(sb, num, (size_t)n);
+    for (size_t i = 0; i < res->nsteps; i++) {
+        n = snprintf(num, sizeof(num), "%s%lu", i ? "," : "", res->step_ms[i]);
+        strbuf_append(sb, num, (size_t)n);
     }
-    return out;
+    if (res->nsteps == 0)
+        strbuf_append(sb, "-", 1);
 }
 
-static char *
-build_check_subs_blob(mapkv *subs, const char *testpath,
-                      const char *testpath_abs)
+static void
+history_append(const char *test, const test_result *res)
 {
-    char s_path[PATH_MAX];
-    char s_dir[PATH_MAX];
-    const char *path_for_s = pick_test_path(testpath, testpath_abs,
-                                            s_path, sizeof(s_path),
-                                            s_dir, sizeof(s_dir));
-    char bmap[PATH_MAX];
-    map_source_to_bin(path_for_s, bmap, sizeof(bmap));
-    char bdir[PATH_MAX];
-    path_dirname(bmap, bdir, sizeof(bdir));
-    ensure_dir(bdir);
+    char abs_path[PATH_MAX];
+    if (history_fd < 0 || !resolve_test_path(test, abs_path, sizeof(abs_path)) ||
+        strchr(abs_path, '\n'))
+        return;
+    strbuf line = {0};
+    char stamp[32];
+    int n = snprintf(stamp, sizeof(stamp), "%lld\t", (long long)time(NULL));
+    strbuf_append(&line, stamp, (size_t)n);
+    format_result_fields(&line, res);
+    strbuf_append(&line, "\t", 1);
+    strbuf_append(&line, abs_path, strlen(abs_path));
+    strbuf_append(&line, "\n", 1);
+    ssize_t w = write(history_fd, line.v, line.n);
+    (void)w;
+    free(line.v);
+}
 
-    vecstr lines = {0};
-    push_sub_line(&lines, "s", path_for_s);
-    push_sub_line(&lines, "S", s_dir);
-    push_sub_line(&lines, "b", bmap);
-    push_sub_line(&lines, "B", bdir);
+/* -j workers send their report and result back through unlinked
+ * temporary files the parent reads once the worker has exited. */
+static int
+open_report_file(void)
+{
+    FILE *f = tmpfile();
+    if (!f)
+        return -1;
+    int fd = dup(fileno(f));
+    fclose(f);
+    if (fd >= 0)
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
 
-    for (size_t i = 0; i < subs->n; i++) {
-        const char *key = subs->v[i].key;
-        if (strcmp(key, "s") == 0 || strcmp(key, "S") == 0 ||
-            strcmp(key, "b") == 0 || strcmp(key, "B") == 0) {
-            continue;
+/* Reads back and closes a worker's report file. */
+static void
+read_report_file(int fd, char **text, size_t *len)
+{
+    strbuf sb = {0};
+    char buf[65536];
+    if (lseek(fd, 0, SEEK_SET) == 0) {
+        ssize_t r;
+        while ((r = read(fd, buf, sizeof(buf))) != 0) {
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            strbuf_append(&sb, buf, (size_t)r);
         }
-        char *expanded = expand_for_check_value(subs->v[i].val, subs,
-                                                path_for_s, s_dir, bmap, bdir);
-        push_sub_line(&lines, key, expanded);
-        free(expanded);
     }
+    close(fd);
+    *text = sb.v;
+    *len = sb.n;
+}
 
-    if (lines.n == 0) {
-        vecstr_free(&lines);
-        return NULL;
-    }
+static void
+format_usage(strbuf *sb, const resource_usage *u)
+{
+    strbuf_printf(sb, "%lu,%lu,%lu,%lu,%lu,%lu,%lu", u->user_ms, u->sys_ms,
+                  u->maxrss_kb, u->nvcsw, u->nivcsw, u->minflt, u->majflt);
+}
 
-    size_t total = 0;
-    for (size_t i = 0; i < lines.n; i++)
-        total += strlen(lines.v[i]) + 1;
-    char *blob = malloc(total);
-    if (!blob)
-        die("OOM");
-    size_t off = 0;
-    for (size_t i = 0; i < lines.n; i++) {
-        size_t len = strlen(lines.v[i]);
-        if (i > 0)
-            blob[off++] = '\n';
-        memcpy(blob + off, lines.v[i], len);
-        off += len;
+static const char *
+parse_usage(const char *s, resource_usage *u)
+{
+    unsigned long *f[] = {
+        &u->user_ms, &u->sys_ms, &u->maxrss_kb, &u->nvcsw, &u->nivcsw,
+        &u->minflt, &u->majflt,
+    };
+    char *end = (char *)s;
+    for (size_t i = 0; i < sizeof(f) / sizeof(f[0]); i++) {
+        *f[i] = strtoul(s, &end, 10);
+        s = *end == ',' ? end + 1 : end;
     }
-    blob[off] = '\0';
-    vecstr_free(&lines);
-    return blob;
+    return end;
 }
 
-static int
-run_shell(const char *cmd, int verbosity, bool *timed_out)
+/* A -j worker hands its test_result to the parent as one line of
+ * format_result_fields(), the test's and then each step's resource usage
+ * separated by ';', the skip reason and the limit a LIMIT test hit, joined
+ * by tabs.  It goes at the end of the worker's report file, after the
+ * test's output, and a last line gives the offset it starts at, so one
+ * file per worker carries both. */
+#define RESULT_TRAILER_LEN 17
+static void
+write_worker_result(int fd, const test_result *res)
 {
-#ifdef TIKL_FUZZ
-    (void)cmd;
-    (void)verbosity;
-    if (timed_out)
-        *timed_out = false;
-    return 0;
-#else
-    if (abort_requested) {
-        if (timed_out)
-            *timed_out = false;
-        return 128 + abort_requested;
-    }
-    if (timed_out)
-        *timed_out = false;
-    const char *script = cmd;
-    char *wrapped = NULL;
-    if (!lit_compat && run_shell_has_pipefail) {
-        const char *pipefail_prelude = "set -o pipefail 2>/dev/null || :; ";
-        size_t want = strlen(pipefail_prelude) + strlen(cmd) + 1;
-        wrapped = malloc(want);
-        if (!wrapped)
-            return 127;
-        snprintf(wrapped, want, "%s%s", pipefail_prelude, cmd);
-        script = wrapped;
-    }
-    if (verbosity >= 1) {
-        fputs("    $ ", stderr);
-        fputs(cmd, stderr);
-        fputc('\n', stderr);
-    }
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("fork");
-        free(wrapped);
-        return 127;
+    off_t at = lseek(fd, 0, SEEK_END);
+    if (at < 0)
+        return;
+    strbuf line = {0};
+    format_result_fields(&line, res);
+    strbuf_append(&line, "\t", 1);
+    format_usage(&line, &res->usage);
+    for (size_t i = 0; i < res->nsteps; i++) {
+        strbuf_append(&line, ";", 1);
+        format_usage(&line, &res->step_usage[i]);
     }
-    if (pid == 0) {
-        int devnull_in = open("/dev/null", O_RDONLY);
-        if (devnull_in >= 0) {
-            dup2(devnull_in, STDIN_FILENO);
-            if (devnull_in > STDERR_FILENO)
-                close(devnull_in);
+    strbuf_append(&line, "\t", 1);
+    if (res->skip_reason)
+        strbuf_append(&line, res->skip_reason, strlen(res->skip_reason));
+    strbuf_append(&line, "\t", 1);
+    if (res->status == TEST_LIMIT)
+        strbuf_puts(&line, limit_names[res->limit]);
+    strbuf_printf(&line, "\n%016llx\n", (unsigned long long)at);
+    write_all(fd, line.v, line.n);
+    free(line.v);
+}
+
+static bool
+parse_worker_result(char *line, size_t len, test_result *res)
+{
+    result_reset(res);
+    char *field[9];
+    char *p = line;
+    bool ok = len > 0 && line[len - 1] == '\n';
+    if (ok)
+        line[len - 1] = '\0';
+    for (int i = 0; ok && i < 9; i++) {
+        field[i] = p;
+        char *tab = i < 8 ? strchr(p, '\t') : p;
+        if (!tab)
+            ok = false;
+        else if (i < 8) {
+            *tab = '\0';
+            p = tab + 1;
         }
-        bool suppress_output = verbosity < 2 && strstr(script, "tikl-check") == NULL;
-        if (suppress_output) {
-            int devnull = open("/dev/null", O_RDWR);
-            if (devnull >= 0) {
-                dup2(devnull, STDOUT_FILENO);
-                dup2(devnull, STDERR_FILENO);
-                if (devnull > STDERR_FILENO)
-                    close(devnull);
-            }
+    }
+    if (ok)
+        ok = parse_test_status(field[0], &res->status);
+    if (ok) {
+        res->total_ms = strtoul(field[1], NULL, 10);
+        res->failed_step = strtoul(field[2], NULL, 10);
+        res->exit_code = atoi(field[3]);
+        res->retries = (unsigned)strtoul(field[4], NULL, 10);
+        for (char *q = field[5]; strcmp(field[5], "-") != 0 && *q;) {
+            char *end = NULL;
+            unsigned long v = strtoul(q, &end, 10);
+            if (end == q)
+                break;
+            res->step_ms = xrealloc(res->step_ms,
+                                    (res->nsteps + 1) * sizeof(*res->step_ms));
+            res->step_ms[res->nsteps++] = v;
+            q = *end ? end + 1 : end;
         }
-        execl(run_shell_path, run_shell_path, "-c", script, (char*)0);
-        _exit(127);
+        res->step_usage = xrealloc(NULL, (res->nsteps + 1) *
+                                   sizeof(*res->step_usage));
+        memset(res->step_usage, 0, (res->nsteps + 1) * sizeof(*res->step_usage));
+        const char *u = parse_usage(field[6], &res->usage);
+        for (size_t i = 0; i < res->nsteps && *u == ';'; i++)
+            u = parse_usage(u + 1, &res->step_usage[i]);
+        if (*field[7])
+            res->skip_reason = xstrdup(field[7]);
+        for (int k = 0; k < LIMIT_NKINDS; k++)
+            if (strcmp(field[8], limit_names[k]) == 0)
+                res->limit = (limit_kind)k;
     }
-    int st = 0;
+    return ok;
+}
 
-    if (timeout_secs == 0) {
-        while (waitpid(pid, &st, 0) < 0) {
-            if (errno == EINTR) {
-                if (abort_requested) {
-                    kill(pid, SIGTERM);
+/* Reads back and closes a worker's report file: the test's output goes to
+ * text/len and the result to res.  Returns false, leaving the whole file in
+ * text, when the worker died before writing a result. */
+static bool
+read_worker_report(int fd, char **text, size_t *len, test_result *res)
+{
+    read_report_file(fd, text, len);
+    result_reset(res);
+    size_t n = *len;
+    if (n < RESULT_TRAILER_LEN || (*text)[n - 1] != '\n')
+        return false;
+    const char *trailer = *text + n - RESULT_TRAILER_LEN;
+    char *end = NULL;
+    unsigned long long at = strtoull(trailer, &end, 16);
+    if (end != *text + n - 1 || at > n - RESULT_TRAILER_LEN)
+        return false;
+    size_t line_len = n - RESULT_TRAILER_LEN - (size_t)at;
+    char *line = xrealloc(NULL, line_len + 1);
+    memcpy(line, *text + at, line_len);
+    line[line_len] = '\0';
+    bool ok = parse_worker_result(line, line_len, res);
+    free(line);
+    if (ok)
+        *len = (size_t)at;
+    return ok;
+}
+
+/* --report-json and --report-junit.  The parent writes one record per
+ * finished test as soon as it is known, so an interrupted run still leaves
+ * every result up to that point; the JUnit file only lacks its closing
+ * tags then. */
+static int report_json_fd = -1;
+static int report_junit_fd = -1;
+
+static int
+open_report(const char *path)
+{
+    if (!path || !*path)
+        return -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        fprintf(stderr, "tikl: cannot write %s: %s\n", path, strerror(errno));
+    return fd;
+}
+
+static void
+append_json_string(strbuf *sb, const char *s)
+{
+    strbuf_puts(sb, "\"");
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        char esc[8];
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = (char)c;
+            strbuf_append(sb, esc, 2);
+        } else if (c < 0x20) {
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            strbuf_append(sb, esc, 6);
+        } else {
+            strbuf_append(sb, s, 1);
+        }
+    }
+    strbuf_puts(sb, "\"");
+}
+
+static void
+append_xml_text(strbuf *sb, const char *s)
+{
+    for (; *s; s++) {
+        const char *ent = NULL;
+        switch (*s) {
+            case '&':
+                ent = "&amp;";
+                break;
+            case '<':
+                ent = "&lt;";
+                break;
+            case '>':
+                ent = "&gt;";
+                break;
+            case '"':
+                ent = "&quot;";
+                break;
+            default:
+                if ((unsigned char)*s < 0x20 && *s != '\t' && *s != '\n')
+                    ent = "?";
+                break;
+        }
+        if (ent)
+            strbuf_append(sb, ent, strlen(ent));
+        else
+            strbuf_append(sb, s, 1);
+    }
+}
+
+static void
+open_result_reports(const char *json_path, const char *junit_path)
+{
+    report_json_fd = open_report(json_path);
+    report_junit_fd = open_report(junit_path);
+    if (report_junit_fd >= 0) {
+        const char *head = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                           "<testsuites>\n<testsuite name=\"tikl\">\n";
+        write_all(report_junit_fd, head, strlen(head));
+    }
+}
+
+static void
+append_json_usage(strbuf *sb, const resource_usage *u)
+{
+    strbuf_printf(sb, "{\"user_ms\":%lu,\"sys_ms\":%lu,\"maxrss_kb\":%lu,"
+                  "\"nvcsw\":%lu,\"nivcsw\":%lu,\"minflt\":%lu,"
+                  "\"majflt\":%lu}", u->user_ms, u->sys_ms, u->maxrss_kb,
+                  u->nvcsw, u->nivcsw, u->minflt, u->majflt);
+}
+
+static void
+report_json_result(const char *test, const test_result *res)
+{
+    strbuf sb = {0};
+    strbuf_puts(&sb, "{\"test\":");
+    append_json_string(&sb, test);
+    strbuf_printf(&sb, ",\"status\":\"%s\",\"failed_step\":%zu,\"exit_code\":%d,"
+                  "\"retries\":%u,\"time_ms\":%lu,\"step_ms\":[",
+                  test_status_names[res->status], res->failed_step,
+                  res->exit_code, res->retries, res->total_ms);
+    for (size_t i = 0; i < res->nsteps; i++)
+        strbuf_printf(&sb, "%s%lu", i ? "," : "", res->step_ms[i]);
+    strbuf_puts(&sb, "],\"usage\":");
+    append_json_usage(&sb, &res->usage);
+    strbuf_puts(&sb, ",\"step_usage\":[");
+    for (size_t i = 0; i < res->nsteps; i++) {
+        if (i)
+            strbuf_puts(&sb, ",");
+        append_json_usage(&sb, &res->step_usage[i]);
+    }
+    strbuf_puts(&sb, "],\"skip_reason\":");
+    if (res->skip_reason)
+        append_json_string(&sb, res->skip_reason);
+    else
+        strbuf_puts(&sb, "null");
+    if (res->status == TEST_LIMIT)
+        strbuf_printf(&sb, ",\"limit\":\"%s\"", limit_names[res->limit]);
+    if (res->cached)
+        strbuf_puts(&sb, ",\"cached\":true");
+    strbuf_puts(&sb, "}\n");
+    write_all(report_json_fd, sb.v, sb.n);
+    free(sb.v);
+}
+
+/* Statuses map onto JUnit as: FAIL and XPASS are failures, TIME and LIMIT
+ * errors, SKIP and NORUN skipped, OK and XFAIL passes.  The tikl status, retries and
+ * step times travel as properties. */
+static void
+report_junit_result(const char *test, const test_result *res)
+{
+    strbuf sb = {0};
+    const char *slash = strrchr(test, '/');
+    strbuf_puts(&sb, "  <testcase classname=\"");
+    if (slash) {
+        char *dir = xstrdup(test);
+        dir[slash - test] = '\0';
+        append_xml_text(&sb, dir);
+        free(dir);
+    } else {
+        strbuf_puts(&sb, ".");
+    }
+    strbuf_puts(&sb, "\" name=\"");
+    append_xml_text(&sb, test);
+    strbuf_printf(&sb, "\" time=\"%lu.%03lu\">\n", res->total_ms / 1000,
+                  res->total_ms % 1000);
+    strbuf_printf(&sb, "    <properties>\n"
+                  "      <property name=\"status\" value=\"%s\"/>\n"
+                  "      <property name=\"retries\" value=\"%u\"/>\n",
+                  test_status_names[res->status], res->retries);
+    const resource_usage *u = &res->usage;
+    strbuf_printf(&sb, "      <property name=\"user_ms\" value=\"%lu\"/>\n"
+                  "      <property name=\"sys_ms\" value=\"%lu\"/>\n"
+                  "      <property name=\"maxrss_kb\" value=\"%lu\"/>\n",
+                  u->user_ms, u->sys_ms, u->maxrss_kb);
+    strbuf_printf(&sb, "      <property name=\"nvcsw\" value=\"%lu\"/>\n"
+                  "      <property name=\"nivcsw\" value=\"%lu\"/>\n"
+                  "      <property name=\"minflt\" value=\"%lu\"/>\n"
+                  "      <property name=\"majflt\" value=\"%lu\"/>\n",
+                  u->nvcsw, u->nivcsw, u->minflt, u->majflt);
+    for (size_t i = 0; i < res->nsteps; i++)
+        strbuf_printf(&sb, "      <property name=\"step%zu_ms\" value=\"%lu\"/>\n",
+                      i + 1, res->step_ms[i]);
+    strbuf_puts(&sb, "    </properties>\n");
+    switch (res->status) {
+        case TEST_FAIL:
+            if (res->failed_step == 0)
+                strbuf_printf(&sb, "    <failure message=\"exit %d\"/>\n",
+                              res->exit_code);
+            else
+                strbuf_printf(&sb, "    <failure message=\"step %zu exit %d\"/>\n",
+                              res->failed_step, res->exit_code);
+            break;
+        case TEST_XPASS:
+            strbuf_puts(&sb, "    <failure message=\"unexpected pass\"/>\n");
+            break;
+        case TEST_TIME:
+            strbuf_printf(&sb, "    <error type=\"timeout\" "
+                          "message=\"step %zu timed out\"/>\n", res->failed_step);
+            break;
+        case TEST_LIMIT:
+            strbuf_printf(&sb, "    <error type=\"limit\" "
+                          "message=\"step %zu exceeded the %s limit\"/>\n",
+                          res->failed_step, limit_names[res->limit]);
+            break;
+        case TEST_NORUN:
+            strbuf_puts(&sb, "    <skipped message=\"not run: "
+                        "--max-time reached\"/>\n");
+            break;
+        case TEST_SKIP:
+            strbuf_puts(&sb, "    <skipped message=\"");
+            append_xml_text(&sb, res->skip_reason ? res->skip_reason : "");
+            strbuf_puts(&sb, "\"/>\n");
+            break;
+        default:
+            break;
+    }
+    strbuf_puts(&sb, "  </testcase>\n");
+    write_all(report_junit_fd, sb.v, sb.n);
+    free(sb.v);
+}
+
+/* Statistics of the run, for the end-of-run summary and --metrics, which
+ * writes them in the Prometheus text format for node_exporter's textfile
+ * collector.  report_result() folds in every result the parent sees; the
+ * file is replaced by rename() at the end of the run and, with
+ * --metrics-interval, on that schedule while it goes. */
+static const unsigned long metrics_buckets_ms[] = {
+    5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000, 300000,
+};
+#define METRICS_NBUCKETS (sizeof(metrics_buckets_ms) / sizeof(metrics_buckets_ms[0]))
+typedef struct {
+    unsigned long count[METRICS_NBUCKETS + 1];
+    unsigned long long sum_ms;
+    unsigned long n;
+} metrics_histogram;
+/* One of the --time-tests slowest tests (step 0) or steps. */
+typedef struct {
+    char *test;
+    size_t step;
+    unsigned long ms;
+} slow_entry;
+typedef struct {
+    unsigned long tests[TEST_NSTATUS];
+    metrics_histogram test_ms, step_ms;
+    unsigned long retries;
+    unsigned long cached;
+    unsigned long long overhead_ms;
+    slow_entry *slow_tests, *slow_steps;
+    size_t nslow_tests, nslow_steps, slow_cap;
+} run_metrics;
+static const char *metrics_path = NULL;
+static unsigned long metrics_interval_ms = 0;
+static unsigned long long metrics_start, metrics_due;
+static run_metrics suite_metrics;
+
+static void
+metrics_observe(metrics_histogram *h, unsigned long ms)
+{
+    size_t i = 0;
+    while (i < METRICS_NBUCKETS && ms > metrics_buckets_ms[i])
+        i++;
+    h->count[i]++;
+    h->sum_ms += ms;
+    h->n++;
+}
+
+/* Keeps v, holding *n of at most cap entries, sorted slowest first. */
+static void
+slowest_insert(slow_entry *v, size_t *n, size_t cap, const char *test,
+               size_t step, unsigned long ms)
+{
+    if (cap == 0 || (*n == cap && v[cap - 1].ms >= ms))
+        return;
+    size_t i;
+    if (*n < cap) {
+        i = (*n)++;
+    } else {
+        i = cap - 1;
+        free(v[i].test);
+    }
+    for (; i > 0 && v[i - 1].ms < ms; i--)
+        v[i] = v[i - 1];
+    v[i] = (slow_entry) {
+        .test = xstrdup(test), .step = step, .ms = ms
+    };
+}
+
+static void
+metrics_record(const char *test, const test_result *res)
+{
+    run_metrics *m = &suite_metrics;
+    m->tests[res->status]++;
+    m->retries += res->retries;
+    if (res->cached)
+        m->cached++;
+    if (res->status == TEST_SKIP || res->status == TEST_NORUN || res->cached)
+        return;
+    metrics_observe(&m->test_ms, res->total_ms);
+    slowest_insert(m->slow_tests, &m->nslow_tests, m->slow_cap, test, 0,
+                   res->total_ms);
+    unsigned long steps_ms = 0;
+    for (size_t i = 0; i < res->nsteps; i++) {
+        metrics_observe(&m->step_ms, res->step_ms[i]);
+        slowest_insert(m->slow_steps, &m->nslow_steps, m->slow_cap, test,
+                       i + 1, res->step_ms[i]);
+        steps_ms += res->step_ms[i];
+    }
+    /* what the test took beyond its commands: loading, scratch setup,
+     * substitution and spawning */
+    if (res->total_ms > steps_ms)
+        m->overhead_ms += res->total_ms - steps_ms;
+}
+
+static void
+metrics_family(strbuf *sb, const char *name, const char *type,
+               const char *help)
+{
+    strbuf_printf(sb, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+format_metrics_histogram(strbuf *sb, const char *name, const char *help,
+                         const metrics_histogram *h)
+{
+    metrics_family(sb, name, "histogram", help);
+    unsigned long cum = 0;
+    for (size_t i = 0; i < METRICS_NBUCKETS; i++) {
+        cum += h->count[i];
+        strbuf_printf(sb, "%s_bucket{le=\"%g\"} %lu\n", name,
+                      (double)metrics_buckets_ms[i] / 1000.0, cum);
+    }
+    strbuf_printf(sb, "%s_bucket{le=\"+Inf\"} %lu\n", name, h->n);
+    strbuf_printf(sb, "%s_sum %.3f\n%s_count %lu\n", name,
+                  (double)h->sum_ms / 1000.0, name, h->n);
+}
+
+static void
+format_metrics(strbuf *sb, const run_metrics *m, unsigned long long elapsed_ms,
+               bool finished)
+{
+    metrics_family(sb, "tikl_tests_total", "counter",
+                   "Tests finished, by status.");
+    for (int i = 0; i < TEST_NSTATUS; i++)
+        strbuf_printf(sb, "tikl_tests_total{status=\"%s\"} %lu\n",
+                      test_status_names[i], m->tests[i]);
+    format_metrics_histogram(sb, "tikl_test_duration_seconds",
+                             "Wall time of each test that ran.", &m->test_ms);
+    format_metrics_histogram(sb, "tikl_step_duration_seconds",
+                             "Wall time of each RUN step.", &m->step_ms);
+    metrics_family(sb, "tikl_retries_total", "counter",
+                   "Step retries granted by ALLOW_RETRIES.");
+    strbuf_printf(sb, "tikl_retries_total %lu\n", m->retries);
+    metrics_family(sb, "tikl_cached_tests_total", "counter",
+                   "Tests reported OK from --cache without running.");
+    strbuf_printf(sb, "tikl_cached_tests_total %lu\n", m->cached);
+    metrics_family(sb, "tikl_timeouts_total", "counter",
+                   "Tests stopped by a timeout.");
+    strbuf_printf(sb, "tikl_timeouts_total %lu\n", m->tests[TEST_TIME]);
+    metrics_family(sb, "tikl_overhead_seconds_total", "counter",
+                   "Time tests spent outside their RUN commands.");
+    strbuf_printf(sb, "tikl_overhead_seconds_total %.3f\n",
+                  (double)m->overhead_ms / 1000.0);
+    metrics_family(sb, "tikl_run_duration_seconds", "gauge",
+                   "Wall time of the run so far.");
+    strbuf_printf(sb, "tikl_run_duration_seconds %.3f\n",
+                  (double)elapsed_ms / 1000.0);
+    metrics_family(sb, "tikl_run_finished", "gauge",
+                   "1 once the run is over.");
+    strbuf_printf(sb, "tikl_run_finished %d\n", finished ? 1 : 0);
+}
+
+/* Replaces the --metrics file: written beside it, then renamed over it, so
+ * the collector never reads half a file. */
+static void
+write_metrics(bool finished)
+{
+    if (!metrics_path)
+        return;
+    unsigned long long now = monotonic_ms();
+    metrics_due = metrics_interval_ms ? now + metrics_interval_ms : 0;
+    strbuf sb = {0};
+    format_metrics(&sb, &suite_metrics, now - metrics_start, finished);
+    char tmp[PATH_MAX];
+    int n = snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", metrics_path,
+                     (long)getpid());
+    int fd = n > 0 && (size_t)n < sizeof(tmp) ?
+             open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    if (fd < 0) {
+        fprintf(stderr, "tikl: cannot write %s: %s\n", metrics_path,
+                strerror(errno));
+        metrics_path = NULL;
+    } else {
+        write_all(fd, sb.v, sb.n);
+        close(fd);
+        if (rename(tmp, metrics_path) != 0) {
+            fprintf(stderr, "tikl: cannot write %s: %s\n", metrics_path,
+                    strerror(errno));
+            unlink(tmp);
+            metrics_path = NULL;
+        }
+    }
+    free(sb.v);
+}
+
+static void
+free_metrics(run_metrics *m)
+{
+    for (size_t i = 0; i < m->nslow_tests; i++)
+        free(m->slow_tests[i].test);
+    for (size_t i = 0; i < m->nslow_steps; i++)
+        free(m->slow_steps[i].test);
+    free(m->slow_tests);
+    free(m->slow_steps);
+    memset(m, 0, sizeof(*m));
+}
+
+/* Starts the run's statistics, keeping the slowest tests and steps when
+ * slowest is nonzero. */
+static void
+open_metrics(const char *path, unsigned slowest)
+{
+    free_metrics(&suite_metrics);
+    if (slowest) {
+        suite_metrics.slow_cap = slowest;
+        suite_metrics.slow_tests = xrealloc(NULL, slowest * sizeof(slow_entry));
+        suite_metrics.slow_steps = xrealloc(NULL, slowest * sizeof(slow_entry));
+    }
+    metrics_path = path && *path ? path : NULL;
+    metrics_start = monotonic_ms();
+    metrics_due = metrics_interval_ms ? metrics_start + metrics_interval_ms : 0;
+}
+
+/* Writes the --metrics-interval snapshot once it is due. */
+static void
+metrics_tick(void)
+{
+    if (metrics_path && metrics_due && monotonic_ms() >= metrics_due)
+        write_metrics(false);
+}
+
+/* Milliseconds until the next snapshot, or -1 when none is scheduled. */
+static int
+metrics_wait_ms(void)
+{
+    if (!metrics_path || !metrics_due)
+        return -1;
+    unsigned long long now = monotonic_ms();
+    unsigned long long left = metrics_due > now ? metrics_due - now : 0;
+    return left > INT_MAX ? INT_MAX : (int)left;
+}
+
+static void
+print_slowest(const char *title, const slow_entry *v, size_t n)
+{
+    if (n == 0)
+        return;
+    fprintf(stderr, "%s:\n", title);
+    for (size_t i = 0; i < n; i++) {
+        char d[32];
+        fprintf(stderr, "%10s  %s", format_duration(d, sizeof(d), v[i].ms),
+                v[i].test);
+        if (v[i].step)
+            fprintf(stderr, " (step %zu)", v[i].step);
+        fputc('\n', stderr);
+    }
+}
+
+/* The end-of-run summary: the --time-tests lists, the status counts and,
+ * for -j, how well the run kept its slots busy. */
+static void
+report_summary(unsigned jobs)
+{
+    const run_metrics *m = &suite_metrics;
+    print_slowest("Slowest tests", m->slow_tests, m->nslow_tests);
+    print_slowest("Slowest steps", m->slow_steps, m->nslow_steps);
+    unsigned long total = 0;
+    for (int i = 0; i < TEST_NSTATUS; i++)
+        total += m->tests[i];
+    unsigned long long wall_ms = monotonic_ms() - metrics_start;
+    char wall[32];
+    fprintf(stderr, "Summary: %lu test%s in %s", total, total == 1 ? "" : "s",
+            format_duration(wall, sizeof(wall), (unsigned long)wall_ms));
+    const char *sep = " (";
+    for (int i = 0; i < TEST_NSTATUS; i++) {
+        if (m->tests[i] == 0)
+            continue;
+        fprintf(stderr, "%s%s %lu", sep, test_status_names[i], m->tests[i]);
+        sep = ", ";
+    }
+    if (m->cached)
+        fprintf(stderr, "; %lu cached", m->cached);
+    fputs(total ? ")\n" : "\n", stderr);
+    /* efficiency counts the slots the run could fill at all */
+    unsigned slots = jobs;
+    if (m->test_ms.n < slots)
+        slots = (unsigned)m->test_ms.n;
+    if (slots > 1 && wall_ms > 0) {
+        char busy[32];
+        double speedup = (double)m->test_ms.sum_ms / (double)wall_ms;
+        fprintf(stderr, "Test time: %s over %u jobs, %.2fx speedup, "
+                "%.0f%% parallel efficiency\n",
+                format_duration(busy, sizeof(busy),
+                                (unsigned long)m->test_ms.sum_ms),
+                jobs, speedup, 100.0 * speedup / slots);
+    }
+}
+
+static void
+close_metrics(void)
+{
+    write_metrics(true);
+    metrics_path = NULL;
+}
+
+/* --progress: one line of done/total, running, failed and an ETA, redrawn
+ * in place on a terminal and printed every PROGRESS_PLAIN_MS otherwise.
+ * The runners feed it the durations their schedulers already looked up,
+ * and drawing is rate-limited, so it adds no per-test system calls of its
+ * own.  Until discovery ends the total is a lower bound, shown with '+'. */
+enum {
+    PROGRESS_TTY_MS = 100,
+    PROGRESS_PLAIN_MS = 10000,
+};
+typedef struct {
+    bool on, tty, shown;
+    bool source_done;
+    unsigned jobs;
+    unsigned long discovered, done, running, failed, timed;
+    unsigned long pending_unknown;
+    unsigned long long pending_ms;      /* recorded durations not started */
+    unsigned long long running_end;     /* sum of expected end times */
+    unsigned long long done_ms;         /* actual durations, for the mean */
+    unsigned long long drawn;
+} progress_state;
+static progress_state progress;
+
+static void
+open_progress(bool on, unsigned jobs)
+{
+    memset(&progress, 0, sizeof(progress));
+    progress.on = on;
+    progress.tty = on && isatty(STDERR_FILENO);
+    progress.jobs = jobs;
+}
+
+static void
+progress_discovered(bool known, unsigned long ms)
+{
+    if (!progress.on)
+        return;
+    progress.discovered++;
+    if (known)
+        progress.pending_ms += ms;
+    else
+        progress.pending_unknown++;
+}
+
+static void
+progress_source_done(void)
+{
+    progress.source_done = true;
+}
+
+static unsigned long
+progress_mean_ms(void)
+{
+    return progress.timed ? (unsigned long)(progress.done_ms / progress.timed) : 0;
+}
+
+/* Returns when the test is expected to end, for progress_finished(). */
+static unsigned long long
+progress_started(bool known, unsigned long ms)
+{
+    if (!progress.on)
+        return 0;
+    if (known) {
+        progress.pending_ms -= ms < progress.pending_ms ? ms : progress.pending_ms;
+    } else {
+        if (progress.pending_unknown)
+            progress.pending_unknown--;
+        ms = progress_mean_ms();
+    }
+    progress.running++;
+    unsigned long long end = monotonic_ms() + ms;
+    progress.running_end += end;
+    return end;
+}
+
+static bool
+progress_failure(test_status status)
+{
+    return status == TEST_FAIL || status == TEST_XPASS || status == TEST_TIME ||
+           status == TEST_LIMIT;
+}
+
+static void
+progress_finished(unsigned long long expected_end, test_status status,
+                  unsigned long ms)
+{
+    if (!progress.on)
+        return;
+    if (progress.running)
+        progress.running--;
+    progress.running_end -= expected_end < progress.running_end ?
+                            expected_end : progress.running_end;
+    progress.done++;
+    if (status != TEST_SKIP) {
+        progress.timed++;
+        progress.done_ms += ms;
+    }
+    if (progress_failure(status))
+        progress.failed++;
+}
+
+/* A test the -j parent settled without starting it, e.g. a skipped one. */
+static void
+progress_settled(test_status status)
+{
+    if (!progress.on)
+        return;
+    progress.discovered++;
+    progress.done++;
+    if (progress_failure(status))
+        progress.failed++;
+}
+
+/* Erases the terminal line before other output goes to stderr. */
+static void
+progress_clear(void)
+{
+    if (!progress.shown)
+        return;
+    write_all(STDERR_FILENO, "\r\033[K", 4);
+    progress.shown = false;
+}
+
+static void
+progress_draw(bool force)
+{
+    if (!progress.on)
+        return;
+    unsigned long long now = monotonic_ms();
+    unsigned long every = progress.tty ? PROGRESS_TTY_MS : PROGRESS_PLAIN_MS;
+    /* a terminal line some report just erased is put back right away */
+    bool erased = progress.tty && !progress.shown;
+    if (!force && !erased && progress.drawn && now < progress.drawn + every)
+        return;
+    progress.drawn = now;
+    /* work left: recorded durations (the mean for new tests) of the tests
+     * not started and the expected rest of the running ones, spread over
+     * the slots they can use */
+    unsigned long pending = progress.discovered - progress.done -
+                            progress.running;
+    unsigned long long running_left = 0;
+    if (progress.running_end > now * progress.running)
+        running_left = progress.running_end - now * progress.running;
+    unsigned long long work = progress.pending_ms + running_left +
+                              progress.pending_unknown * progress_mean_ms();
+    unsigned long busy = pending + progress.running;
+    unsigned long slots = progress.jobs < busy ? progress.jobs : busy;
+    unsigned long long eta = slots ? work / slots : 0;
+    char left[32];
+    format_duration(left, sizeof(left), (unsigned long)((eta + 999) / 1000 * 1000));
+    strbuf sb = {0};
+    strbuf_printf(&sb, "%s%lu/%lu%s done, %lu running, %lu failed, ETA %s%s",
+                  progress.tty ? "\r\033[K" : "tikl: ", progress.done,
+                  progress.discovered, progress.source_done ? "" : "+",
+                  progress.running, progress.failed,
+                  progress.source_done ? "" : ">", left);
+    if (!progress.tty)
+        strbuf_puts(&sb, "\n");
+    write_all(STDERR_FILENO, sb.v, sb.n);
+    free(sb.v);
+    progress.shown = progress.tty;
+}
+
+/* Milliseconds until the line is due for a refresh with nothing else
+ * happening, or -1 when --progress is off. */
+static int
+progress_wait_ms(void)
+{
+    if (!progress.on)
+        return -1;
+    unsigned long long due = progress.drawn +
+                             (progress.tty ? 1000 : PROGRESS_PLAIN_MS);
+    unsigned long long now = monotonic_ms();
+    return due > now ? (int)(due - now) : 0;
+}
+
+/* When a runner waiting on its children should wake up for --metrics-interval
+ * or --progress, or -1 when neither needs it. */
+static int
+periodic_wait_ms(void)
+{
+    int m = metrics_wait_ms();
+    int p = progress_wait_ms();
+    if (m < 0 || (p >= 0 && p < m))
+        return p;
+    return m;
+}
+
+static void
+periodic_tick(void)
+{
+    metrics_tick();
+    progress_draw(false);
+}
+
+static void
+close_progress(void)
+{
+    progress_clear();
+    progress.on = false;
+}
+
+static void
+report_result(const char *test, const test_result *res)
+{
+    metrics_record(test, res);
+    if (report_json_fd >= 0)
+        report_json_result(test, res);
+    if (report_junit_fd >= 0)
+        report_junit_result(test, res);
+}
+
+static void
+close_result_reports(void)
+{
+    if (report_json_fd >= 0)
+        close(report_json_fd);
+    if (report_junit_fd >= 0) {
+        const char *tail = "</testsuite>\n</testsuites>\n";
+        write_all(report_junit_fd, tail, strlen(tail));
+        close(report_junit_fd);
+    }
+    report_json_fd = report_junit_fd = -1;
+}
+
+/* --trace: Chrome/Perfetto trace-event JSON.  Track (tid) 0 is the
+ * scheduler and tracks 1..-j are the slots tests run in.  The file is
+ * opened O_APPEND before any worker forks, and every process writes each
+ * event with a single write(), so workers need no coordination; the
+ * parent writes the opening bracket and, at the end, the track names that
+ * close the array. */
+static int trace_fd = -1;
+static unsigned long long trace_t0;
+
+static void
+open_trace(const char *path)
+{
+    if (!path || !*path)
+        return;
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                    0644);
+    if (trace_fd < 0) {
+        fprintf(stderr, "tikl: cannot write %s: %s\n", path, strerror(errno));
+        return;
+    }
+    trace_t0 = monotonic_us();
+    write_all(trace_fd, "[\n", 2);
+}
+
+/* Writes one event: a complete span ('X', start and dur in monotonic us)
+ * or an instant ('i', at start).  test and detail become its args. */
+static void
+trace_event(char ph, const char *cat, const char *name, unsigned tid,
+            unsigned long long start, unsigned long long dur,
+            const char *test, const char *detail)
+{
+    if (trace_fd < 0)
+        return;
+    strbuf sb = {0};
+    strbuf_puts(&sb, "{\"name\":");
+    append_json_string(&sb, name);
+    strbuf_printf(&sb, ",\"cat\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%u,"
+                  "\"ts\":%llu", cat, ph, tid,
+                  start > trace_t0 ? start - trace_t0 : 0);
+    if (ph == 'X')
+        strbuf_printf(&sb, ",\"dur\":%llu", dur);
+    else
+        strbuf_puts(&sb, ",\"s\":\"t\"");
+    if (test || detail) {
+        strbuf_puts(&sb, ",\"args\":{");
+        if (test) {
+            strbuf_puts(&sb, "\"test\":");
+            append_json_string(&sb, test);
+        }
+        if (detail) {
+            strbuf_puts(&sb, test ? ",\"detail\":" : "\"detail\":");
+            append_json_string(&sb, detail);
+        }
+        strbuf_puts(&sb, "}");
+    }
+    strbuf_puts(&sb, "},\n");
+    write_all(trace_fd, sb.v, sb.n);
+    free(sb.v);
+}
+
+/* A span from start until now. */
+static void
+trace_span(const char *cat, const char *name, unsigned tid,
+           unsigned long long start, const char *test, const char *detail)
+{
+    if (trace_fd < 0)
+        return;
+    unsigned long long now = monotonic_us();
+    trace_event('X', cat, name, tid, start, now > start ? now - start : 0,
+                test, detail);
+}
+
+static void
+trace_instant(const char *name, unsigned tid, const char *test,
+              const char *detail)
+{
+    if (trace_fd < 0)
+        return;
+    trace_event('i', "event", name, tid, monotonic_us(), 0, test, detail);
+}
+
+static void
+close_trace(unsigned slots)
+{
+    if (trace_fd < 0)
+        return;
+    strbuf sb = {0};
+    strbuf_puts(&sb, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"args\":{\"name\":\"tikl\"}},\n");
+    for (unsigned i = 0; i <= slots; i++) {
+        strbuf_printf(&sb, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                      "\"tid\":%u,\"args\":{\"name\":", i);
+        if (i == 0)
+            strbuf_puts(&sb, "\"scheduler\"");
+        else
+            strbuf_printf(&sb, "\"slot %u\"", i);
+        strbuf_printf(&sb, "}}%s\n", i == slots ? "" : ",");
+    }
+    strbuf_puts(&sb, "]\n");
+    write_all(trace_fd, sb.v, sb.n);
+    free(sb.v);
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+typedef struct {
+    test_status status;
+    unsigned long total_ms;
+    unsigned long *step_ms;
+    size_t nsteps;
+} history_run;
+typedef struct {
+    char *path;
+    history_run *runs;
+    size_t n, cap;
+} history_test;
+typedef struct {
+    history_test *v;
+    size_t n, cap;
+    strmap index;
+} history_db;
+
+/* STATE/history keeps this many of each test's latest runs. */
+enum { HISTORY_KEEP_RUNS = 100 };
+
+/* Parses one history line in place.  Returns false for malformed lines so
+ * a torn or foreign line never poisons the rest of the file. */
+static bool
+parse_history_line(char *line, history_run *run, char **path_out)
+{
+    char *field[8];
+    char *p = line;
+    for (int i = 0; i < 7; i++) {
+        char *tab = strchr(p, '\t');
+        if (!tab)
+            return false;
+        *tab = '\0';
+        field[i] = p;
+        p = tab + 1;
+    }
+    field[7] = p;
+    if (*field[7] != '/')
+        return false;
+    memset(run, 0, sizeof(*run));
+    if (!parse_test_status(field[1], &run->status))
+        return false;
+    char *end = NULL;
+    run->total_ms = strtoul(field[2], &end, 10);
+    if (end == field[2] || *end != '\0')
+        return false;
+    if (strcmp(field[6], "-") != 0) {
+        for (char *q = field[6]; *q;) {
+            unsigned long v = strtoul(q, &end, 10);
+            if (end == q || (*end != ',' && *end != '\0')) {
+                free(run->step_ms);
+                return false;
+            }
+            run->step_ms = xrealloc(run->step_ms,
+                                    (run->nsteps + 1) * sizeof(*run->step_ms));
+            run->step_ms[run->nsteps++] = v;
+            q = *end ? end + 1 : end;
+        }
+    }
+    *path_out = field[7];
+    return true;
+}
+
+/* Forgets the oldest n runs of t. */
+static void
+history_test_drop(history_test *t, size_t n)
+{
+    for (size_t j = 0; j < n; j++)
+        free(t->runs[j].step_ms);
+    memmove(t->runs, t->runs + n, (t->n - n) * sizeof(*t->runs));
+    t->n -= n;
+}
+
+/* Loads the last HISTORY_KEEP_RUNS runs of each test.  The file may hold
+ * more until it is next compacted; older runs are dropped while reading, in
+ * batches, so memory stays bounded by the window. */
+static void
+load_history(history_db *db)
+{
+    char path[PATH_MAX];
+    if (!state_path(path, sizeof(path), "history"))
+        return;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    while ((n = getline(&line, &cap, f)) != -1) {
+        if (n == 0 || line[n - 1] != '\n')
+            continue;
+        line[n - 1] = '\0';
+        history_run run;
+        char *test;
+        if (!parse_history_line(line, &run, &test))
+            continue;
+        unsigned long *slot = strmap_put(&db->index, test);
+        if (*slot == 0) {
+            if (db->n == db->cap) {
+                db->cap = db->cap ? db->cap * 2 : 64;
+                db->v = xrealloc(db->v, db->cap * sizeof(*db->v));
+            }
+            db->v[db->n] = (history_test) {
+                .path = xstrdup(test)
+            };
+            *slot = ++db->n;
+        }
+        history_test *t = &db->v[*slot - 1];
+        if (t->n == 2 * HISTORY_KEEP_RUNS)
+            history_test_drop(t, HISTORY_KEEP_RUNS);
+        if (t->n == t->cap) {
+            t->cap = t->cap ? t->cap * 2 : 8;
+            t->runs = xrealloc(t->runs, t->cap * sizeof(*t->runs));
+        }
+        t->runs[t->n++] = run;
+    }
+    for (size_t i = 0; i < db->n; i++)
+        if (db->v[i].n > HISTORY_KEEP_RUNS)
+            history_test_drop(&db->v[i], db->v[i].n - HISTORY_KEEP_RUNS);
+    free(line);
+    fclose(f);
+}
+
+static void
+history_db_free(history_db *db)
+{
+    for (size_t i = 0; i < db->n; i++) {
+        for (size_t j = 0; j < db->v[i].n; j++)
+            free(db->v[i].runs[j].step_ms);
+        free(db->v[i].runs);
+        free(db->v[i].path);
+    }
+    free(db->v);
+    strmap_free(&db->index);
+}
+
+/* Rewrites STATE/history with only the last HISTORY_KEEP_RUNS records of
+ * each test once dropped records would dominate.  Like the index, the main
+ * process does this after its run; malformed lines are dropped with it. */
+static void
+compact_history(void)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    if (!state_path(path, sizeof(path), "history"))
+        return;
+    FILE *in = fopen(path, "r");
+    if (!in)
+        return;
+    strmap left = {0};
+    size_t records = 0, kept = 0;
+    char *line = NULL, *copy = NULL;
+    size_t cap = 0, copy_cap = 0;
+    ssize_t n;
+    FILE *out = NULL;
+    for (int pass = 0; pass < 2; pass++) {
+        while ((n = getline(&line, &cap, in)) != -1) {
+            if (n == 0 || line[n - 1] != '\n')
+                continue;
+            if ((size_t)n > copy_cap) {
+                copy_cap = (size_t)n;
+                copy = xrealloc(copy, copy_cap);
+            }
+            memcpy(copy, line, (size_t)n - 1);
+            copy[n - 1] = '\0';
+            history_run run;
+            char *test;
+            if (!parse_history_line(copy, &run, &test))
+                continue;
+            free(run.step_ms);
+            unsigned long *count = strmap_put(&left, test);
+            if (pass == 0) {
+                records++;
+                if (++*count <= HISTORY_KEEP_RUNS)
+                    kept++;
+            } else if ((*count)-- <= HISTORY_KEEP_RUNS) {
+                fwrite(line, 1, (size_t)n, out);
+            }
+        }
+        if (pass == 1 || records <= 2 * kept + 64 ||
+            snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path,
+                     (long)getpid()) >= (int)sizeof(tmp) ||
+            !(out = fopen(tmp, "w")))
+            break;
+        rewind(in);
+    }
+    if (out) {
+        bool ok = fclose(out) == 0 && !ferror(in);
+        if (!ok || rename(tmp, path) != 0)
+            unlink(tmp);
+    }
+    free(line);
+    free(copy);
+    fclose(in);
+    strmap_free(&left);
+}
+
+static int
+ulong_cmp(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return x < y ? -1 : (x > y);
+}
+
+/* Nearest-rank percentile of an ascending array. */
+static unsigned long
+percentile(const unsigned long *sorted, size_t n, unsigned pct)
+{
+    if (n == 0)
+        return 0;
+    size_t rank = (n * pct + 99) / 100;
+    return sorted[rank ? rank - 1 : 0];
+}
+
+/* -t auto: a step's timeout is factor times the p99 of its durations in
+ * the latest passing runs, clamped to [floor_ms, cap_ms] (no cap when 0).
+ * Steps with too few samples keep the plain -t value. */
+typedef struct {
+    bool on;
+    double factor;
+    unsigned long floor_ms, cap_ms;
+} auto_timeout_options;
+
+enum {
+    AUTO_TIMEOUT_MIN_RUNS = 3,
+    AUTO_TIMEOUT_WINDOW = 50,
+};
+
+static auto_timeout_options auto_timeout = { .factor = 3.0, .floor_ms = 1000 };
+/* the history -t auto derives from, loaded by run_tests() */
+static history_db auto_history;
+
+/* Parses "auto[,factor=K][,floor=DURATION][,cap=DURATION]". */
+static bool
+parse_auto_timeout(const char *spec, auto_timeout_options *out)
+{
+    if (strncmp(spec, "auto", 4) != 0 || (spec[4] != '\0' && spec[4] != ','))
+        return false;
+    auto_timeout_options o = { .on = true, .factor = 3.0, .floor_ms = 1000 };
+    char *copy = xstrdup(spec + 4);
+    bool ok = true;
+    for (char *tok = strtok(copy, ","); tok && ok; tok = strtok(NULL, ",")) {
+        char *val = strchr(tok, '=');
+        if (!val) {
+            ok = false;
+            break;
+        }
+        *val++ = '\0';
+        if (strcmp(tok, "factor") == 0) {
+            char *end = NULL;
+            errno = 0;
+            o.factor = strtod(val, &end);
+            ok = !errno && end != val && *end == '\0' && o.factor >= 1.0;
+        } else if (strcmp(tok, "floor") == 0) {
+            ok = parse_duration_ms(val, &o.floor_ms);
+        } else if (strcmp(tok, "cap") == 0) {
+            ok = parse_duration_ms(val, &o.cap_ms);
+        } else {
+            ok = false;
+        }
+    }
+    free(copy);
+    if (ok && o.cap_ms && o.cap_ms < o.floor_ms)
+        ok = false;
+    if (ok)
+        *out = o;
+    return ok;
+}
+
+/* -t: a duration, or auto[,...] to derive step timeouts from history. */
+static bool
+parse_timeout_option(const char *arg)
+{
+    if (strncmp(arg, "auto", 4) == 0)
+        return parse_auto_timeout(arg, &auto_timeout);
+    if (!parse_duration_ms(arg, &timeout_ms))
+        return false;
+    auto_timeout.on = false;
+    return true;
+}
+
+/* The timeout -t auto gives step (0-based) of a test, or 0 when its history
+ * holds fewer than AUTO_TIMEOUT_MIN_RUNS passing runs that reached it. */
+static unsigned long
+derive_step_timeout(const history_test *t, size_t step,
+                    const auto_timeout_options *o)
+{
+    unsigned long samples[AUTO_TIMEOUT_WINDOW];
+    size_t n = 0;
+    for (size_t j = t->n; j-- > 0 && n < AUTO_TIMEOUT_WINDOW;) {
+        const history_run *run = &t->runs[j];
+        if (run->status == TEST_OK && run->nsteps > step)
+            samples[n++] = run->step_ms[step];
+    }
+    if (n < AUTO_TIMEOUT_MIN_RUNS)
+        return 0;
+    qsort(samples, n, sizeof(*samples), ulong_cmp);
+    double ms = o->factor * (double)percentile(samples, n, 99) + 0.5;
+    unsigned long out = ms >= (double)ULONG_MAX ? ULONG_MAX : (unsigned long)ms;
+    if (out < o->floor_ms)
+        out = o->floor_ms;
+    if (o->cap_ms && out > o->cap_ms)
+        out = o->cap_ms;
+    return out ? out : 1;
+}
+
+typedef struct {
+    const history_test *test;
+    size_t runs, failures;
+    unsigned long p50, p95, recent, baseline;
+    bool slower;
+} history_row;
+
+static int
+history_row_cmp(const void *a, const void *b)
+{
+    const history_row *x = a;
+    const history_row *y = b;
+    if (x->p50 != y->p50)
+        return x->p50 > y->p50 ? -1 : 1;
+    return strcmp(x->test->path, y->test->path);
+}
+
+enum {
+    HISTORY_RECENT_RUNS = 3,
+    HISTORY_MIN_BASELINE = 3,
+    HISTORY_MIN_SLOWDOWN_MS = 50,
+};
+
+/* "tikl history [TEST...]": per-test p50/p95 over passing runs.  A test is
+ * flagged when the median of its last few passing runs exceeds
+ * slowdown_factor times the median of the runs before them. */
+static int
+run_history_query(char **tests, int ntests, double slowdown_factor)
+{
+    history_db db = {0};
+    load_history(&db);
+    history_row *rows = xrealloc(NULL, (db.n ? db.n : 1) * sizeof(*rows));
+    size_t nrows = 0;
+    for (size_t i = 0; i < db.n; i++) {
+        const history_test *t = &db.v[i];
+        if (ntests > 0) {
+            bool wanted = false;
+            for (int j = 0; j < ntests && !wanted; j++) {
+                char abs_path[PATH_MAX];
+                wanted = resolve_test_path(tests[j], abs_path, sizeof(abs_path)) &&
+                         strcmp(abs_path, t->path) == 0;
+            }
+            if (!wanted)
+                continue;
+        }
+        history_row *row = &rows[nrows++];
+        memset(row, 0, sizeof(*row));
+        row->test = t;
+        unsigned long *ok = xrealloc(NULL, t->n * sizeof(*ok));
+        size_t nok = 0;
+        for (size_t j = 0; j < t->n; j++) {
+            if (t->runs[j].status == TEST_OK)
+                ok[nok++] = t->runs[j].total_ms;
+            else if (t->runs[j].status != TEST_SKIP)
+                row->failures++;
+        }
+        row->runs = t->n;
+        if (nok > HISTORY_RECENT_RUNS + HISTORY_MIN_BASELINE - 1) {
+            size_t nbase = nok - HISTORY_RECENT_RUNS;
+            unsigned long *recent = xrealloc(NULL, HISTORY_RECENT_RUNS * sizeof(*recent));
+            memcpy(recent, ok + nbase, HISTORY_RECENT_RUNS * sizeof(*recent));
+            qsort(recent, HISTORY_RECENT_RUNS, sizeof(*recent), ulong_cmp);
+            qsort(ok, nbase, sizeof(*ok), ulong_cmp);
+            row->recent = percentile(recent, HISTORY_RECENT_RUNS, 50);
+            row->baseline = percentile(ok, nbase, 50);
+            row->slower = row->recent >= row->baseline + HISTORY_MIN_SLOWDOWN_MS &&
+                          (double)row->recent > slowdown_factor * (double)row->baseline;
+            free(recent);
+        }
+        qsort(ok, nok, sizeof(*ok), ulong_cmp);
+        row->p50 = percentile(ok, nok, 50);
+        row->p95 = percentile(ok, nok, 95);
+        free(ok);
+    }
+    qsort(rows, nrows, sizeof(*rows), history_row_cmp);
+
+    int rc = 0;
+    printf("%6s %6s %10s %10s  %s\n", "RUNS", "FAILS", "P50", "P95", "TEST");
+    for (size_t i = 0; i < nrows; i++) {
+        const history_row *row = &rows[i];
+        char p50[32], p95[32];
+        printf("%6zu %6zu %10s %10s  %s", row->runs, row->failures,
+               format_duration(p50, sizeof(p50), row->p50),
+               format_duration(p95, sizeof(p95), row->p95), row->test->path);
+        if (row->slower) {
+            char recent[32], base[32];
+            printf("  SLOWER (recent %s, baseline %s)",
+                   format_duration(recent, sizeof(recent), row->recent),
+                   format_duration(base, sizeof(base), row->baseline));
+            rc = 1;
+        }
+        putchar('\n');
+    }
+    free(rows);
+    history_db_free(&db);
+    return rc;
+}
+
+typedef struct {
+    size_t index;
+    unsigned long ms;
+    bool known;
+    char *path;
+} sched_entry;
+/* in_order turns the heap into a queue in discovery order, for the serial
+ * runner's --progress lookahead. */
+typedef struct {
+    sched_entry *v;
+    size_t n, cap;
+    bool in_order;
+} sched_heap;
+
+/* Discovery may still be running while tests are scheduled, so -j keeps up
+ * to this many discovered tests in a priority queue and always starts the
+ * best candidate among them. */
+enum { SCHED_LOOKAHEAD = 4096 };
+
+/* Longest-processing-time-first: tests without history go first (they may
+ * be slow and we cannot tell), then known tests by decreasing duration.
+ * Ties keep command-line order. */
+static int
+sched_entry_cmp(const void *a, const void *b)
+{
+    const sched_entry *x = a;
+    const sched_entry *y = b;
+    if (x->known != y->known)
+        return x->known ? 1 : -1;
+    if (x->known && x->ms != y->ms)
+        return x->ms > y->ms ? -1 : 1;
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+static int
+sched_heap_cmp(const sched_heap *h, const sched_entry *x, const sched_entry *y)
+{
+    if (h->in_order)
+        return x->index < y->index ? -1 : (x->index > y->index);
+    return sched_entry_cmp(x, y);
+}
+
+static void
+sched_heap_push(sched_heap *h, sched_entry e)
+{
+    if (h->n == h->cap) {
+        h->cap = h->cap ? h->cap * 2 : 64;
+        h->v = xrealloc(h->v, h->cap * sizeof(*h->v));
+    }
+    size_t i = h->n++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (sched_heap_cmp(h, &h->v[parent], &e) <= 0)
+            break;
+        h->v[i] = h->v[parent];
+        i = parent;
+    }
+    h->v[i] = e;
+}
+
+static sched_entry
+sched_heap_pop(sched_heap *h)
+{
+    sched_entry top = h->v[0];
+    sched_entry last = h->v[--h->n];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= h->n)
+            break;
+        if (child + 1 < h->n &&
+            sched_heap_cmp(h, &h->v[child + 1], &h->v[child]) < 0)
+            child++;
+        if (sched_heap_cmp(h, &last, &h->v[child]) <= 0)
+            break;
+        h->v[i] = h->v[child];
+        i = child;
+    }
+    if (h->n > 0)
+        h->v[i] = last;
+    return top;
+}
+
+static void
+sched_heap_free(sched_heap *h)
+{
+    for (size_t i = 0; i < h->n; i++)
+        free(h->v[i].path);
+    free(h->v);
+}
+
+/* Test inputs are produced lazily: positional files, @listfiles, stdin
+ * (--from-stdin) and recursive directory walks are expanded one entry at a
+ * time so the scheduler can start running tests while discovery goes on. */
+typedef struct {
+    vecstr names;
+    size_t next;
+    char *dir;
+} walk_frame;
+typedef struct {
+    vecstr suffixes;
+    vecstr includes;
+    vecstr excludes;
+    regex_t filter;
+    bool have_filter;
+    regex_t filter_out;
+    bool have_filter_out;
+} test_filter;
+typedef struct {
+    char **args;
+    int nargs;
+    int next_arg;
+    bool from_stdin;
+    bool listing;
+    int list_fd;
+    strbuf list_buf;
+    size_t list_off;
+    walk_frame *stack;
+    size_t depth, cap;
+    char *current;
+    const test_filter *filter;
+} test_source;
+
+static bool walked_file_is_test(const char *path);
+
+static bool
+glob_matches(const vecstr *globs, const char *path)
+{
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    for (size_t i = 0; i < globs->n; i++) {
+        const char *subject = strchr(globs->v[i], '/') ? path : base;
+        if (fnmatch(globs->v[i], subject, 0) == 0)
+            return true;
+    }
+    return false;
+}
+
+static bool
+test_filter_accepts(const test_filter *flt, const char *path, bool walked)
+{
+    if (!flt)
+        return true;
+    if (walked && flt->suffixes.n > 0) {
+        bool ok = false;
+        for (size_t i = 0; i < flt->suffixes.n && !ok; i++)
+            ok = ends_with(path, flt->suffixes.v[i]);
+        if (!ok)
+            return false;
+    }
+    if (flt->includes.n > 0 && !glob_matches(&flt->includes, path))
+        return false;
+    if (glob_matches(&flt->excludes, path))
+        return false;
+    if (flt->have_filter && regexec(&flt->filter, path, 0, NULL, 0) != 0)
+        return false;
+    if (flt->have_filter_out && regexec(&flt->filter_out, path, 0, NULL, 0) == 0)
+        return false;
+    return true;
+}
+
+/* --filter and --filter-out; a later pattern replaces an earlier one. */
+static bool
+test_filter_set_regex(test_filter *flt, bool out, const char *pattern)
+{
+    regex_t *re = out ? &flt->filter_out : &flt->filter;
+    bool *have = out ? &flt->have_filter_out : &flt->have_filter;
+    if (*have)
+        regfree(re);
+    *have = regcomp(re, pattern, REG_EXTENDED | REG_NOSUB) == 0;
+    return *have;
+}
+
+static void
+test_filter_free(test_filter *flt)
+{
+    vecstr_free(&flt->suffixes);
+    vecstr_free(&flt->includes);
+    vecstr_free(&flt->excludes);
+    if (flt->have_filter)
+        regfree(&flt->filter);
+    if (flt->have_filter_out)
+        regfree(&flt->filter_out);
+}
+
+static int
+name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void
+test_source_push_dir(test_source *src, const char *path)
+{
+    DIR *d = opendir(path);
+    if (!d) {
+        fprintf(stderr, "opendir %s: %s\n", path, strerror(errno));
+        return;
+    }
+    walk_frame frame = {0};
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+        vecstr_push(&frame.names, ent->d_name);
+    }
+    closedir(d);
+    qsort(frame.names.v, frame.names.n, sizeof(*frame.names.v), name_cmp);
+    size_t n = strlen(path);
+    while (n > 1 && path[n - 1] == '/')
+        n--;
+    frame.dir = xrealloc(NULL, n + 1);
+    memcpy(frame.dir, path, n);
+    frame.dir[n] = '\0';
+    if (src->depth == src->cap) {
+        src->cap = src->cap ? src->cap * 2 : 8;
+        src->stack = xrealloc(src->stack, src->cap * sizeof(*src->stack));
+    }
+    src->stack[src->depth++] = frame;
+}
+
+static void
+test_source_pop_dir(test_source *src)
+{
+    walk_frame *frame = &src->stack[--src->depth];
+    vecstr_free(&frame->names);
+    free(frame->dir);
+}
+
+static bool
+is_directory(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* Offers a candidate named on the command line, in a list file or on stdin.
+ * Directories start a walk; anything else is returned as a test when it
+ * passes the filters. */
+static bool
+test_source_offer(test_source *src, const char *path)
+{
+    if (is_directory(path)) {
+        test_source_push_dir(src, path);
+        return false;
+    }
+    if (!test_filter_accepts(src->filter, path, false))
+        return false;
+    free(src->current);
+    src->current = xstrdup(path);
+    return true;
+}
+
+/* List files and stdin are read through a buffer of our own rather than
+ * stdio, so test_source_ready can tell whether a whole line is at hand.
+ * Returns the next line without its newline, or NULL at the end. */
+static char *
+test_source_read_line(test_source *src)
+{
+    strbuf *b = &src->list_buf;
+    for (;;) {
+        size_t left = b->n - src->list_off;
+        char *nl = left ? memchr(b->v + src->list_off, '\n', left) : NULL;
+        if (nl) {
+            char *line = b->v + src->list_off;
+            *nl = '\0';
+            src->list_off = (size_t)(nl + 1 - b->v);
+            return line;
+        }
+        if (src->list_off > 0)
+            memmove(b->v, b->v + src->list_off, left);
+        b->n = left;
+        src->list_off = 0;
+        if (b->cap - b->n < 4096) {
+            b->cap = b->cap ? b->cap * 2 : 8192;
+            b->v = xrealloc(b->v, b->cap);
+        }
+        ssize_t n = read(src->list_fd, b->v + b->n, b->cap - b->n - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (b->n == 0)
+                return NULL;
+            /* a last line without a newline */
+            b->v[b->n] = '\0';
+            src->list_off = b->n;
+            return b->v;
+        }
+        b->n += (size_t)n;
+    }
+}
+
+static void
+test_source_end_list(test_source *src)
+{
+    if (src->list_fd != STDIN_FILENO)
+        close(src->list_fd);
+    src->listing = false;
+    src->list_buf.n = 0;
+    src->list_off = 0;
+}
+
+static bool
+test_source_next_line(test_source *src)
+{
+    for (;;) {
+        char *line = test_source_read_line(src);
+        if (!line) {
+            test_source_end_list(src);
+            return false;
+        }
+        rtrim_inplace(line);
+        char *entry = ltrim(line);
+        if (*entry == '\0' || *entry == '#')
+            continue;
+        if (test_source_offer(src, entry))
+            return true;
+        if (src->depth > 0)
+            return false;
+    }
+}
+
+/* Returns the next test path, or NULL once every input is exhausted.  The
+ * string stays valid until the following call. */
+static const char *
+test_source_next(test_source *src)
+{
+    for (;;) {
+        while (src->depth > 0) {
+            walk_frame *frame = &src->stack[src->depth - 1];
+            if (frame->next == frame->names.n) {
+                test_source_pop_dir(src);
+                continue;
+            }
+            const char *name = frame->names.v[frame->next++];
+            size_t need = strlen(frame->dir) + 1 + strlen(name) + 1;
+            char *path = xrealloc(NULL, need);
+            snprintf(path, need, "%s/%s", frame->dir, name);
+            struct stat st;
+            if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+                if (!glob_matches(&src->filter->excludes, path))
+                    test_source_push_dir(src, path);
+                free(path);
+                continue;
+            }
+            if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) ||
+                !test_filter_accepts(src->filter, path, true) ||
+                (src->filter->suffixes.n == 0 && !walked_file_is_test(path))) {
+                free(path);
+                continue;
+            }
+            free(src->current);
+            src->current = path;
+            return src->current;
+        }
+        if (src->listing) {
+            if (test_source_next_line(src))
+                return src->current;
+            continue;
+        }
+        if (src->next_arg < src->nargs) {
+            const char *arg = src->args[src->next_arg++];
+            if (arg[0] == '@' && arg[1] != '\0') {
+                src->list_fd = open(arg + 1, O_RDONLY | O_CLOEXEC);
+                if (src->list_fd < 0)
+                    die("cannot open list file %s: %s", arg + 1, strerror(errno));
+                src->listing = true;
+                continue;
+            }
+            if (test_source_offer(src, arg))
+                return src->current;
+            continue;
+        }
+        if (src->from_stdin) {
+            src->from_stdin = false;
+            src->list_fd = STDIN_FILENO;
+            src->listing = true;
+            continue;
+        }
+        return NULL;
+    }
+}
+
+static void
+test_source_free(test_source *src)
+{
+    while (src->depth > 0)
+        test_source_pop_dir(src);
+    free(src->stack);
+    if (src->listing)
+        test_source_end_list(src);
+    free(src->list_buf.v);
+    free(src->current);
+}
+
+/* The descriptor the next path has to be read from, or -1 when it comes
+ * from a walk, an argument or a line that is already buffered. */
+static int
+test_source_input_fd(const test_source *src)
+{
+    if (src->depth > 0)
+        return -1;
+    if (src->listing) {
+        size_t left = src->list_buf.n - src->list_off;
+        if (left && memchr(src->list_buf.v + src->list_off, '\n', left))
+            return -1;
+        return src->list_fd;
+    }
+    return src->next_arg == src->nargs && src->from_stdin ? STDIN_FILENO : -1;
+}
+
+/* Whether test_source_next can go on without waiting for a pipe or a
+ * terminal to produce more paths; the schedulers keep running tests in the
+ * meantime rather than block in discovery. */
+static bool
+test_source_ready(const test_source *src)
+{
+    int fd = test_source_input_fd(src);
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    return fd < 0 || poll(&pfd, 1, 0) != 0;
+}
+
+static void
+parse_env_options(vecstr *out, const char *env)
+{
+    if (!env || !*env)
+        return;
+    char tok[8192];
+    size_t len = 0;
+    char quote = 0;
+    for (const char *p = env;; p++) {
+        char c = *p;
+        if (c == '\0') {
+            if (quote)
+                die("unterminated quote in TIKL_OPTIONS");
+            if (len) {
+                tok[len] = '\0';
+                vecstr_push(out, tok);
+            }
+            break;
+        }
+        if (quote == 0) {
+            if (isspace((unsigned char)c)) {
+                if (len) {
+                    tok[len] = '\0';
+                    vecstr_push(out, tok);
+                    len = 0;
+                }
+                continue;
+            }
+            if (c == '\'' || c == '"') {
+                quote = c;
+                continue;
+            }
+            if (c == '\\' && p[1] != '\0') {
+                c = *++p;
+            }
+        } else {
+            if (c == quote) {
+                quote = 0;
+                continue;
+            }
+            if (quote == '"' && c == '\\' && p[1] != '\0') {
+                c = *++p;
+            }
+        }
+        if (len + 1 >= sizeof(tok))
+            die("TIKL_OPTIONS token too long");
+        tok[len++] = c;
+    }
+}
+
+static char *
+apply_config_substitutions(const char *input, mapkv *subs)
+{
+    char *current = xstrdup(input);
+    for (int pass = 0; pass < 8; pass++) {
+        int status = 0;
+        char *next = tikl_expand_placeholders(current, true, false,
+                                              lookup_mapkv_cb, subs,
+                                              "tikl", &status);
+        if (status != 0) {
+            free(current);
+            free(next);
+            fprintf(stderr, "tikl: invalid placeholder in configuration\n");
+            return NULL;
+        }
+        if (!next)
+            return current;
+        bool changed = strcmp(current, next) != 0;
+        free(current);
+        current = next;
+        if (!changed)
+            break;
+    }
+    return current;
+}
+
+/* Fills %b and %B (PATH_MAX each) for a test and creates %B.  Failures
+ * are reported and fail that test, not the run. */
+static bool
+test_bin_paths(const char *path_for_s, char *bmap, char *bdir)
+{
+    if (!map_source_to_bin(path_for_s, bmap, PATH_MAX)) {
+        fprintf(stderr, "tikl: output path too long: %s\n", path_for_s);
+        return false;
+    }
+    path_dirname(bmap, bdir, PATH_MAX);
+    if (!make_dirs(bdir)) {
+        fprintf(stderr, "tikl: mkdir %s: %s\n", bdir, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/* Returns the command with every placeholder expanded, or NULL after
+ * reporting why it cannot be. */
+static char *
+perform_substitutions(const char *cmd_in, mapkv *subs,
+                      const char *testpath,
+                      const char *testpath_abs,
+                      const char *shared_tfile,
+                      const char *shared_T)
+{
+    char s_path[PATH_MAX];
+    char s_dir[PATH_MAX];
+    const char *path_for_s = pick_test_path(testpath, testpath_abs,
+                                            s_path, sizeof(s_path),
+                                            s_dir, sizeof(s_dir));
+    char bmap[PATH_MAX];
+    char bdir[PATH_MAX];
+    if (!test_bin_paths(path_for_s, bmap, bdir))
+        return NULL;
+
+    char *cmd = apply_config_substitutions(cmd_in, subs);
+    if (!cmd)
+        return NULL;
+
+    const char *scratch_for_T = shared_T ? shared_T : ((scratch_root &&
+                                *scratch_root) ? scratch_root :
+                                default_scratch_root);
+
+    builtin_substs builtins = {
+        .s = path_for_s,
+        .S = s_dir,
+        .t = shared_tfile,
+        .T = scratch_for_T,
+        .b = bmap,
+        .B = bdir,
+    };
+
+    int status = 0;
+    char *expanded = tikl_expand_placeholders(cmd, true, true,
+                     lookup_builtin_cb, &builtins,
+                     "tikl", &status);
+    free(cmd);
+    if (status != 0) {
+        free(expanded);
+        fprintf(stderr, "tikl: invalid placeholder expansion in %s\n", testpath);
+        return NULL;
+    }
+    return expanded;
+}
+
+static void
+push_sub_line(vecstr *lines, const char *key, const char *val)
+{
+    size_t nk = strlen(key);
+    size_t nv = strlen(val);
+    char *buf = malloc(nk + 1 + nv + 1);
+    if (!buf)
+        die("OOM");
+    memcpy(buf, key, nk);
+    buf[nk] = '=';
+    memcpy(buf + nk + 1, val, nv + 1);
+    vecstr_push(lines, buf);
+    free(buf);
+}
+
+static char *
+expand_for_check_value(const char *input, mapkv *subs,
+                       const char *path_for_s,
+                       const char *s_dir,
+                       const char *bmap,
+                       const char *bdir)
+{
+    char *cmd = apply_config_substitutions(input, subs);
+    if (!cmd)
+        return NULL;
+    builtin_substs builtins = {
+        .s = path_for_s,
+        .S = s_dir,
+        .b = bmap,
+        .B = bdir,
+    };
+    int status = 0;
+    char *out = tikl_expand_placeholders(cmd, true, true,
+                                         lookup_builtin_cb, &builtins,
+                                         "tikl", &status);
+    free(cmd);
+    if (status != 0) {
+        free(out);
+        fprintf(stderr, "tikl: invalid placeholder in configuration\n");
+        return NULL;
+    }
+    return out;
+}
+
+/* Sets *blob_out to the TIKL_CHECK_SUBSTS value (NULL when empty).  Returns
+ * false after reporting when a placeholder cannot be expanded. */
+static bool
+build_check_subs_blob(mapkv *subs, const char *testpath,
+                      const char *testpath_abs, char **blob_out)
+{
+    *blob_out = NULL;
+    char s_path[PATH_MAX];
+    char s_dir[PATH_MAX];
+    const char *path_for_s = pick_test_path(testpath, testpath_abs,
+                                            s_path, sizeof(s_path),
+                                            s_dir, sizeof(s_dir));
+    char bmap[PATH_MAX];
+    char bdir[PATH_MAX];
+    if (!test_bin_paths(path_for_s, bmap, bdir))
+        return false;
+
+    vecstr lines = {0};
+    push_sub_line(&lines, "s", path_for_s);
+    push_sub_line(&lines, "S", s_dir);
+    push_sub_line(&lines, "b", bmap);
+    push_sub_line(&lines, "B", bdir);
+
+    for (size_t i = 0; i < subs->n; i++) {
+        const char *key = subs->v[i].key;
+        if (strcmp(key, "s") == 0 || strcmp(key, "S") == 0 ||
+            strcmp(key, "b") == 0 || strcmp(key, "B") == 0) {
+            continue;
+        }
+        char *expanded = expand_for_check_value(subs->v[i].val, subs,
+                                                path_for_s, s_dir, bmap, bdir);
+        if (!expanded) {
+            vecstr_free(&lines);
+            return false;
+        }
+        push_sub_line(&lines, key, expanded);
+        free(expanded);
+    }
+
+    if (lines.n == 0) {
+        vecstr_free(&lines);
+        return true;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < lines.n; i++)
+        total += strlen(lines.v[i]) + 1;
+    char *blob = malloc(total);
+    if (!blob)
+        die("OOM");
+    size_t off = 0;
+    for (size_t i = 0; i < lines.n; i++) {
+        size_t len = strlen(lines.v[i]);
+        if (i > 0)
+            blob[off++] = '\n';
+        memcpy(blob + off, lines.v[i], len);
+        off += len;
+    }
+    blob[off] = '\0';
+    vecstr_free(&lines);
+    *blob_out = blob;
+    return true;
+}
+
+/* Environment for the commands of one test: the inherited environment plus
+ * this test's TIKL_CHECK_SUBSTS or TIKL_LIT_COMPAT.  Entries other than
+ * check_subs are borrowed from environ, which tikl never changes once tests
+ * start running.  It also holds what in-process %check steps load, so each
+ * checked file is read once per test, and the limits and time budgets its
+ * steps run under: step_timeout_ms from -t or STEP_TIMEOUT:, and deadline,
+ * the earlier of the test's TIMEOUT: and the --max-time deadline.
+ * trace_tid is the --trace track the test runs on. */
+typedef struct {
+    char **envp;
+    char *check_subs;
+    tikl_check_substs *substs;
+    tikl_check_source **sources;
+    size_t nsources;
+    step_limits limits;
+    unsigned long step_timeout_ms;
+    unsigned long long deadline;
+    unsigned trace_tid;
+} test_env;
+
+#ifndef TIKL_FUZZ
+/* The monotonic deadline of a step started at start, 0 for none. */
+static unsigned long long
+step_deadline(const test_env *te, unsigned long long start)
+{
+    unsigned long long d = te->step_timeout_ms ? start + te->step_timeout_ms : 0;
+    if (te->deadline && (!d || te->deadline < d))
+        d = te->deadline;
+    return d;
+}
+#endif
+
+static bool
+suite_expired(void)
+{
+    return suite_deadline && monotonic_ms() >= suite_deadline;
+}
+
+/* Returns false, with te still safe to free, when the check placeholders
+ * cannot be expanded. */
+static bool
+test_env_init(test_env *te, mapkv *cfgsubs, const char *path,
+              const char *testpath_abs)
+{
+    static char lit_compat_var[] = "TIKL_LIT_COMPAT=1";
+    size_t n = 0;
+    while (environ[n])
+        n++;
+    memset(te, 0, sizeof(*te));
+    te->envp = xrealloc(NULL, (n + 2) * sizeof(*te->envp));
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (strncmp(environ[i], "TIKL_CHECK_SUBSTS=", 18) == 0 ||
+            strncmp(environ[i], "TIKL_LIT_COMPAT=", 16) == 0)
+            continue;
+        te->envp[k++] = environ[i];
+    }
+    if (lit_compat) {
+        te->envp[k++] = lit_compat_var;
+    } else {
+        char *blob;
+        if (!build_check_subs_blob(cfgsubs, path, testpath_abs, &blob)) {
+            te->envp[k] = NULL;
+            return false;
+        }
+        if (blob) {
+            size_t len = strlen(blob);
+            te->check_subs = xrealloc(NULL, 18 + len + 1);
+            memcpy(te->check_subs, "TIKL_CHECK_SUBSTS=", 18);
+            memcpy(te->check_subs + 18, blob, len + 1);
+            te->envp[k++] = te->check_subs;
+            free(blob);
+        }
+    }
+    te->envp[k] = NULL;
+    return true;
+}
+
+static void
+test_env_free(test_env *te)
+{
+    free(te->envp);
+    free(te->check_subs);
+    tikl_check_substs_free(te->substs);
+    for (size_t i = 0; i < te->nsources; i++)
+        tikl_check_source_free(te->sources[i]);
+    free(te->sources);
+    memset(te, 0, sizeof(*te));
+}
+
+#ifndef TIKL_FUZZ
+/* Returns the CHECK lines of path, loading them on first use in this test;
+ * NULL (reported) when the file cannot be read. */
+static const tikl_check_source *
+test_env_check_source(test_env *te, const char *path)
+{
+    for (size_t i = 0; i < te->nsources; i++)
+        if (strcmp(tikl_check_source_path(te->sources[i]), path) == 0)
+            return te->sources[i];
+    tikl_check_source *src = tikl_check_source_load(path);
+    if (!src)
+        return NULL;
+    te->sources = xrealloc(te->sources, (te->nsources + 1) * sizeof(*te->sources));
+    te->sources[te->nsources++] = src;
+    if (!te->substs)
+        te->substs = tikl_check_substs_parse(te->check_subs ? te->check_subs + 18
+                                             : NULL);
+    return src;
+}
+#endif
+
+/* Output of a step kept within a fixed budget: the first CAPTURE_HEAD
+ * bytes and a ring holding the last CAPTURE_TAIL, so a chatty test costs no
+ * more memory than a quiet one.  Everything also goes to log_fd when a
+ * --log-dir file is open, and to stderr at -vv. */
+enum { CAPTURE_HEAD = 16384, CAPTURE_TAIL = 49152 };
+typedef struct {
+    char *head;
+    size_t head_n;
+    char *tail;
+    size_t tail_pos;
+    unsigned long long total;
+    int log_fd;
+    bool echo;
+} output_capture;
+
+static const char *log_dir = NULL;
+
+/* Writes what was kept, marking the gap when the middle was dropped. */
+static void
+capture_print(const output_capture *c, FILE *out)
+{
+    if (c->total == 0)
+        return;
+    fwrite(c->head, 1, c->head_n, out);
+    unsigned long long rest = c->total - c->head_n;
+    size_t tail_n = rest > CAPTURE_TAIL ? CAPTURE_TAIL : (size_t)rest;
+    if (rest > tail_n)
+        fprintf(out, "%s[... %llu bytes omitted ...]\n",
+                c->head_n && c->head[c->head_n - 1] != '\n' ? "\n" : "",
+                rest - tail_n);
+    if (tail_n == CAPTURE_TAIL) {
+        fwrite(c->tail + c->tail_pos, 1, CAPTURE_TAIL - c->tail_pos, out);
+        fwrite(c->tail, 1, c->tail_pos, out);
+    } else {
+        fwrite(c->tail, 1, tail_n, out);
+    }
+    char last = tail_n ? c->tail[(c->tail_pos + CAPTURE_TAIL - 1) % CAPTURE_TAIL]
+                : c->head[c->head_n - 1];
+    if (last != '\n')
+        fputc('\n', out);
+}
+
+static void
+capture_free(output_capture *c)
+{
+    if (c->log_fd >= 0)
+        close(c->log_fd);
+    free(c->head);
+    free(c->tail);
+    memset(c, 0, sizeof(*c));
+    c->log_fd = -1;
+}
+
+/* Opens LOG_DIR/<test path with '/' turned into '_'>.log for the test. */
+static int
+open_test_log(const char *path)
+{
+    if (!log_dir || !*log_dir)
+        return -1;
+    while (path[0] == '.' && path[1] == '/')
+        path += 2;
+    while (*path == '/')
+        path++;
+    char name[PATH_MAX];
+    if (snprintf(name, sizeof(name), "%s.log", path) >= (int)sizeof(name))
+        return -1;
+    for (char *p = name; *p; p++)
+        if (*p == '/')
+            *p = '_';
+    char full[PATH_MAX];
+    if (!build_temp_path(full, sizeof(full), log_dir, name))
+        return -1;
+    int fd = make_dirs(log_dir) ?
+             open(full, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    if (fd < 0)
+        fprintf(stderr, "tikl: cannot write %s: %s\n", full, strerror(errno));
+    return fd;
+}
+
+#ifndef TIKL_FUZZ
+static void
+capture_append(output_capture *c, const char *s, size_t n)
+{
+    if (c->log_fd >= 0)
+        write_all(c->log_fd, s, n);
+    if (c->echo)
+        fwrite(s, 1, n, stderr);
+    c->total += n;
+    if (c->head_n < CAPTURE_HEAD) {
+        size_t take = CAPTURE_HEAD - c->head_n;
+        if (take > n)
+            take = n;
+        if (!c->head)
+            c->head = xrealloc(NULL, CAPTURE_HEAD);
+        memcpy(c->head + c->head_n, s, take);
+        c->head_n += take;
+        s += take;
+        n -= take;
+    }
+    if (n == 0)
+        return;
+    if (!c->tail)
+        c->tail = xrealloc(NULL, CAPTURE_TAIL);
+    if (n > CAPTURE_TAIL) {
+        s += n - CAPTURE_TAIL;
+        n = CAPTURE_TAIL;
+    }
+    while (n > 0) {
+        size_t take = CAPTURE_TAIL - c->tail_pos;
+        if (take > n)
+            take = n;
+        memcpy(c->tail + c->tail_pos, s, take);
+        c->tail_pos = (c->tail_pos + take) % CAPTURE_TAIL;
+        s += take;
+        n -= take;
+    }
+}
+
+/* Forgets the previous step's output, keeping the buffers. */
+static void
+capture_reset(output_capture *c)
+{
+    c->head_n = 0;
+    c->tail_pos = 0;
+    c->total = 0;
+}
+
+/* Starts `shell -c script` in a process group of its own, with stdin on
+ * /dev/null and, when out_fd is not -1, stdout and stderr on out_fd.
+ * Returns 0 or an errno value. */
+static int
+spawn_shell(pid_t *pid, const char *shell, const char *script,
+            char *const envp[], int out_fd)
+{
+    posix_spawn_file_actions_t fa;
+    int err = posix_spawn_file_actions_init(&fa);
+    if (err != 0)
+        return err;
+    err = posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null",
+                                           O_RDONLY, 0);
+    if (err == 0 && out_fd >= 0)
+        err = posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+    if (err == 0 && out_fd >= 0)
+        err = posix_spawn_file_actions_adddup2(&fa, out_fd, STDERR_FILENO);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+    char *argv[] = { (char *)shell, "-c", (char *)script, NULL };
+    if (err == 0)
+        err = posix_spawn(pid, shell, &fa, &attr, argv, envp);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    return err;
+}
+
+/* spawn_shell() for a step with limits.  Rlimits can only be set in the
+ * child, so this forks: the child joins the step's cgroup through procs_fd
+ * when there is one and applies the limits the cgroup does not enforce
+ * (those in cgroup_kinds) as rlimits.  The CPU hard limit sits a second
+ * above the soft one, so SIGXCPU comes first. */
+static int
+spawn_limited_shell(pid_t *pid, const char *shell, const char *script,
+                    char *const envp[], int out_fd, const step_limits *lim,
+                    int procs_fd, unsigned cgroup_kinds)
+{
+    static const int resources[LIMIT_NKINDS] = {
+        [LIMIT_MEM] = RLIMIT_AS,
+        [LIMIT_CPU] = RLIMIT_CPU,
+        [LIMIT_FSIZE] = RLIMIT_FSIZE,
+        [LIMIT_NPROC] = RLIMIT_NPROC,
+    };
+    char *argv[] = { (char *)shell, "-c", (char *)script, NULL };
+    pid_t p = fork();
+    if (p < 0)
+        return errno;
+    if (p == 0) {
+        setpgid(0, 0);
+        int in = open("/dev/null", O_RDONLY);
+        if (in > STDIN_FILENO) {
+            dup2(in, STDIN_FILENO);
+            close(in);
+        }
+        if (out_fd >= 0) {
+            dup2(out_fd, STDOUT_FILENO);
+            dup2(out_fd, STDERR_FILENO);
+        }
+        if (procs_fd >= 0 && write(procs_fd, "0", 1) != 1)
+            _exit(127);
+        for (int k = 0; k < LIMIT_NKINDS; k++) {
+            if (!lim->v[k] || (cgroup_kinds & (1u << k)))
+                continue;
+            struct rlimit rl;
+            rl.rlim_cur = (rlim_t)lim->v[k];
+            rl.rlim_max = (rlim_t)lim->v[k] + (k == LIMIT_CPU ? 1 : 0);
+            if (setrlimit(resources[k], &rl) != 0) {
+                static const char msg[] = "tikl: cannot set resource limit\n";
+                ssize_t w = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+                (void)w;
+                _exit(127);
+            }
+        }
+        execve(shell, argv, envp);
+        _exit(127);
+    }
+    setpgid(p, p);
+    *pid = p;
+    return 0;
+}
+#endif
+
+/* RUN lines made of plain words, quotes, simple redirections and `|` are run
+ * without a shell: each stage is spawned directly with its own pipes.  Any
+ * other shell syntax (expansions, globs, lists, builtins, ...) makes
+ * parse_simple_pipeline() decline and the line goes to the shell. */
+typedef enum {
+    REDIR_IN,
+    REDIR_OUT,
+    REDIR_APPEND,
+    REDIR_DUP,
+} redir_kind;
+typedef struct {
+    redir_kind kind;
+    int fd;
+    int target;
+    char *path;
+} redir;
+typedef struct {
+    vecstr argv;
+    redir *redirs;
+    size_t nredirs, cap;
+} pipeline_stage;
+typedef struct {
+    pipeline_stage *v;
+    size_t n, cap;
+} pipeline;
+
+static bool run_shell_fast_path = true;
+
+static const char *const shell_only_words[] = {
+    "!", "{", "}", "[", "[[", "]]", "case", "do", "done", "elif", "else",
+    "esac", "fi", "for", "function", "if", "in", "select", "then", "time",
+    "until", "while", ".", ":", "alias", "bg", "break", "builtin", "cd",
+    "command", "continue", "declare", "eval", "exec", "exit", "export", "fg",
+    "getopts", "hash", "jobs", "let", "local", "pwd", "read", "readonly",
+    "return", "set", "shift", "source", "times", "trap", "type", "typeset",
+    "ulimit", "umask", "unalias", "unset", "wait",
+};
+
+static void
+pipeline_free(pipeline *pl)
+{
+    for (size_t i = 0; i < pl->n; i++) {
+        vecstr_free(&pl->v[i].argv);
+        for (size_t j = 0; j < pl->v[i].nredirs; j++)
+            free(pl->v[i].redirs[j].path);
+        free(pl->v[i].redirs);
+    }
+    free(pl->v);
+    memset(pl, 0, sizeof(*pl));
+}
+
+static pipeline_stage *
+pipeline_add_stage(pipeline *pl)
+{
+    if (pl->n == pl->cap) {
+        pl->cap = pl->cap ? pl->cap * 2 : 4;
+        pl->v = xrealloc(pl->v, pl->cap * sizeof(*pl->v));
+    }
+    pipeline_stage *st = &pl->v[pl->n++];
+    memset(st, 0, sizeof(*st));
+    return st;
+}
+
+static void
+stage_add_redir(pipeline_stage *st, redir r)
+{
+    if (st->nredirs == st->cap) {
+        st->cap = st->cap ? st->cap * 2 : 4;
+        st->redirs = xrealloc(st->redirs, st->cap * sizeof(*st->redirs));
+    }
+    st->redirs[st->nredirs++] = r;
+}
+
+/* Whether a stage's command needs the shell: keywords and builtins, and
+ * echo where builtin and /bin/echo disagree on options and escapes. */
+static bool
+stage_needs_shell(const pipeline_stage *st)
+{
+    const char *name = st->argv.v[0];
+    for (size_t i = 0; i < sizeof(shell_only_words) / sizeof(*shell_only_words); i++)
+        if (strcmp(name, shell_only_words[i]) == 0)
+            return true;
+    if (strchr(name, '='))
+        return true;
+    if (strcmp(name, "echo") == 0) {
+        for (size_t i = 1; i < st->argv.n; i++)
+            if (st->argv.v[i][0] == '-' || strchr(st->argv.v[i], '\\'))
+                return true;
+    }
+    return false;
+}
+
+/* Parses cmd into pl.  Returns false (leaving pl empty) when cmd uses any
+ * shell feature beyond words, quoting, `<`, `>`, `>>`, `N>`, `N>&M` and
+ * `|`. */
+static bool
+parse_simple_pipeline(const char *cmd, pipeline *pl)
+{
+    memset(pl, 0, sizeof(*pl));
+    pipeline_stage *st = pipeline_add_stage(pl);
+    strbuf word = {0};
+    bool have_word = false;
+    bool word_quoted = false;
+    bool have_redir = false;
+    redir pending = {0};
+    const char *p = cmd;
+    bool ok = true;
+    for (;;) {
+        char c = *p;
+        bool at_word_start = !have_word;
+        if (c == '\0' || c == ' ' || c == '\t' || c == '|' || c == '<' ||
+            c == '>') {
+            bool fd_prefix = (c == '<' || c == '>') && have_word && !word_quoted &&
+                             word.n == 1 && isdigit((unsigned char)word.v[0]);
+            if (fd_prefix && word.v[0] > '2') {
+                ok = false;
+                break;
+            }
+            if (have_word && !fd_prefix) {
+                if (have_redir) {
+                    pending.path = xstrdup(word.v);
+                    stage_add_redir(st, pending);
+                    have_redir = false;
+                } else {
+                    vecstr_push(&st->argv, word.v);
+                }
+            }
+            int fd = fd_prefix ? word.v[0] - '0' : -1;
+            have_word = word_quoted = false;
+            word.n = 0;
+            if (word.v)
+                word.v[0] = '\0';
+            if (c == '\0')
+                break;
+            if (c == ' ' || c == '\t') {
+                p++;
+                continue;
+            }
+            if (have_redir) {
+                ok = false;
+                break;
+            }
+            if (c == '|') {
+                if (p[1] == '|' || p[1] == '&' || st->argv.n == 0) {
+                    ok = false;
+                    break;
+                }
+                st = pipeline_add_stage(pl);
+                p++;
+                continue;
+            }
+            memset(&pending, 0, sizeof(pending));
+            if (c == '<') {
+                if (p[1] == '<' || p[1] == '&' || p[1] == '>' || p[1] == '(') {
+                    ok = false;
+                    break;
+                }
+                pending.kind = REDIR_IN;
+                pending.fd = fd >= 0 ? fd : 0;
+                p++;
+            } else {
+                pending.fd = fd >= 0 ? fd : 1;
+                pending.kind = REDIR_OUT;
+                p++;
+                if (*p == '>') {
+                    pending.kind = REDIR_APPEND;
+                    p++;
+                } else if (*p == '&') {
+                    if (p[1] < '0' || p[1] > '2' ||
+                        (p[2] && !strchr(" \t|", p[2]))) {
+                        ok = false;
+                        break;
+                    }
+                    pending.kind = REDIR_DUP;
+                    pending.target = p[1] - '0';
+                    stage_add_redir(st, pending);
+                    p += 2;
+                    continue;
+                } else if (*p == '|' || *p == '(') {
+                    ok = false;
+                    break;
+                }
+            }
+            have_redir = true;
+            continue;
+        }
+        if (c == '\'') {
+            const char *q = strchr(p + 1, '\'');
+            if (!q) {
+                ok = false;
+                break;
+            }
+            strbuf_append(&word, p + 1, (size_t)(q - p - 1));
+            have_word = word_quoted = true;
+            p = q + 1;
+            continue;
+        }
+        if (c == '"') {
+            p++;
+            while (*p && *p != '"') {
+                if (*p == '$' || *p == '`') {
+                    ok = false;
+                    break;
+                }
+                if (*p == '\\' && p[1] && strchr("$`\"\\", p[1]))
+                    p++;
+                else if (*p == '\\' && (p[1] == '\n' || p[1] == '\0'))
+                    ok = false;
+                strbuf_append(&word, p, 1);
+                p++;
+            }
+            if (!ok || *p != '"') {
+                ok = false;
+                break;
+            }
+            have_word = word_quoted = true;
+            p++;
+            continue;
+        }
+        if (c == '\\') {
+            if (p[1] == '\0' || p[1] == '\n') {
+                ok = false;
+                break;
+            }
+            strbuf_append(&word, p + 1, 1);
+            have_word = word_quoted = true;
+            p += 2;
+            continue;
+        }
+        if (strchr(";&()$`*?[]{}~\n", c) || (at_word_start && c == '#')) {
+            ok = false;
+            break;
+        }
+        strbuf_append(&word, p, 1);
+        have_word = true;
+        p++;
+    }
+    free(word.v);
+    if (have_redir)
+        ok = false;
+    for (size_t i = 0; ok && i < pl->n; i++)
+        if (pl->v[i].argv.n == 0 || stage_needs_shell(&pl->v[i]))
+            ok = false;
+    if (!ok)
+        pipeline_free(pl);
+    return ok;
+}
+
+#ifndef TIKL_FUZZ
+static void
+report_stage_exit(size_t i, const pipeline_stage *st, int ec,
+                  unsigned long long ms)
+{
+    char took[32];
+    fprintf(stderr, "      [%zu] %s: exit %d, %s\n", i + 1, st->argv.v[0], ec,
+            format_duration(took, sizeof(took), ms));
+}
+
+static int
+decode_wait_status(int st)
+{
+    if (WIFEXITED(st))
+        return WEXITSTATUS(st);
+    if (WIFSIGNALED(st))
+        return 128 + WTERMSIG(st);
+    return 127;
+}
+
+/* Recognises a final `tikl-check ...` stage that can run in-process. */
+static bool
+stage_is_check(const pipeline_stage *st, tikl_check_options *opts)
+{
+    const char *name = strrchr(st->argv.v[0], '/');
+    name = name ? name + 1 : st->argv.v[0];
+    if (strcmp(name, "tikl-check") != 0 || st->nredirs > 0)
+        return false;
+    if (tikl_check_parse_args((int)st->argv.n, st->argv.v, opts) != 0) {
+        tikl_check_options_free(opts);
+        return false;
+    }
+    return true;
+}
+
+/* Collects what the pipeline writes into fd until EOF.  Returns false when
+ * the deadline passes first; an abort stops reading early. */
+static bool
+read_pipeline_output(int fd, strbuf *out, unsigned long long deadline)
+{
+    char buf[65536];
+    while (!abort_requested) {
+        int wait_ms = -1;
+        if (deadline) {
+            unsigned long long now = monotonic_ms();
+            if (now >= deadline)
+                return false;
+            unsigned long long left = deadline - now;
+            wait_ms = left > INT_MAX ? INT_MAX : (int)left;
+        }
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int pr = poll(&pfd, 1, wait_ms);
+        if (pr < 0 && errno != EINTR)
+            return true;
+        if (pr <= 0)
+            continue;
+        ssize_t r = read(fd, buf, sizeof(buf));
+        if (r == 0 || (r < 0 && errno != EINTR && errno != EAGAIN))
+            return true;
+        if (r > 0)
+            strbuf_append(out, buf, (size_t)r);
+    }
+    return true;
+}
+
+/* One RUN line in flight: a process per pipeline stage when it runs without
+ * a shell, otherwise the single shell running the line.  All of them share
+ * the process group pgid, so signals reach whatever they start in turn.
+ * step_start() spawns the processes; whoever waits for them (run_shell(),
+ * or the async executor) fills in sts and ended and then calls
+ * step_finish(). */
+typedef struct {
+    pipeline pl;
+    bool shell;
+    pid_t pgid;
+    size_t n;
+    pid_t *pids;
+    pid_t *live;
+    int *sts;
+    int *ecs;
+    unsigned long long *ended;
+    unsigned long long start;
+    bool check_stage;
+    tikl_check_options check;
+    int out_fd;
+    strbuf output;
+    output_capture *cap;
+    int cap_fd;
+    resource_usage usage;
+    char *cgroup;
+    unsigned cgroup_kinds;
+} step_proc;
+
+static void
+step_proc_alloc(step_proc *sp, size_t n)
+{
+    sp->n = n;
+    sp->pids = xrealloc(NULL, n * sizeof(*sp->pids));
+    sp->live = xrealloc(NULL, n * sizeof(*sp->live));
+    sp->sts = xrealloc(NULL, n * sizeof(*sp->sts));
+    sp->ecs = xrealloc(NULL, n * sizeof(*sp->ecs));
+    sp->ended = xrealloc(NULL, n * sizeof(*sp->ended));
+    for (size_t i = 0; i < n; i++) {
+        sp->pids[i] = 0;
+        sp->live[i] = 0;
+        sp->sts[i] = 0;
+        sp->ecs[i] = -1;
+        sp->ended[i] = sp->start;
+    }
+}
+
+/* Creates the cgroup leaf of a step limited in mem or nproc and sets the
+ * limits it can enforce, recording them in sp->cgroup_kinds.  Returns a
+ * descriptor of its cgroup.procs for the child to join, or -1 when the step
+ * has to make do with rlimits. */
+static int
+step_cgroup_create(step_proc *sp, const step_limits *lim)
+{
+#ifdef __linux__
+    static unsigned seq = 0;
+    if (!cgroup_dir || (!lim->v[LIMIT_MEM] && !lim->v[LIMIT_NPROC]))
+        return -1;
+    char leaf[PATH_MAX];
+    if (snprintf(leaf, sizeof(leaf), "%s/tikl-%ld-%u", cgroup_dir,
+                 (long)getpid(), ++seq) >= (int)sizeof(leaf))
+        return -1;
+    if (mkdir(leaf, 0755) != 0) {
+        fprintf(stderr, "tikl: mkdir %s: %s\n", leaf, strerror(errno));
+        return -1;
+    }
+    sp->cgroup = xstrdup(leaf);
+    char num[32];
+    if (lim->v[LIMIT_MEM]) {
+        snprintf(num, sizeof(num), "%llu", lim->v[LIMIT_MEM]);
+        if (cgroup_write(leaf, "memory.max", num)) {
+            sp->cgroup_kinds |= 1u << LIMIT_MEM;
+            cgroup_write(leaf, "memory.swap.max", "0");
+        }
+    }
+    if (lim->v[LIMIT_NPROC]) {
+        snprintf(num, sizeof(num), "%llu", lim->v[LIMIT_NPROC]);
+        if (cgroup_write(leaf, "pids.max", num))
+            sp->cgroup_kinds |= 1u << LIMIT_NPROC;
+    }
+    char procs[PATH_MAX];
+    int fd = -1;
+    if (snprintf(procs, sizeof(procs), "%s/cgroup.procs", leaf) <
+        (int)sizeof(procs))
+        fd = open(procs, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        sp->cgroup_kinds = 0;
+    return fd;
+#else
+    (void)sp;
+    (void)lim;
+    return -1;
+#endif
+}
+
+/* Returns the value of `key N` in the flat-keyed file dir/file, 0 when
+ * there is none. */
+static unsigned long long
+cgroup_event_count(const char *dir, const char *file, const char *key)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    char name[64];
+    unsigned long long v, found = 0;
+    while (fscanf(f, "%63s %llu", name, &v) == 2)
+        if (strcmp(name, key) == 0)
+            found = v;
+    fclose(f);
+    return found;
+}
+
+/* Kills whatever is left in the step's cgroup and removes it. */
+static void
+step_cgroup_remove(step_proc *sp)
+{
+#ifdef __linux__
+    cgroup_write(sp->cgroup, "cgroup.kill", "1");
+    for (int i = 0; i < 100 && rmdir(sp->cgroup) != 0 && errno == EBUSY; i++) {
+        struct timespec ts = { 0, 1000000 };
+        nanosleep(&ts, NULL);
+    }
+#endif
+    free(sp->cgroup);
+    sp->cgroup = NULL;
+}
+
+/* Works out whether a failed step was stopped by one of its limits: its
+ * cgroup recorded an OOM kill or a refused fork, or the step died of the
+ * signal the kernel sends at the RLIMIT_CPU or RLIMIT_FSIZE limit (directly
+ * or as the shell's 128+N), or of SIGKILL with its CPU time at the limit.
+ * Returns the limit_kind, or -1.  A step stopped by RLIMIT_AS or
+ * RLIMIT_NPROC just sees allocations or forks fail, which cannot be told
+ * from any other failure. */
+static int
+step_limit_hit(const step_proc *sp, const step_limits *lim, int rc)
+{
+    if (rc == 0)
+        return -1;
+    if ((sp->cgroup_kinds & (1u << LIMIT_MEM)) &&
+        cgroup_event_count(sp->cgroup, "memory.events", "oom_kill") > 0)
+        return LIMIT_MEM;
+    if ((sp->cgroup_kinds & (1u << LIMIT_NPROC)) &&
+        cgroup_event_count(sp->cgroup, "pids.events", "max") > 0)
+        return LIMIT_NPROC;
+    unsigned long long cpu_ms = sp->usage.user_ms + sp->usage.sys_ms;
+    if (lim->v[LIMIT_CPU] &&
+        (rc == 128 + SIGXCPU ||
+         (rc == 128 + SIGKILL && cpu_ms >= lim->v[LIMIT_CPU] * 1000)))
+        return LIMIT_CPU;
+    if (lim->v[LIMIT_FSIZE] && rc == 128 + SIGXFSZ)
+        return LIMIT_FSIZE;
+    return -1;
+}
+
+static bool
+step_limited(const step_limits *lim)
+{
+    for (int k = 0; k < LIMIT_NKINDS; k++)
+        if (lim->v[k])
+            return true;
+    return false;
+}
+
+static void
+step_proc_free(step_proc *sp)
+{
+    if (sp->cgroup)
+        step_cgroup_remove(sp);
+    if (sp->out_fd >= 0)
+        close(sp->out_fd);
+    if (sp->cap_fd >= 0)
+        close(sp->cap_fd);
+    if (sp->check_stage)
+        tikl_check_options_free(&sp->check);
+    if (!sp->shell)
+        pipeline_free(&sp->pl);
+    free(sp->pids);
+    free(sp->live);
+    free(sp->sts);
+    free(sp->ecs);
+    free(sp->ended);
+    free(sp->output.v);
+    memset(sp, 0, sizeof(*sp));
+    sp->out_fd = -1;
+    sp->cap_fd = -1;
+}
+
+/* Reports a problem starting a stage where its own stderr would have gone. */
+static void
+step_note(step_proc *sp, const char *what, const char *why)
+{
+    if (sp->cap) {
+        char msg[PATH_MAX + 128];
+        int n = snprintf(msg, sizeof(msg), "tikl: %s: %s\n", what, why);
+        if (n > 0)
+            capture_append(sp->cap, msg, (size_t)n < sizeof(msg) ? (size_t)n :
+                           sizeof(msg) - 1);
+    } else {
+        fprintf(stderr, "tikl: %s: %s\n", what, why);
+    }
+}
+
+/* Moves whatever the step has written so far into its capture; at EOF, or
+ * when drain is set and nothing more is pending, the pipe is closed. */
+static void
+step_read_capture(step_proc *sp, bool drain)
+{
+    char buf[65536];
+    while (sp->cap_fd >= 0) {
+        ssize_t r = read(sp->cap_fd, buf, sizeof(buf));
+        if (r > 0) {
+            capture_append(sp->cap, buf, (size_t)r);
+            if (!drain)
+                return;
+            continue;
+        }
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && errno == EAGAIN && !drain)
+            return;
+        close(sp->cap_fd);
+        sp->cap_fd = -1;
+    }
+}
+
+#ifndef TIKL_FUZZ
+/* Waits for the stages of sp until all are reaped or the monotonic deadline
+ * passes (0 means no deadline), reading the step's output into its capture
+ * meanwhile.  Each stage's status goes to sp->sts and its exit time to
+ * sp->ended; reaped entries are set to 0 in sp->live.  Returns 1 once all are
+ * reaped, 0 on deadline, -1 on error.  A pending abort sends SIGTERM to the
+ * step once and keeps waiting. */
+static int
+wait_step_until(step_proc *sp, unsigned long long deadline)
+{
+    bool term_sent = false;
+    for (;;) {
+        size_t live = 0;
+        for (size_t i = 0; i < sp->n; i++) {
+            if (sp->live[i] <= 0)
+                continue;
+            struct rusage ru;
+            pid_t r = wait4(sp->live[i], &sp->sts[i], WNOHANG, &ru);
+            if (r == sp->live[i]) {
+                usage_add_rusage(&sp->usage, &ru);
+                sp->live[i] = 0;
+                sp->ended[i] = monotonic_ms();
+                continue;
+            }
+            if (r < 0 && errno != EINTR)
+                return -1;
+            live++;
+        }
+        if (live == 0) {
+            step_read_capture(sp, true);
+            return 1;
+        }
+        if (abort_requested && !term_sent) {
+            if (sp->pgid > 0)
+                kill(-sp->pgid, SIGTERM);
+            for (size_t i = 0; i < sp->n; i++)
+                if (sp->live[i] > 0)
+                    kill(sp->live[i], SIGTERM);
+            term_sent = true;
+        }
+        int wait_ms = -1;
+        if (deadline) {
+            unsigned long long now = monotonic_ms();
+            if (now >= deadline)
+                return 0;
+            unsigned long long left = deadline - now;
+            wait_ms = left > INT_MAX ? INT_MAX : (int)left;
+        }
+        struct pollfd pfd[2] = {
+            { .fd = sigchld_pipe[0], .events = POLLIN },
+            { .fd = sp->cap_fd, .events = POLLIN },
+        };
+        if (poll(pfd, sp->cap_fd >= 0 ? 2 : 1, wait_ms) > 0) {
+            if (pfd[0].revents)
+                drain_child_wait();
+            if (sp->cap_fd >= 0 && pfd[1].revents)
+                step_read_capture(sp, false);
+        }
+    }
+}
+#endif
+
+/* Spawns the stages of sp->pl connected by pipes, sending the last stage's
+ * stdout and every stage's stderr to cap_wfd unless it is -1.  A final
+ * tikl-check stage is not spawned; its input is left in sp->out_fd for the
+ * caller to read. */
+static void
+pipeline_spawn(step_proc *sp, test_env *env, int cap_wfd)
+{
+    const pipeline *pl = &sp->pl;
+    size_t n = pl->n;
+    step_proc_alloc(sp, n);
+    sp->check_stage = stage_is_check(&pl->v[n - 1], &sp->check);
+    size_t nspawn = sp->check_stage ? n - 1 : n;
+    int prev_read = -1;
+    for (size_t i = 0; i < nspawn; i++) {
+        const pipeline_stage *st = &pl->v[i];
+        int fds[2] = { -1, -1 };
+        if (i + 1 < n) {
+            if (pipe(fds) != 0) {
+                perror("pipe");
+                sp->ecs[i] = 127;
+                break;
+            }
+            fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+            fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        }
+        posix_spawn_file_actions_t fa;
+        posix_spawn_file_actions_init(&fa);
+        if (prev_read >= 0)
+            posix_spawn_file_actions_adddup2(&fa, prev_read, STDIN_FILENO);
+        else
+            posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null",
+                                             O_RDONLY, 0);
+        if (fds[1] >= 0)
+            posix_spawn_file_actions_adddup2(&fa, fds[1], STDOUT_FILENO);
+        else if (cap_wfd >= 0)
+            posix_spawn_file_actions_adddup2(&fa, cap_wfd, STDOUT_FILENO);
+        if (cap_wfd >= 0)
+            posix_spawn_file_actions_adddup2(&fa, cap_wfd, STDERR_FILENO);
+        /* Redirection targets are opened here so a bad path is reported
+         * like the shell would, rather than as a failed spawn. */
+        int *opened = xrealloc(NULL, (st->nredirs + 1) * sizeof(*opened));
+        size_t nopened = 0;
+        const char *bad_path = NULL;
+        for (size_t j = 0; j < st->nredirs; j++) {
+            const redir *r = &st->redirs[j];
+            if (r->kind == REDIR_DUP) {
+                posix_spawn_file_actions_adddup2(&fa, r->target, r->fd);
+                continue;
+            }
+            int flags = r->kind == REDIR_IN ? O_RDONLY
+                        : O_WRONLY | O_CREAT | (r->kind == REDIR_APPEND ? O_APPEND : O_TRUNC);
+            int fd = open(r->path, flags | O_CLOEXEC, 0666);
+            if (fd < 0) {
+                bad_path = r->path;
+                break;
+            }
+            opened[nopened++] = fd;
+            posix_spawn_file_actions_adddup2(&fa, fd, r->fd);
+        }
+        char **argv = xrealloc(NULL, (st->argv.n + 1) * sizeof(*argv));
+        memcpy(argv, st->argv.v, st->argv.n * sizeof(*argv));
+        argv[st->argv.n] = NULL;
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attr, sp->pgid);
+        int err = 0;
+        if (bad_path) {
+            step_note(sp, bad_path, strerror(errno));
+            sp->ecs[i] = 1;
+        } else {
+            err = posix_spawnp(&sp->pids[i], argv[0], &fa, &attr, argv,
+                               env->envp);
+            if (err == ENOEXEC) {
+                /* a script without a #! line: execvp() hands those to the
+                 * shell, and so does the shell path */
+                char **sh_argv = xrealloc(NULL, (st->argv.n + 4) * sizeof(*sh_argv));
+                sh_argv[0] = (char *)run_shell_path;
+                sh_argv[1] = (char *)"-c";
+                sh_argv[2] = (char *)"\"$0\" \"$@\"";
+                memcpy(sh_argv + 3, argv, (st->argv.n + 1) * sizeof(*sh_argv));
+                err = posix_spawn(&sp->pids[i], run_shell_path, &fa, &attr,
+                                  sh_argv, env->envp);
+                free(sh_argv);
+            }
+            if (err == 0 && sp->pgid == 0)
+                sp->pgid = sp->pids[i];
+        }
+        while (nopened > 0)
+            close(opened[--nopened]);
+        free(opened);
+        free(argv);
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&fa);
+        if (err != 0) {
+            step_note(sp, st->argv.v[0],
+                      err == ENOENT ? "command not found" : strerror(err));
+            sp->ecs[i] = err == ENOENT ? 127 : 126;
+            sp->pids[i] = 0;
+        }
+        if (prev_read >= 0)
+            close(prev_read);
+        if (fds[1] >= 0)
+            close(fds[1]);
+        prev_read = fds[0];
+    }
+    if (sp->check_stage)
+        sp->out_fd = prev_read;
+    else if (prev_read >= 0)
+        close(prev_read);
+    memcpy(sp->live, sp->pids, n * sizeof(*sp->live));
+}
+
+/* Starts cmd, without a shell when parse_simple_pipeline() accepts it and
+ * the test sets no limits.  Returns false with *rc set when nothing could
+ * be started. */
+static bool
+step_start(step_proc *sp, const char *cmd, test_env *env, int verbosity,
+           output_capture *cap, int *rc)
+{
+    memset(sp, 0, sizeof(*sp));
+    sp->out_fd = -1;
+    sp->cap_fd = -1;
+    sp->start = monotonic_ms();
+    if (verbosity >= 1) {
+        fputs("    $ ", stderr);
+        fputs(cmd, stderr);
+        fputc('\n', stderr);
+    }
+    /* Steps that run tikl-check themselves keep the terminal: their
+     * diagnostics are the report. */
+    int cap_wfd = -1;
+    if (cap && (verbosity < 2 || cap->log_fd >= 0) &&
+        strstr(cmd, "tikl-check") == NULL) {
+        int fds[2];
+        if (pipe(fds) == 0) {
+            fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+            fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+            fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+            capture_reset(cap);
+            cap->echo = verbosity >= 2;
+            if (cap->log_fd >= 0) {
+                write_all(cap->log_fd, "$ ", 2);
+                write_all(cap->log_fd, cmd, strlen(cmd));
+                write_all(cap->log_fd, "\n", 1);
+            }
+            sp->cap = cap;
+            sp->cap_fd = fds[0];
+            cap_wfd = fds[1];
+        }
+    }
+    unsigned long long spawn_start = trace_fd >= 0 ? monotonic_us() : 0;
+    bool limited = step_limited(&env->limits);
+    if (run_shell_fast_path && !limited && parse_simple_pipeline(cmd, &sp->pl)) {
+        pipeline_spawn(sp, env, cap_wfd);
+        if (cap_wfd >= 0)
+            close(cap_wfd);
+        trace_span("tikl", "spawn", env->trace_tid, spawn_start, NULL,
+                   "pipeline");
+        return true;
+    }
+    sp->shell = true;
+    const char *script = cmd;
+    char *wrapped = NULL;
+    if (!lit_compat && run_shell_has_pipefail) {
+        const char *pipefail_prelude = "set -o pipefail 2>/dev/null || :; ";
+        size_t want = strlen(pipefail_prelude) + strlen(cmd) + 1;
+        wrapped = xrealloc(NULL, want);
+        snprintf(wrapped, want, "%s%s", pipefail_prelude, cmd);
+        script = wrapped;
+    }
+    step_proc_alloc(sp, 1);
+    int err;
+    if (limited) {
+        int procs_fd = step_cgroup_create(sp, &env->limits);
+        err = spawn_limited_shell(&sp->pids[0], run_shell_path, script,
+                                  env->envp, cap_wfd, &env->limits, procs_fd,
+                                  sp->cgroup_kinds);
+        if (procs_fd >= 0)
+            close(procs_fd);
+    } else {
+        err = spawn_shell(&sp->pids[0], run_shell_path, script, env->envp,
+                          cap_wfd);
+    }
+    free(wrapped);
+    if (cap_wfd >= 0)
+        close(cap_wfd);
+    trace_span("tikl", "spawn", env->trace_tid, spawn_start, NULL, "shell");
+    if (err != 0) {
+        fprintf(stderr, "spawn %s: %s\n", run_shell_path, strerror(err));
+        step_proc_free(sp);
+        *rc = 127;
+        return false;
+    }
+    sp->live[0] = sp->pids[0];
+    sp->pgid = sp->pids[0];
+    return true;
+}
+
+/* Signals the whole step: its process group and, in case a stage could not
+ * join the group, each stage still alive. */
+static void
+step_signal(step_proc *sp, int sig)
+{
+    if (sp->pgid > 0)
+        kill(-sp->pgid, sig);
+    for (size_t i = 0; i < sp->n; i++)
+        if (sp->live[i] > 0)
+            kill(sp->live[i], sig);
+}
+
+/* Kills and reaps the processes tikl adopted as a subreaper.  Returns how
+ * many it found. */
+static size_t
+kill_adopted_children(void)
+{
+    size_t killed = 0;
+#ifdef __linux__
+    if (!adopt_orphans)
+        return 0;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%ld/children", (long)getpid());
+    /* killing one may orphan its own children onto tikl, so look again */
+    for (int round = 0; round < 8; round++) {
+        FILE *f = fopen(path, "r");
+        if (!f)
+            break;
+        size_t found = 0;
+        long pid;
+        while (fscanf(f, "%ld", &pid) == 1) {
+            kill(-(pid_t)pid, SIGKILL);
+            kill((pid_t)pid, SIGKILL);
+            while (waitpid((pid_t)pid, NULL, 0) < 0 && errno == EINTR)
+                ;
+            found++;
+        }
+        fclose(f);
+        if (found == 0)
+            break;
+        killed += found;
+    }
+#endif
+    return killed;
+}
+
+/* Once every stage is reaped, anything left in the step's process group
+ * (or adopted while the step ran) is a leak: background jobs, servers that
+ * were never stopped.  Kills them and returns whether there were any. */
+static bool
+step_kill_leftovers(step_proc *sp)
+{
+    bool leaked = false;
+    if (sp->pgid > 0 && kill(-sp->pgid, 0) == 0) {
+        kill(-sp->pgid, SIGKILL);
+        leaked = true;
+    }
+    if (kill_adopted_children() > 0)
+        leaked = true;
+    return leaked;
+}
+
+/* Turns the reaped statuses into the step's exit code.  Exit codes follow
+ * the shell: 127/126 for commands that cannot be started, 128+N for signals,
+ * and with pipefail the rightmost failing stage decides.  An in-process
+ * check only runs when the other stages completed in time. */
+static int
+step_finish(step_proc *sp, test_env *env, int verbosity, bool completed,
+            bool timed_out)
+{
+    if (timed_out)
+        return 124;
+    if (sp->shell)
+        return decode_wait_status(sp->sts[0]);
+    size_t n = sp->n;
+    if (sp->check_stage) {
+        const tikl_check_source *src = NULL;
+        if (completed && !abort_requested)
+            src = test_env_check_source(env, sp->check.testfile);
+        if (src)
+            sp->ecs[n - 1] = tikl_check_verify(src, &sp->check, lit_compat,
+                                               env->substs,
+                                               sp->output.v ? sp->output.v : "",
+                                               sp->output.n);
+        else
+            sp->ecs[n - 1] = 2;
+        sp->ended[n - 1] = monotonic_ms();
+    }
+    int rc = 0;
+    bool pipefail = !lit_compat && run_shell_has_pipefail;
+    for (size_t i = 0; i < n; i++) {
+        if (sp->pids[i] > 0)
+            sp->ecs[i] = decode_wait_status(sp->sts[i]);
+        else if (sp->ecs[i] < 0)
+            sp->ecs[i] = 127;
+        if (pipefail ? sp->ecs[i] != 0 : i + 1 == n)
+            rc = sp->ecs[i];
+        if (verbosity >= 2 && n > 1)
+            report_stage_exit(i, &sp->pl.v[i], sp->ecs[i],
+                              sp->ended[i] - sp->start);
+    }
+    return rc;
+}
+#endif
+
+static int
+run_shell(const char *cmd, test_env *env, int verbosity, output_capture *cap,
+          step_outcome *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->limit = -1;
+#ifdef TIKL_FUZZ
+    pipeline pl;
+    if (parse_simple_pipeline(cmd, &pl))
+        pipeline_free(&pl);
+    (void)env;
+    (void)verbosity;
+    (void)cap;
+    return 0;
+#else
+    if (abort_requested)
+        return 128 + abort_requested;
+    step_proc sp;
+    int rc;
+    if (!step_start(&sp, cmd, env, verbosity, cap, &rc))
+        return rc;
+    unsigned long long deadline = step_deadline(env, sp.start);
+    bool in_time = true;
+    if (sp.out_fd >= 0) {
+        in_time = read_pipeline_output(sp.out_fd, &sp.output, deadline);
+        close(sp.out_fd);
+        sp.out_fd = -1;
+    }
+    int wr = in_time ? wait_step_until(&sp, deadline) : 0;
+    bool expired = wr == 0;
+    if (wr == 0) {
+        if (kill_grace_ms > 0) {
+            step_signal(&sp, SIGTERM);
+            wr = wait_step_until(&sp, monotonic_ms() + kill_grace_ms);
+        }
+        if (wr == 0) {
+            step_signal(&sp, SIGKILL);
+            wr = wait_step_until(&sp, 0);
+        }
+    }
+    if (wr == 1)
+        out->leaked = step_kill_leftovers(&sp);
+    rc = step_finish(&sp, env, verbosity, wr == 1, expired);
+    if (wr < 0) {
+        perror("waitpid");
+        rc = 127;
+    }
+    out->timed_out = expired;
+    if (!expired)
+        out->limit = step_limit_hit(&sp, &env->limits, rc);
+    out->usage = sp.usage;
+    if (verbosity >= 1)
+        report_step_usage(&out->usage);
+    step_proc_free(&sp);
+    return rc;
+#endif
+}
+
+static bool
+probe_pipefail(const char *shell_path)
+{
+#ifdef TIKL_FUZZ
+    (void)shell_path;
+    return true;
+#else
+    pid_t pid;
+    if (spawn_shell(&pid, shell_path, "set -o pipefail 2>/dev/null", environ,
+                    -1) != 0)
+        return false;
+    int st = 0;
+    while (waitpid(pid, &st, 0) < 0) {
+        if (errno == EINTR)
+            continue;
+        return false;
+    }
+    return WIFEXITED(st) && WEXITSTATUS(st) == 0;
+#endif
+}
+
+static void
+init_run_shell(void)
+{
+    run_shell_path = "/bin/sh";
+    run_shell_has_pipefail = false;
+    const char *forced_shell = getenv("TIKL_SHELL");
+    if (forced_shell && *forced_shell) {
+        run_shell_path = forced_shell;
+        run_shell_fast_path = false;
+        if (!lit_compat)
+            run_shell_has_pipefail = probe_pipefail(forced_shell);
+        return;
+    }
+    if (lit_compat)
+        return;
+    if (probe_pipefail("/bin/sh")) {
+        run_shell_has_pipefail = true;
+        return;
+    }
+    if (access("/bin/bash", X_OK) == 0 && probe_pipefail("/bin/bash")) {
+        run_shell_path = "/bin/bash";
+        run_shell_has_pipefail = true;
+        return;
+    }
+}
+
+static void
+test_directives_free(test_directives *d)
+{
+    vecstr_free(&d->runs);
+    vecstr_free(&d->reqs);
+    vecstr_free(&d->uns);
+    vecstr_free(&d->limits);
+    vecstr_free(&d->depends);
+    free(d->timeout);
+    free(d->step_timeout);
+    free(d->xfail_reason);
+    memset(d, 0, sizeof(*d));
+}
+
+/* Returns the start of the command when [s, e) is a `RUN:` line behind a
+ * `//`, `#` or `;` comment marker, NULL otherwise. */
+static const char *
+comment_run_body(const char *s, const char *e)
+{
+    while (s < e && (*s == ' ' || *s == '\t'))
+        s++;
+    if (e - s >= 2 && s[0] == '/' && s[1] == '/')
+        s += 2;
+    else if (s < e && (*s == '#' || *s == ';'))
+        s++;
+    else
+        return NULL;
+    while (s < e && (*s == ' ' || *s == '\t'))
+        s++;
+    if (e - s < 4 || memcmp(s, "RUN:", 4) != 0)
+        return NULL;
+    s += 4;
+    while (s < e && (*s == ' ' || *s == '\t'))
+        s++;
+    return s;
+}
+
+typedef enum {
+    DIRECTIVE_REQUIRES,
+    DIRECTIVE_UNSUPPORTED,
+    DIRECTIVE_XFAIL,
+    DIRECTIVE_ALLOW_RETRIES,
+    DIRECTIVE_LIMIT,
+    DIRECTIVE_DEPENDS,
+    /* ahead of TIMEOUT, which is its suffix */
+    DIRECTIVE_STEP_TIMEOUT,
+    DIRECTIVE_TIMEOUT,
+    DIRECTIVE_COUNT
+} directive_kind;
+static const struct {
+    const char *name;
+    size_t len;
+} directive_names[DIRECTIVE_COUNT] = {
+    [DIRECTIVE_REQUIRES] = { "REQUIRES", 8 },
+    [DIRECTIVE_UNSUPPORTED] = { "UNSUPPORTED", 11 },
+    [DIRECTIVE_XFAIL] = { "XFAIL", 5 },
+    [DIRECTIVE_ALLOW_RETRIES] = { "ALLOW_RETRIES", 13 },
+    [DIRECTIVE_LIMIT] = { "LIMIT", 5 },
+    [DIRECTIVE_DEPENDS] = { "DEPENDS", 7 },
+    [DIRECTIVE_STEP_TIMEOUT] = { "STEP_TIMEOUT", 12 },
+    [DIRECTIVE_TIMEOUT] = { "TIMEOUT", 7 },
+};
+
+/* Splits a REQUIRES/UNSUPPORTED value into comma-separated entries.  An entry
+ * that uses boolean operators is kept whole as an expression; plain entries
+ * are further split on spaces, as older test files rely on. */
+static void
+split_feature_list(const char *s, const char *e, vecstr *out)
+{
+    while (s < e) {
+        const char *item = s;
+        while (s < e && *s != ',')
+            s++;
+        const char *item_end = s;
+        if (s < e)
+            s++;
+        while (item < item_end && isspace((unsigned char)*item))
+            item++;
+        while (item_end > item && isspace((unsigned char)item_end[-1]))
+            item_end--;
+        bool is_expr = false;
+        for (const char *c = item; c < item_end; c++)
+            if (strchr("!&|()", *c))
+                is_expr = true;
+        if (is_expr) {
+            vecstr_push_n(out, item, (size_t)(item_end - item));
+            continue;
+        }
+        while (item < item_end) {
+            while (item < item_end && *item == ' ')
+                item++;
+            const char *tok = item;
+            while (item < item_end && *item != ' ')
+                item++;
+            if (item > tok)
+                vecstr_push_n(out, tok, (size_t)(item - tok));
+        }
+    }
+}
+
+static void
+apply_directive(directive_kind kind, const char *s, const char *e,
+                test_directives *d)
+{
+    if (kind == DIRECTIVE_REQUIRES) {
+        split_feature_list(s, e, &d->reqs);
+        return;
+    }
+    if (kind == DIRECTIVE_UNSUPPORTED) {
+        split_feature_list(s, e, &d->uns);
+        return;
+    }
+    if (kind == DIRECTIVE_DEPENDS) {
+        /* paths separated by commas or blanks */
+        while (s < e) {
+            while (s < e && (*s == ',' || isspace((unsigned char)*s)))
+                s++;
+            const char *tok = s;
+            while (s < e && *s != ',' && !isspace((unsigned char)*s))
+                s++;
+            if (s > tok)
+                vecstr_push_n(&d->depends, tok, (size_t)(s - tok));
+        }
+        return;
+    }
+    while (s < e && isspace((unsigned char)*s))
+        s++;
+    if (kind == DIRECTIVE_XFAIL) {
+        free(d->xfail_reason);
+        d->xfail_reason = NULL;
+        if (s < e)
+            d->xfail_reason = xmemdup(s, (size_t)(e - s));
+        d->xfail = true;
+        return;
+    }
+    if (kind == DIRECTIVE_LIMIT || kind == DIRECTIVE_TIMEOUT ||
+        kind == DIRECTIVE_STEP_TIMEOUT) {
+        while (e > s && isspace((unsigned char)e[-1]))
+            e--;
+        if (kind == DIRECTIVE_LIMIT) {
+            if (s < e)
+                vecstr_push_n(&d->limits, s, (size_t)(e - s));
+            return;
+        }
+        char **slot = kind == DIRECTIVE_TIMEOUT ? &d->timeout : &d->step_timeout;
+        free(*slot);
+        *slot = xmemdup(s, (size_t)(e - s));
+        return;
+    }
+    unsigned long v = 0;
+    const char *p = s;
+    while (p < e && isdigit((unsigned char)*p) && v <= UINT_MAX)
+        v = v * 10 + (unsigned long)(*p++ - '0');
+    if (p == s || p != e || v > UINT_MAX) {
+        d->bad_allow_retries++;
+        return;
+    }
+    d->allow_retries = (unsigned)v;
+    d->have_allow_retries = true;
+}
+
+/* Scans a whole test file in one pass.  Directive keywords are recognised by
+ * looking back from each ':' found with memchr, so lines without a colon are
+ * skipped wholesale unless a RUN continuation is pending.  RUN lines ending in
+ * a backslash continue on the next line; commands have no length limit. */
+static void
+scan_test_directives(const char *data, size_t size, test_directives *d)
+{
+    const char *p = data;
+    const char *end = data + size;
+    strbuf pending = {0};
+    bool have_pending = false;
+    while (p < end) {
+        if (!have_pending) {
+            const char *colon = memchr(p, ':', (size_t)(end - p));
+            if (!colon)
+                break;
+            const char *bol = colon;
+            while (bol > p && bol[-1] != '\n')
+                bol--;
+            p = bol;
+        }
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol)
+            eol = end;
+        const char *line = p;
+        const char *e = eol;
+        p = eol < end ? eol + 1 : end;
+        while (e > line && (unsigned char)e[-1] <= ' ')
+            e--;
+
+        unsigned seen = 0;
+        for (const char *c = line; (c = memchr(c, ':', (size_t)(e - c))); c++) {
+            for (int k = 0; k < DIRECTIVE_COUNT; k++) {
+                size_t len = directive_names[k].len;
+                if ((seen & (1u << k)) || (size_t)(c - line) < len ||
+                    memcmp(c - len, directive_names[k].name, len) != 0)
+                    continue;
+                seen |= 1u << k;
+                apply_directive((directive_kind)k, c + 1, e, d);
+                break;
+            }
+        }
+
+        const char *body = comment_run_body(line, e);
+        if (!body && !have_pending)
+            continue;
+        if (!body)
+            body = line;
+        if (have_pending)
+            strbuf_append(&pending, " ", 1);
+        strbuf_append(&pending, body, (size_t)(e - body));
+        if (pending.n > 0 && pending.v[pending.n - 1] == '\\') {
+            pending.v[--pending.n] = '\0';
+            have_pending = true;
+            continue;
+        }
+        vecstr_push(&d->runs, pending.v);
+        pending.n = 0;
+        have_pending = false;
+    }
+    if (have_pending)
+        vecstr_push(&d->runs, pending.v);
+    free(pending.v);
+}
+
+/* Maps path and scans it; files that cannot be mapped (empty files, pipes)
+ * are read instead.  Returns false with errno set on failure and fills st
+ * from the open descriptor on success. */
+static bool
+parse_test_directives(const char *path, struct stat *st, test_directives *d)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, st) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return false;
+    }
+    if (S_ISREG(st->st_mode) && st->st_size > 0) {
+        void *m = mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            scan_test_directives(m, (size_t)st->st_size, d);
+            munmap(m, (size_t)st->st_size);
+            close(fd);
+            return true;
+        }
+    }
+    strbuf buf = {0};
+    char chunk[65536];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            int err = errno;
+            free(buf.v);
+            close(fd);
+            errno = err;
+            return false;
+        }
+        strbuf_append(&buf, chunk, (size_t)n);
+    }
+    close(fd);
+    scan_test_directives(buf.v ? buf.v : "", buf.n, d);
+    free(buf.v);
+    return true;
+}
+
+static void
+test_directives_copy(test_directives *dst, const test_directives *src)
+{
+    memset(dst, 0, sizeof(*dst));
+    for (size_t i = 0; i < src->runs.n; i++)
+        vecstr_push(&dst->runs, src->runs.v[i]);
+    for (size_t i = 0; i < src->reqs.n; i++)
+        vecstr_push(&dst->reqs, src->reqs.v[i]);
+    for (size_t i = 0; i < src->uns.n; i++)
+        vecstr_push(&dst->uns, src->uns.v[i]);
+    for (size_t i = 0; i < src->limits.n; i++)
+        vecstr_push(&dst->limits, src->limits.v[i]);
+    for (size_t i = 0; i < src->depends.n; i++)
+        vecstr_push(&dst->depends, src->depends.v[i]);
+    dst->timeout = src->timeout ? xstrdup(src->timeout) : NULL;
+    dst->step_timeout = src->step_timeout ? xstrdup(src->step_timeout) : NULL;
+    dst->xfail = src->xfail;
+    dst->xfail_reason = src->xfail_reason ? xstrdup(src->xfail_reason) : NULL;
+    dst->allow_retries = src->allow_retries;
+    dst->have_allow_retries = src->have_allow_retries;
+    dst->bad_allow_retries = src->bad_allow_retries;
+}
+
+/* Parsed directives are cached in STATE/index so unchanged tests are never
+ * re-read.  Entries are keyed by resolved path and only trusted while the
+ * file's device, inode, size, mtime and ctime all match.  Timestamps are
+ * compared at one-second resolution, so files modified within the last two
+ * seconds are not cached at all (the "racy" rule git uses for its index).
+ *
+ * The file starts with INDEX_MAGIC and holds one record per parse:
+ *
+ *   F dev ino size mtime ctime path
+ *   R run-command        (repeated)
+ *   Q requires-entry     (repeated)
+ *   U unsupported-entry  (repeated)
+ *   L limit-spec         (repeated)
+ *   P depends-path       (repeated)
+ *   T duration           (when TIMEOUT)
+ *   S duration           (when STEP_TIMEOUT)
+ *   X [reason]           (when XFAIL)
+ *   A retries            (when ALLOW_RETRIES)
+ *   B count              (invalid ALLOW_RETRIES lines)
+ *   E
+ *
+ * with tab separators.  Records are appended with a single write() by
+ * whichever process parsed the file; later records win, and the main
+ * process compacts the file once it is mostly stale. */
+#define INDEX_MAGIC "tikl-index 6"
+typedef struct {
+    unsigned long long dev, ino;
+    long long size, mtime, ctime;
+} file_identity;
+typedef struct {
+    file_identity id;
+    test_directives d;
+} index_entry;
+typedef struct {
+    index_entry *v;
+    size_t n, cap;
+    strmap map;
+    size_t records;
+} directive_index;
+static directive_index dindex = {0};
+static int index_fd = -1;
+
+static file_identity
+identity_of(const struct stat *st)
+{
+    file_identity id = {
+        .dev = (unsigned long long)st->st_dev,
+        .ino = (unsigned long long)st->st_ino,
+        .size = (long long)st->st_size,
+        .mtime = (long long)st->st_mtime,
+        .ctime = (long long)st->st_ctime,
+    };
+    return id;
+}
+
+static bool
+identity_equal(const file_identity *a, const file_identity *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime == b->mtime && a->ctime == b->ctime;
+}
+
+/* Takes ownership of d. */
+static void
+index_put(const char *path, const file_identity *id, test_directives *d)
+{
+    unsigned long *slot = strmap_put(&dindex.map, path);
+    if (*slot == 0) {
+        if (dindex.n == dindex.cap) {
+            dindex.cap = dindex.cap ? dindex.cap * 2 : 64;
+            dindex.v = xrealloc(dindex.v, dindex.cap * sizeof(*dindex.v));
+        }
+        memset(&dindex.v[dindex.n], 0, sizeof(dindex.v[dindex.n]));
+        *slot = ++dindex.n;
+    }
+    index_entry *e = &dindex.v[*slot - 1];
+    test_directives_free(&e->d);
+    e->id = *id;
+    e->d = *d;
+    memset(d, 0, sizeof(*d));
+}
+
+static void
+index_free(void)
+{
+    for (size_t i = 0; i < dindex.n; i++)
+        test_directives_free(&dindex.v[i].d);
+    free(dindex.v);
+    strmap_free(&dindex.map);
+    memset(&dindex, 0, sizeof(dindex));
+}
+
+static void
+load_directive_index(void)
+{
+    char path[PATH_MAX];
+    if (!state_path(path, sizeof(path), "index"))
+        return;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n = getline(&line, &cap, f);
+    bool ok = n > 0 && strcmp(line, INDEX_MAGIC "\n") == 0;
+    char *rec_path = NULL;
+    file_identity id = {0};
+    test_directives d = {0};
+    while (ok && (n = getline(&line, &cap, f)) != -1) {
+        if (n == 0 || line[n - 1] != '\n') {
+            break;
+        }
+        line[n - 1] = '\0';
+        char tag = line[0];
+        const char *val = (line[0] && line[1] == '\t') ? line + 2 : NULL;
+        if (tag == 'F' && val) {
+            free(rec_path);
+            rec_path = NULL;
+            test_directives_free(&d);
+            char *end = NULL;
+            id.dev = strtoull(val, &end, 10);
+            id.ino = strtoull(end, &end, 10);
+            id.size = strtoll(end, &end, 10);
+            id.mtime = strtoll(end, &end, 10);
+            id.ctime = strtoll(end, &end, 10);
+            if (*end == '\t' && end[1] == '/')
+                rec_path = xstrdup(end + 1);
+            continue;
+        }
+        if (!rec_path)
+            continue;
+        switch (tag) {
+            case 'R':
+                if (val)
+                    vecstr_push(&d.runs, val);
+                break;
+            case 'Q':
+                if (val)
+                    vecstr_push(&d.reqs, val);
+                break;
+            case 'U':
+                if (val)
+                    vecstr_push(&d.uns, val);
+                break;
+            case 'L':
+                if (val)
+                    vecstr_push(&d.limits, val);
+                break;
+            case 'P':
+                if (val)
+                    vecstr_push(&d.depends, val);
+                break;
+            case 'T':
+            case 'S': {
+                    char **slot = tag == 'T' ? &d.timeout : &d.step_timeout;
+                    free(*slot);
+                    *slot = xstrdup(val ? val : "");
+                    break;
+                }
+            case 'X':
+                d.xfail = true;
+                free(d.xfail_reason);
+                d.xfail_reason = (val && *val) ? xstrdup(val) : NULL;
+                break;
+            case 'A':
+                if (val) {
+                    d.allow_retries = (unsigned)strtoul(val, NULL, 10);
+                    d.have_allow_retries = true;
+                }
+                break;
+            case 'B':
+                if (val)
+                    d.bad_allow_retries = (unsigned)strtoul(val, NULL, 10);
+                break;
+            case 'E':
+                index_put(rec_path, &id, &d);
+                dindex.records++;
+                free(rec_path);
+                rec_path = NULL;
+                break;
+            default:
+                break;
+        }
+    }
+    free(rec_path);
+    test_directives_free(&d);
+    free(line);
+    fclose(f);
+}
+
+static void
+append_record_field(char **buf, size_t *len, size_t *cap, char tag,
+                    const char *val)
+{
+    size_t vl = val ? strlen(val) : 0;
+    if (*len + vl + 4 > *cap) {
+        *cap = (*len + vl + 4) * 2;
+        *buf = xrealloc(*buf, *cap);
+    }
+    (*buf)[(*len)++] = tag;
+    if (val) {
+        (*buf)[(*len)++] = '\t';
+        memcpy(*buf + *len, val, vl);
+        *len += vl;
+    }
+    (*buf)[(*len)++] = '\n';
+}
+
+static char *
+encode_index_record(const char *path, const file_identity *id,
+                    const test_directives *d, size_t *len_out)
+{
+    size_t cap = strlen(path) + 128;
+    char *buf = xrealloc(NULL, cap);
+    size_t len = (size_t)snprintf(buf, cap, "F\t%llu %llu %lld %lld %lld\t%s\n",
+                                  id->dev, id->ino, id->size, id->mtime,
+                                  id->ctime, path);
+    for (size_t i = 0; i < d->runs.n; i++)
+        append_record_field(&buf, &len, &cap, 'R', d->runs.v[i]);
+    for (size_t i = 0; i < d->reqs.n; i++)
+        append_record_field(&buf, &len, &cap, 'Q', d->reqs.v[i]);
+    for (size_t i = 0; i < d->uns.n; i++)
+        append_record_field(&buf, &len, &cap, 'U', d->uns.v[i]);
+    for (size_t i = 0; i < d->limits.n; i++)
+        append_record_field(&buf, &len, &cap, 'L', d->limits.v[i]);
+    for (size_t i = 0; i < d->depends.n; i++)
+        append_record_field(&buf, &len, &cap, 'P', d->depends.v[i]);
+    if (d->timeout)
+        append_record_field(&buf, &len, &cap, 'T', d->timeout);
+    if (d->step_timeout)
+        append_record_field(&buf, &len, &cap, 'S', d->step_timeout);
+    if (d->xfail)
+        append_record_field(&buf, &len, &cap, 'X',
+                            d->xfail_reason ? d->xfail_reason : "");
+    char num[32];
+    if (d->have_allow_retries) {
+        snprintf(num, sizeof(num), "%u", d->allow_retries);
+        append_record_field(&buf, &len, &cap, 'A', num);
+    }
+    if (d->bad_allow_retries) {
+        snprintf(num, sizeof(num), "%u", d->bad_allow_retries);
+        append_record_field(&buf, &len, &cap, 'B', num);
+    }
+    append_record_field(&buf, &len, &cap, 'E', NULL);
+    *len_out = len;
+    return buf;
+}
+
+static void
+open_directive_index(void)
+{
+    char path[PATH_MAX];
+    if (!state_path(path, sizeof(path), "index"))
+        return;
+    load_directive_index();
+    ensure_dir(state_dir);
+    bool fresh = dindex.records == 0;
+    index_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | (fresh ? O_TRUNC : 0),
+                    0644);
+    if (index_fd < 0)
+        return;
+    fcntl(index_fd, F_SETFD, FD_CLOEXEC);
+    if (fresh) {
+        ssize_t w = write(index_fd, INDEX_MAGIC "\n", strlen(INDEX_MAGIC "\n"));
+        (void)w;
+    }
+}
+
+static void
+index_store(const char *path, const struct stat *st, const test_directives *d)
+{
+    if (index_fd < 0 || strchr(path, '\n'))
+        return;
+    for (size_t i = 0; i < d->runs.n; i++)
+        if (strchr(d->runs.v[i], '\n'))
+            return;
+    if (st->st_mtime >= time(NULL) - 1)
+        return;
+    file_identity id = identity_of(st);
+    size_t len = 0;
+    char *rec = encode_index_record(path, &id, d, &len);
+    ssize_t w = write(index_fd, rec, len);
+    (void)w;
+    free(rec);
+    test_directives copy;
+    test_directives_copy(&copy, d);
+    index_put(path, &id, &copy);
+}
+
+/* Rewrites the index without superseded records once they dominate. */
+static void
+compact_directive_index(void)
+{
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    if (index_fd < 0 || !state_path(path, sizeof(path), "index"))
+        return;
+    close(index_fd);
+    index_fd = -1;
+    index_free();
+    load_directive_index();
+    if (dindex.records <= 2 * dindex.n + 64)
+        return;
+    if (snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path,
+                 (long)getpid()) >= (int)sizeof(tmp))
+        return;
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        return;
+    fputs(INDEX_MAGIC "\n", f);
+    for (size_t i = 0; i < dindex.map.cap; i++) {
+        const strmap_slot *slot = &dindex.map.v[i];
+        if (!slot->key)
+            continue;
+        const index_entry *e = &dindex.v[slot->val - 1];
+        size_t len = 0;
+        char *rec = encode_index_record(slot->key, &e->id, &e->d, &len);
+        fwrite(rec, 1, len, f);
+        free(rec);
+    }
+    if (fclose(f) != 0 || rename(tmp, path) != 0)
+        unlink(tmp);
+}
+
+/* Fills d from the index when the file is unchanged, parsing it otherwise.
+ * Returns false (after reporting) when the file cannot be read. */
+static bool
+load_test_directives(const char *path, const char *testpath_abs,
+                     test_directives *d, bool warn)
+{
+    struct stat st;
+    bool cached = false;
+    if (stat(testpath_abs, &st) == 0) {
+        unsigned long *slot = strmap_get(&dindex.map, testpath_abs);
+        file_identity id = identity_of(&st);
+        if (slot && identity_equal(&dindex.v[*slot - 1].id, &id)) {
+            test_directives_copy(d, &dindex.v[*slot - 1].d);
+            cached = true;
+        }
+    }
+    if (!cached) {
+        if (!parse_test_directives(testpath_abs, &st, d)) {
+            fprintf(stderr, "open %s: %s\n", testpath_abs, strerror(errno));
+            test_directives_free(d);
+            return false;
+        }
+        index_store(testpath_abs, &st, d);
+    }
+    for (unsigned i = 0; warn && i < d->bad_allow_retries; i++)
+        fprintf(stderr, "%s: invalid ALLOW_RETRIES directive\n", path);
+    return true;
+}
+
+/* Whether path is a text file (no NUL byte in its first block) that says
+ * "RUN:" anywhere.  Much cheaper than a directive scan, and it leaves
+ * nothing in the index for the files it turns down. */
+static bool
+file_mentions_run(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    bool found = false;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t size = (size_t)st.st_size;
+        void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            const char *p = m, *end = p + size;
+            if (!memchr(p, '\0', size < 4096 ? size : 4096)) {
+                while (!found && (p = memchr(p, 'R', (size_t)(end - p))) != NULL) {
+                    found = end - p >= 4 && memcmp(p, "RUN:", 4) == 0;
+                    p++;
                 }
+            }
+            munmap(m, size);
+        }
+    }
+    close(fd);
+    return found;
+}
+
+/* Without --suffix a directory walk keeps only files that have RUN lines, so
+ * READMEs and inputs next to the tests are not run.  Binaries and files that
+ * never say RUN: are turned down up front; the rest are looked up through
+ * the index, which the run itself reuses. */
+static bool
+walked_file_is_test(const char *path)
+{
+    char abs[PATH_MAX];
+    test_directives d = {0};
+    if (!file_mentions_run(path))
+        return false;
+    if (!realpath(path, abs) || !load_test_directives(path, abs, &d, false))
+        return false;
+    bool runs = d.runs.n > 0;
+    test_directives_free(&d);
+    return runs;
+}
+
+/* --cache: a test whose inputs hash the same as at its last passing run is
+ * reported OK without running.  Its key covers the test file, the files its
+ * DEPENDS: lines name (relative to the test's directory) and a run key over
+ * the tikl and tikl-check binaries, the config substitutions, the -D
+ * features and the options that change how steps run.  Environment
+ * variables are not part of it; --rerun runs everything and refreshes the
+ * cache.
+ *
+ * STATE/results holds "KEY\tPATH" lines, with KEY "-" once a test ran
+ * without passing, and STATE/hashes "dev ino size mtime ctime HASH\tPATH"
+ * lines, so files whose identity is unchanged are not read again (racy
+ * files are not kept, as for the index).  Both are appended to with single
+ * write()s by whichever process learns something, later lines win, and the
+ * main process compacts them like the index.  Hashes are 64-bit FNV-1a. */
+#define RESULTS_MAGIC "tikl-results 1"
+#define HASHES_MAGIC "tikl-hashes 1"
+typedef enum {
+    CACHE_OFF,
+    CACHE_ON,
+    CACHE_RERUN,
+} cache_mode;
+typedef struct {
+    file_identity id;
+    unsigned long long hash;
+} file_hash;
+typedef struct {
+    bool loaded;
+    bool lookup, record;
+    unsigned long long run_key;
+    strmap hash_map;
+    file_hash *hashes;
+    size_t nhashes, hashes_cap, hash_records;
+    strmap pass_map;
+    unsigned long long *passes;     /* 0 once the test did not pass */
+    size_t npasses, passes_cap, pass_records;
+    int hashes_fd, results_fd;
+} result_cache;
+static result_cache rcache = { .hashes_fd = -1, .results_fd = -1 };
+static char tikl_exe_path[PATH_MAX];
+static char tikl_check_exe_path[PATH_MAX];
+
+#define FNV64_OFFSET 14695981039346656037ull
+
+static unsigned long long
+fnv1a64(unsigned long long h, const void *data, size_t n)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static unsigned long long
+fnv1a64_str(unsigned long long h, const char *s)
+{
+    /* with the terminator, so adjacent strings cannot run together */
+    return fnv1a64(h, s, strlen(s) + 1);
+}
+
+static void
+cache_put_hash(const char *path, const file_identity *id,
+               unsigned long long hash)
+{
+    unsigned long *slot = strmap_put(&rcache.hash_map, path);
+    if (*slot == 0) {
+        if (rcache.nhashes == rcache.hashes_cap) {
+            rcache.hashes_cap = rcache.hashes_cap ? rcache.hashes_cap * 2 : 64;
+            rcache.hashes = xrealloc(rcache.hashes,
+                                     rcache.hashes_cap * sizeof(*rcache.hashes));
+        }
+        *slot = ++rcache.nhashes;
+    }
+    rcache.hashes[*slot - 1] = (file_hash) {
+        .id = *id, .hash = hash
+    };
+}
+
+static void
+cache_put_pass(const char *path, unsigned long long key)
+{
+    unsigned long *slot = strmap_put(&rcache.pass_map, path);
+    if (*slot == 0) {
+        if (rcache.npasses == rcache.passes_cap) {
+            rcache.passes_cap = rcache.passes_cap ? rcache.passes_cap * 2 : 64;
+            rcache.passes = xrealloc(rcache.passes,
+                                     rcache.passes_cap * sizeof(*rcache.passes));
+        }
+        *slot = ++rcache.npasses;
+    }
+    rcache.passes[*slot - 1] = key;
+}
+
+static void
+load_result_cache(void)
+{
+    char path[PATH_MAX];
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    FILE *f = state_path(path, sizeof(path), "hashes") ? fopen(path, "r") : NULL;
+    if (f && getline(&line, &cap, f) > 0 &&
+        strcmp(line, HASHES_MAGIC "\n") == 0) {
+        while ((n = getline(&line, &cap, f)) > 0 && line[n - 1] == '\n') {
+            line[n - 1] = '\0';
+            file_identity id;
+            char *end = NULL;
+            id.dev = strtoull(line, &end, 10);
+            id.ino = strtoull(end, &end, 10);
+            id.size = strtoll(end, &end, 10);
+            id.mtime = strtoll(end, &end, 10);
+            id.ctime = strtoll(end, &end, 10);
+            unsigned long long hash = strtoull(end, &end, 16);
+            if (*end != '\t' || end[1] != '/')
+                continue;
+            cache_put_hash(end + 1, &id, hash);
+            rcache.hash_records++;
+        }
+    }
+    if (f)
+        fclose(f);
+    f = state_path(path, sizeof(path), "results") ? fopen(path, "r") : NULL;
+    if (f && getline(&line, &cap, f) > 0 &&
+        strcmp(line, RESULTS_MAGIC "\n") == 0) {
+        while ((n = getline(&line, &cap, f)) > 0 && line[n - 1] == '\n') {
+            line[n - 1] = '\0';
+            char *end = NULL;
+            unsigned long long key = line[0] == '-' ? 0 :
+                                     strtoull(line, &end, 16);
+            if (line[0] == '-')
+                end = line + 1;
+            if (*end != '\t' || end[1] != '/')
+                continue;
+            cache_put_pass(end + 1, key);
+            rcache.pass_records++;
+        }
+    }
+    if (f)
+        fclose(f);
+    free(line);
+}
+
+static int
+open_state_log(const char *leaf, const char *magic, bool fresh)
+{
+    char path[PATH_MAX];
+    if (!state_path(path, sizeof(path), leaf))
+        return -1;
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC |
+                  (fresh ? O_TRUNC : 0), 0644);
+    if (fd >= 0 && fresh)
+        write_all(fd, magic, strlen(magic));
+    return fd;
+}
+
+/* Loads the cache once per process; a daemon keeps it across runs. */
+static void
+open_result_cache(void)
+{
+    if (rcache.loaded)
+        return;
+    rcache.loaded = true;
+    load_result_cache();
+    ensure_dir(state_dir);
+    rcache.hashes_fd = open_state_log("hashes", HASHES_MAGIC "\n",
+                                      rcache.hash_records == 0);
+    rcache.results_fd = open_state_log("results", RESULTS_MAGIC "\n",
+                                       rcache.pass_records == 0);
+}
+
+/* Content hash of path, read only when its identity changed since it was
+ * last hashed.  Returns false for files that cannot be read. */
+static bool
+hash_file(const char *path, unsigned long long *out)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+    file_identity id = identity_of(&st);
+    unsigned long *slot = strmap_get(&rcache.hash_map, path);
+    if (slot && identity_equal(&rcache.hashes[*slot - 1].id, &id)) {
+        *out = rcache.hashes[*slot - 1].hash;
+        return true;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    unsigned long long h = FNV64_OFFSET;
+    char buf[65536];
+    ssize_t r;
+    while ((r = read(fd, buf, sizeof(buf))) != 0) {
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return false;
+        }
+        h = fnv1a64(h, buf, (size_t)r);
+    }
+    close(fd);
+    *out = h;
+    /* ctime too: a rewrite that kept size and a back-dated mtime only
+     * shows there */
+    time_t racy = time(NULL) - 1;
+    if (st.st_mtime >= racy || st.st_ctime >= racy || strchr(path, '\n'))
+        return true;
+    cache_put_hash(path, &id, h);
+    if (rcache.hashes_fd >= 0) {
+        strbuf rec = {0};
+        strbuf_printf(&rec, "%llu %llu %lld %lld %lld %016llx\t%s\n", id.dev,
+                      id.ino, id.size, id.mtime, id.ctime, h, path);
+        write_all(rcache.hashes_fd, rec.v, rec.n);
+        free(rec.v);
+    }
+    return true;
+}
+
+static int
+cmp_str_ptr(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Sets up --cache for one run and computes its run key.  Without a state
+ * directory, or when the tikl binary cannot be hashed, nothing is cached. */
+static void
+begin_result_cache(cache_mode mode, const mapkv *subs, const vecstr *features)
+{
+    rcache.lookup = rcache.record = false;
+    rcache.run_key = 0;
+    if (mode == CACHE_OFF)
+        return;
+    if (!state_dir) {
+        fprintf(stderr, "tikl: --cache needs a state directory\n");
+        return;
+    }
+    open_result_cache();
+    unsigned long long h = FNV64_OFFSET, fh = 0;
+    if (!*tikl_exe_path || !hash_file(tikl_exe_path, &fh))
+        return;
+    h = fnv1a64(h, &fh, sizeof(fh));
+    /* a missing tikl-check hashes as 0 */
+    fh = 0;
+    if (*tikl_check_exe_path && !hash_file(tikl_check_exe_path, &fh))
+        fh = 0;
+    h = fnv1a64(h, &fh, sizeof(fh));
+    for (size_t i = 0; subs && i < subs->n; i++) {
+        h = fnv1a64_str(h, subs->v[i].key);
+        h = fnv1a64_str(h, subs->v[i].val);
+    }
+    h = fnv1a64_str(h, "");
+    if (features && features->n > 0) {
+        char **sorted = xrealloc(NULL, features->n * sizeof(*sorted));
+        memcpy(sorted, features->v, features->n * sizeof(*sorted));
+        qsort(sorted, features->n, sizeof(*sorted), cmp_str_ptr);
+        for (size_t i = 0; i < features->n; i++)
+            h = fnv1a64_str(h, sorted[i]);
+        free(sorted);
+    }
+    h = fnv1a64_str(h, "");
+    unsigned long long opts[] = {
+        lit_compat, timeout_ms, auto_timeout.on, kill_grace_ms,
+    };
+    h = fnv1a64(h, opts, sizeof(opts));
+    h = fnv1a64(h, default_limits.v, sizeof(default_limits.v));
+    rcache.run_key = h;
+    rcache.lookup = mode == CACHE_ON;
+    rcache.record = true;
+}
+
+/* The cache key of a test, or 0 when it cannot be cached: caching is off,
+ * or the test or one of its DEPENDS: files cannot be read. */
+static unsigned long long
+cache_test_key(const char *testpath_abs, const test_directives *d)
+{
+    if (!rcache.record)
+        return 0;
+    unsigned long long h = rcache.run_key, fh;
+    if (!hash_file(testpath_abs, &fh))
+        return 0;
+    h = fnv1a64(h, &fh, sizeof(fh));
+    const char *slash = strrchr(testpath_abs, '/');
+    int dirlen = (int)(slash - testpath_abs);
+    for (size_t i = 0; i < d->depends.n; i++) {
+        const char *dep = d->depends.v[i];
+        char path[PATH_MAX];
+        int n = dep[0] == '/' ? snprintf(path, sizeof(path), "%s", dep) :
+                snprintf(path, sizeof(path), "%.*s/%s", dirlen, testpath_abs,
+                         dep);
+        if (n < 0 || (size_t)n >= sizeof(path) || !hash_file(path, &fh))
+            return 0;
+        h = fnv1a64_str(h, path);
+        h = fnv1a64(h, &fh, sizeof(fh));
+    }
+    return h ? h : 1;
+}
+
+static bool
+cache_hit(const char *testpath_abs, unsigned long long key)
+{
+    if (!rcache.lookup || key == 0)
+        return false;
+    unsigned long *slot = strmap_get(&rcache.pass_map, testpath_abs);
+    return slot && rcache.passes[*slot - 1] == key;
+}
+
+/* Records how a test with the given key went: its key when it passed, "-"
+ * when it did not and an earlier pass is on record. */
+static void
+cache_store(const char *testpath_abs, unsigned long long key, bool passed)
+{
+    if (!rcache.record || key == 0 || strchr(testpath_abs, '\n'))
+        return;
+    unsigned long *slot = strmap_get(&rcache.pass_map, testpath_abs);
+    unsigned long long old = slot ? rcache.passes[*slot - 1] : 0;
+    unsigned long long now = passed ? key : 0;
+    if (old == now)
+        return;
+    cache_put_pass(testpath_abs, now);
+    if (rcache.results_fd < 0)
+        return;
+    strbuf rec = {0};
+    if (passed)
+        strbuf_printf(&rec, "%016llx\t%s\n", key, testpath_abs);
+    else
+        strbuf_printf(&rec, "-\t%s\n", testpath_abs);
+    write_all(rcache.results_fd, rec.v, rec.n);
+    free(rec.v);
+}
+
+static int
+report_cached_test(FILE *out, const char *path, bool quiet, test_result *res)
+{
+    if (!quiet)
+        fprintf(out, "[  OK ] %s (cached)\n", path);
+    res->status = TEST_OK;
+    res->exit_code = 0;
+    res->cached = true;
+    return 0;
+}
+
+static void
+result_cache_free(void)
+{
+    if (rcache.hashes_fd >= 0)
+        close(rcache.hashes_fd);
+    if (rcache.results_fd >= 0)
+        close(rcache.results_fd);
+    strmap_free(&rcache.hash_map);
+    strmap_free(&rcache.pass_map);
+    free(rcache.hashes);
+    free(rcache.passes);
+    memset(&rcache, 0, sizeof(rcache));
+    rcache.hashes_fd = rcache.results_fd = -1;
+}
+
+/* Rewrites STATE/hashes and STATE/results without superseded lines once
+ * those dominate. */
+static void
+compact_result_cache(void)
+{
+    if (!rcache.loaded)
+        return;
+    result_cache_free();
+    load_result_cache();
+    for (int k = 0; k < 2; k++) {
+        const strmap *m = k ? &rcache.pass_map : &rcache.hash_map;
+        size_t records = k ? rcache.pass_records : rcache.hash_records;
+        const char *leaf = k ? "results" : "hashes";
+        char path[PATH_MAX];
+        char tmp[PATH_MAX];
+        if (records <= 2 * m->n + 64 || !state_path(path, sizeof(path), leaf) ||
+            snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path,
+                     (long)getpid()) >= (int)sizeof(tmp))
+            continue;
+        FILE *f = fopen(tmp, "w");
+        if (!f)
+            continue;
+        fputs(k ? RESULTS_MAGIC "\n" : HASHES_MAGIC "\n", f);
+        for (size_t i = 0; i < m->cap; i++) {
+            const strmap_slot *slot = &m->v[i];
+            if (!slot->key)
                 continue;
+            if (k) {
+                unsigned long long key = rcache.passes[slot->val - 1];
+                if (key)
+                    fprintf(f, "%016llx\t%s\n", key, slot->key);
+                continue;
+            }
+            const file_hash *e = &rcache.hashes[slot->val - 1];
+            fprintf(f, "%llu %llu %lld %lld %lld %016llx\t%s\n", e->id.dev,
+                    e->id.ino, e->id.size, e->id.mtime, e->id.ctime, e->hash,
+                    slot->key);
+        }
+        if (fclose(f) != 0 || rename(tmp, path) != 0)
+            unlink(tmp);
+    }
+    result_cache_free();
+}
+
+typedef enum {
+    GATE_RUN,
+    GATE_SKIP,
+    GATE_BAD,
+} gate_result;
+
+static bool
+is_feature_expr(const char *entry)
+{
+    return strpbrk(entry, "!&|()") != NULL;
+}
+
+/* Decides whether REQUIRES/UNSUPPORTED let the test run.  On GATE_SKIP *why
+ * and *entry describe the first failing gate; on GATE_BAD *entry is the
+ * malformed expression. */
+static gate_result
+check_feature_gates(const test_directives *d, vecstr *features,
+                    const char **why, const char **entry)
+{
+    for (size_t i = 0; i < d->reqs.n; i++) {
+        int r = eval_feature_expr(d->reqs.v[i], features);
+        *entry = d->reqs.v[i];
+        if (r < 0)
+            return GATE_BAD;
+        if (r == 0) {
+            *why = is_feature_expr(*entry) ? "unsatisfied requirement"
+                   : "missing feature";
+            return GATE_SKIP;
+        }
+    }
+    for (size_t i = 0; i < d->uns.n; i++) {
+        int r = eval_feature_expr(d->uns.v[i], features);
+        *entry = d->uns.v[i];
+        if (r < 0)
+            return GATE_BAD;
+        if (r == 1) {
+            *why = "unsupported on feature";
+            return GATE_SKIP;
+        }
+    }
+    return GATE_RUN;
+}
+
+static int
+report_gated_test(FILE *out, const char *path, gate_result gate,
+                  const char *why, const char *entry, bool quiet,
+                  test_result *res)
+{
+    if (!quiet)
+        fprintf(out, "[ RUN ] %s\n", path);
+    if (gate == GATE_BAD) {
+        if (!quiet)
+            fprintf(out, "[ FAIL] %s (invalid feature expression: %s)\n", path,
+                    entry);
+        res->status = TEST_FAIL;
+        res->exit_code = 1;
+        return 1;
+    }
+    if (!quiet)
+        fprintf(out, "[ SKIP] %s (%s: %s)\n", path, why, entry);
+    size_t n = strlen(why) + strlen(entry) + 3;
+    res->skip_reason = xrealloc(NULL, n);
+    snprintf(res->skip_reason, n, "%s: %s", why, entry);
+    res->status = TEST_SKIP;
+    res->exit_code = 0;
+    return 0;
+}
+
+/* Evaluates the feature gates and --cache of path in the -j parent so gated
+ * and cached tests never cost a worker.  Returns -1 when the test has to
+ * run, otherwise reports it to out the way run_test_file() would and
+ * returns its exit code. */
+static int
+pregate_test_file(FILE *out, const char *path, vecstr *features, bool quiet,
+                  test_result *res)
+{
+    char testpath_abs[PATH_MAX];
+    if (!resolve_test_path(path, testpath_abs, sizeof(testpath_abs)))
+        return -1;
+    test_directives d = {0};
+    if (!load_test_directives(path, testpath_abs, &d, false))
+        return -1;
+    const char *why = NULL;
+    const char *entry = NULL;
+    gate_result gate = check_feature_gates(&d, features, &why, &entry);
+    int rc = -1;
+    if (gate != GATE_RUN) {
+        result_reset(res);
+        for (unsigned i = 0; i < d.bad_allow_retries; i++)
+            fprintf(out, "%s: invalid ALLOW_RETRIES directive\n", path);
+        rc = report_gated_test(out, path, gate, why, entry, quiet, res);
+    } else if (cache_hit(testpath_abs, cache_test_key(testpath_abs, &d))) {
+        result_reset(res);
+        rc = report_cached_test(out, path, quiet, res);
+    }
+    test_directives_free(&d);
+    return rc;
+}
+
+/* A test on its way through its RUN steps.  run_test_file() drives one to
+ * completion; the async executor keeps many of them in flight. */
+typedef struct {
+    const char *path;
+    char testpath_abs[PATH_MAX];
+    mapkv *cfgsubs;
+    bool quiet;
+    test_result *res;
+    test_directives d;
+    test_env env;
+    char *shared_tdir;
+    char shared_tfile[PATH_MAX];
+    const char *shared_scratch_T;
+    unsigned long long test_start;
+    unsigned long long trace_start, step_trace_start;
+    unsigned long budget_ms;
+    unsigned long long cache_key;
+    size_t step;
+    unsigned attempt, attempts;
+    char *cmd;
+    int rc;
+    bool xfail_hit;
+    bool auto_timed;
+    test_status failure;
+    output_capture capture;
+} test_run;
+
+/* Sets the current step's timeout.  STEP_TIMEOUT: wins over -t auto, which
+ * falls back to the plain -t value for steps without enough history. */
+static void
+test_run_arm_step(test_run *t)
+{
+    if (!auto_timeout.on || t->d.step_timeout)
+        return;
+    unsigned long *slot = strmap_get(&auto_history.index, t->testpath_abs);
+    unsigned long ms = slot ? derive_step_timeout(&auto_history.v[*slot - 1],
+                                                  t->step, &auto_timeout) : 0;
+    t->env.step_timeout_ms = ms ? ms : timeout_ms;
+    t->auto_timed = ms != 0;
+}
+
+static int
+test_run_load(test_run *t, const char *path, mapkv *cfgsubs,
+              vecstr *features, bool quiet, unsigned slot, test_result *res)
+{
+    memset(t, 0, sizeof(*t));
+    t->capture.log_fd = -1;
+    t->path = path;
+    t->cfgsubs = cfgsubs;
+    t->quiet = quiet;
+    t->res = res;
+    t->test_start = monotonic_ms();
+    t->trace_start = trace_fd >= 0 ? monotonic_us() : 0;
+    result_reset(res);
+    res->status = TEST_FAIL;
+    res->exit_code = 2;
+    if (!resolve_test_path(path, t->testpath_abs, sizeof(t->testpath_abs))) {
+        if (source_root && path && *path != '/') {
+            fprintf(stderr, "realpath %s (or %s/%s): %s\n", path, source_root,
+                    path, strerror(errno));
+        } else {
+            fprintf(stderr, "realpath %s: %s\n", path, strerror(errno));
+        }
+        return 2;
+    }
+    test_directives *d = &t->d;
+    if (!load_test_directives(path, t->testpath_abs, d, true))
+        return 2;
+    const char *gate_why = NULL;
+    const char *gate_entry = NULL;
+    gate_result gate = check_feature_gates(d, features, &gate_why, &gate_entry);
+    if (gate != GATE_RUN) {
+        int gate_rc = report_gated_test(stderr, path, gate, gate_why,
+                                        gate_entry, quiet, res);
+        if (res->status == TEST_SKIP)
+            trace_instant("skip", slot, path, res->skip_reason);
+        res->total_ms = (unsigned long)(monotonic_ms() - t->test_start);
+        test_directives_free(d);
+        return gate_rc;
+    }
+    t->cache_key = cache_test_key(t->testpath_abs, d);
+    if (cache_hit(t->testpath_abs, t->cache_key)) {
+        int cached_rc = report_cached_test(stderr, path, quiet, res);
+        res->total_ms = (unsigned long)(monotonic_ms() - t->test_start);
+        test_directives_free(d);
+        return cached_rc;
+    }
+    if (!quiet)
+        fprintf(stderr, "[ RUN ] %s\n", path);
+
+    res->status = TEST_SKIP;
+    res->exit_code = 0;
+    if (d->runs.n == 0) {
+        if (!quiet) {
+            if (d->xfail) {
+                const char *sep = (d->xfail_reason && *d->xfail_reason) ? "; " : "";
+                const char *msg = (d->xfail_reason && *d->xfail_reason) ? d->xfail_reason : "";
+                fprintf(stderr, "[XFAIL] %s (no RUN directives%s%s)\n", path, sep, msg);
+            } else {
+                fprintf(stderr, "[FAIL] %s (no RUN directives)\n", path);
+            }
+        }
+        bool xfail = d->xfail;
+        test_directives_free(d);
+        res->status = xfail ? TEST_XFAIL : TEST_FAIL;
+        res->exit_code = xfail ? 0 : 1;
+        res->total_ms = (unsigned long)(monotonic_ms() - t->test_start);
+        return xfail ? 0 : 1;
+    }
+    step_limits limits = default_limits;
+    unsigned long step_timeout = timeout_ms;
+    const char *bad = NULL;
+    const char *bad_value = NULL;
+    for (size_t i = 0; i < d->limits.n && !bad; i++)
+        if (!parse_limits(d->limits.v[i], &limits)) {
+            bad = "LIMIT";
+            bad_value = d->limits.v[i];
+        }
+    if (!bad && d->timeout && !parse_duration_ms(d->timeout, &t->budget_ms)) {
+        bad = "TIMEOUT";
+        bad_value = d->timeout;
+    }
+    if (!bad && d->step_timeout &&
+        !parse_duration_ms(d->step_timeout, &step_timeout)) {
+        bad = "STEP_TIMEOUT";
+        bad_value = d->step_timeout;
+    }
+    if (bad) {
+        if (!quiet)
+            fprintf(stderr, "[ FAIL] %s (invalid %s directive: %s)\n", path,
+                    bad, bad_value);
+        test_directives_free(d);
+        res->status = TEST_FAIL;
+        res->exit_code = 1;
+        res->total_ms = (unsigned long)(monotonic_ms() - t->test_start);
+        return 1;
+    }
+
+    unsigned long long setup_start = trace_fd >= 0 ? monotonic_us() : 0;
+    if (!test_env_init(&t->env, cfgsubs, path, t->testpath_abs)) {
+        if (!quiet)
+            fprintf(stderr, "[ FAIL] %s (cannot expand placeholders)\n", path);
+        test_env_free(&t->env);
+        test_directives_free(d);
+        res->status = TEST_FAIL;
+        res->total_ms = (unsigned long)(monotonic_ms() - t->test_start);
+        return 2;
+    }
+    prepare_shared_scratch(&t->shared_tdir, t->shared_tfile,
+                           sizeof(t->shared_tfile), &t->shared_scratch_T);
+    trace_span("tikl", "setup", slot, setup_start, path, NULL);
+    t->env.trace_tid = slot;
+    t->env.limits = limits;
+    t->env.step_timeout_ms = step_timeout;
+    t->env.deadline = suite_deadline;
+    if (t->budget_ms && (!suite_deadline ||
+                         t->test_start + t->budget_ms < suite_deadline))
+        t->env.deadline = t->test_start + t->budget_ms;
+    t->capture.log_fd = open_test_log(path);
+    t->attempts = d->have_allow_retries ? (d->allow_retries + 1) : 1;
+    if (t->attempts == 0)
+        t->attempts = 1;
+    test_run_arm_step(t);
+    res->step_ms = xrealloc(NULL, d->runs.n * sizeof(*res->step_ms));
+    res->step_usage = xrealloc(NULL, d->runs.n * sizeof(*res->step_usage));
+    return -1;
+}
+
+/* Loads and gates the test.  Returns -1 when it has steps to run, or its
+ * exit status when it was settled without running any. */
+static int
+test_run_begin(test_run *t, const char *path, mapkv *cfgsubs,
+               vecstr *features, bool quiet, unsigned slot, test_result *res)
+{
+    int rc = test_run_load(t, path, cfgsubs, features, quiet, slot, res);
+    if (rc >= 0)
+        trace_span("test", path, slot, t->trace_start, NULL,
+                   test_status_names[res->status]);
+    return rc;
+}
+
+/* The substituted command line of the current step, called as the step
+ * (or its retry) starts.  NULL when its placeholders cannot be expanded;
+ * the step then fails with status 2. */
+static const char *
+test_run_command(test_run *t)
+{
+    if (trace_fd >= 0)
+        t->step_trace_start = monotonic_us();
+    if (!t->cmd) {
+        t->cmd = perform_substitutions(t->d.runs.v[t->step], t->cfgsubs,
+                                       t->path, t->testpath_abs,
+                                       t->shared_tfile, t->shared_scratch_T);
+        trace_span("tikl", "substitute", t->env.trace_tid, t->step_trace_start,
+                   t->path, NULL);
+    }
+    return t->cmd;
+}
+
+/* Describes how a step went wrong for the status lines: "timed out",
+ * "exceeded the cpu limit" or "exit N". */
+static const char *
+describe_step_failure(char *buf, size_t cap, int ec, const step_outcome *out)
+{
+    if (out->timed_out)
+        snprintf(buf, cap, "timed out");
+    else if (out->limit >= 0)
+        snprintf(buf, cap, "exceeded the %s limit", limit_names[out->limit]);
+    else
+        snprintf(buf, cap, "exit %d", ec);
+    return buf;
+}
+
+/* Records how the current attempt went.  Returns true while there is
+ * another attempt or step to run. */
+static bool
+test_run_step_done(test_run *t, int ec, unsigned long ms,
+                   const step_outcome *out)
+{
+    test_directives *d = &t->d;
+    test_result *res = t->res;
+    const char *path = t->path;
+    size_t i = t->step;
+    if (trace_fd >= 0) {
+        char name[32];
+        snprintf(name, sizeof(name), "RUN %zu", i + 1);
+        trace_span("step", name, t->env.trace_tid, t->step_trace_start, path,
+                   t->cmd);
+    }
+    res->step_ms[i] = ms;
+    res->step_usage[i] = out->usage;
+    usage_merge(&res->usage, &out->usage);
+    res->nsteps = i + 1;
+    if (out->leaked && !t->quiet)
+        fprintf(stderr, "[ LEAK] %s (step %zu left processes running; killed)\n",
+                path, i + 1);
+    if (ec == 0) {
+        res->retries += t->attempt;
+        free(t->cmd);
+        t->cmd = NULL;
+        t->attempt = 0;
+        if (++t->step >= d->runs.n)
+            return false;
+        test_run_arm_step(t);
+        return true;
+    }
+    char why[64];
+    describe_step_failure(why, sizeof(why), ec, out);
+    if (out->timed_out)
+        trace_instant("timeout", t->env.trace_tid, path, why);
+    /* a step stopped by TIMEOUT: or --max-time gets no retry */
+    bool out_of_time = t->env.deadline && monotonic_ms() >= t->env.deadline;
+    if (t->attempt + 1 < t->attempts && !out_of_time) {
+        trace_instant("retry", t->env.trace_tid, path, why);
+        if (!t->quiet)
+            fprintf(stderr, "[RETRY] %s (step %zu %s, retry %u/%u)\n", path,
+                    i + 1, why, t->attempt + 2, t->attempts);
+        t->attempt++;
+        return true;
+    }
+    res->retries += t->attempt;
+    if (!t->quiet) {
+        if (d->xfail) {
+            const char *sep = (d->xfail_reason && *d->xfail_reason) ? "; " : "";
+            const char *msg = (d->xfail_reason && *d->xfail_reason) ? d->xfail_reason : "";
+            fprintf(stderr, "[XFAIL] %s (step %zu %s%s%s)\n", path, i + 1, why,
+                    sep, msg);
+        } else {
+            const char *attempt_note = (t->attempt > 0) ? " after retries" : "";
+            char limit[32];
+            if (out->timed_out && suite_expired()) {
+                fprintf(stderr, "[ TIME] %s (step %zu stopped at the --max-time "
+                        "deadline%s)\n", path, i + 1, attempt_note);
+            } else if (out->timed_out && out_of_time) {
+                fprintf(stderr, "[ TIME] %s (test exceeded its %s budget in "
+                        "step %zu%s)\n", path,
+                        format_duration(limit, sizeof(limit), t->budget_ms),
+                        i + 1, attempt_note);
+            } else if (out->timed_out) {
+                fprintf(stderr, "[ TIME] %s (step %zu exceeded %s%s%s)\n", path,
+                        i + 1, format_duration(limit, sizeof(limit),
+                                               t->env.step_timeout_ms),
+                        t->auto_timed ? " derived from its history" : "",
+                        attempt_note);
+            } else if (out->limit >= 0) {
+                fprintf(stderr, "[LIMIT] %s (step %zu exceeded %s limit %s%s)\n",
+                        path, i + 1, limit_names[out->limit],
+                        format_limit(limit, sizeof(limit),
+                                     (limit_kind)out->limit,
+                                     t->env.limits.v[out->limit]),
+                        attempt_note);
+            } else {
+                fprintf(stderr, "[ FAIL] %s (step %zu exit %d%s)\n", path, i + 1,
+                        ec, attempt_note);
             }
-            perror("waitpid");
-            free(wrapped);
-            return 127;
+            if (!t->capture.echo)
+                capture_print(&t->capture, stderr);
         }
+    }
+    res->failed_step = i + 1;
+    res->exit_code = ec;
+    t->failure = TEST_FAIL;
+    if (out->timed_out) {
+        t->failure = TEST_TIME;
+    } else if (out->limit >= 0) {
+        t->failure = TEST_LIMIT;
+        res->limit = (limit_kind)out->limit;
+    }
+    if (d->xfail) {
+        t->xfail_hit = true;
+        t->rc = 0;
     } else {
-        unsigned remaining = timeout_secs;
-        for (;;) {
-            pid_t r = waitpid(pid, &st, WNOHANG);
-            if (r == pid)
-                break;
-            if (r < 0) {
-                if (errno == EINTR) {
-                    if (abort_requested)
-                        kill(pid, SIGTERM);
-                    continue;
-                }
-                perror("waitpid");
-                free(wrapped);
-                return 127;
-            }
-            if (remaining == 0) {
-                (void)kill(pid, SIGKILL);
-                while (waitpid(pid, &st, 0) < 0) {
-                    if (errno == EINTR)
-                        continue;
-                    break;
+        t->rc = ec ? ec : 1;
+    }
+    return false;
+}
+
+/* Settles the final status, reports it and releases the test. */
+static int
+test_run_end(test_run *t)
+{
+    test_directives *d = &t->d;
+    test_result *res = t->res;
+    int rc = t->rc;
+    free(t->cmd);
+    t->cmd = NULL;
+    free(t->shared_tdir);
+    t->shared_tdir = NULL;
+    if (t->xfail_hit)
+        res->status = TEST_XFAIL;
+    else if (rc != 0)
+        res->status = t->failure;
+    else
+        res->status = d->xfail ? TEST_XPASS : TEST_OK;
+    if (rc == 0) {
+        if (d->xfail) {
+            if (!t->xfail_hit) {
+                if (!t->quiet) {
+                    const char *sep = (d->xfail_reason && *d->xfail_reason) ? ": " : "";
+                    const char *msg = (d->xfail_reason && *d->xfail_reason) ? d->xfail_reason : "";
+                    fprintf(stderr, "[XPASS] %s%s%s\n", t->path, sep, msg);
                 }
-                if (timed_out)
-                    *timed_out = true;
-                free(wrapped);
-                return 124;
+                rc = 1;
             }
-            sleep(1);
-            if (remaining > 0)
-                remaining--;
-            if (abort_requested) {
-                kill(pid, SIGTERM);
+        } else {
+            if (!t->quiet)
+                fprintf(stderr, "[  OK ] %s\n", t->path);
+        }
+    }
+
+    trace_span("test", t->path, t->env.trace_tid, t->trace_start, NULL,
+               test_status_names[res->status]);
+    if (!abort_requested)
+        cache_store(t->testpath_abs, t->cache_key, res->status == TEST_OK);
+    test_directives_free(d);
+    test_env_free(&t->env);
+    capture_free(&t->capture);
+    res->total_ms = (unsigned long)(monotonic_ms() - t->test_start);
+    return rc;
+}
+
+static int
+run_test_file(const char *path, mapkv *cfgsubs, vecstr *features,
+              int verbosity, bool quiet, unsigned slot, test_result *res)
+{
+    test_run *t = xrealloc(NULL, sizeof(*t));
+    int rc = test_run_begin(t, path, cfgsubs, features, quiet, slot, res);
+    if (rc >= 0) {
+        free(t);
+        return rc;
+    }
+    bool more;
+    do {
+        step_outcome out = { .limit = -1 };
+        unsigned long long step_start = monotonic_ms();
+        const char *cmd = test_run_command(t);
+        int ec = cmd ? run_shell(cmd, &t->env, verbosity, &t->capture, &out) : 2;
+        more = test_run_step_done(t, ec,
+                                  (unsigned long)(monotonic_ms() - step_start),
+                                  &out);
+    } while (more);
+    rc = test_run_end(t);
+    free(t);
+    return rc;
+}
+
+typedef struct {
+    mapkv *subs;
+    vecstr *features;
+    int verbosity;
+    bool quiet;
+    bool keep_going;
+    unsigned jobs;
+    bool async;
+    bool ordered;
+    const char *report_json;
+    const char *report_junit;
+    const char *trace;
+    const char *metrics;
+    unsigned time_tests;
+    bool progress;
+    cache_mode cache;
+} run_options;
+
+/* Once --max-time has passed, reports the tests that never started, those
+ * still waiting in pending (if any) and whatever the source has left, as
+ * NORUN.  They make the run fail with 124 unless it already failed. */
+static int
+report_unrun_tests(sched_heap *pending, test_source *source,
+                   const run_options *o, int overall_rc)
+{
+    if (!suite_expired() || abort_requested)
+        return overall_rc;
+    test_result res = {0};
+    size_t n = 0;
+    for (;;) {
+        char *owned = NULL;
+        const char *path;
+        if (pending && pending->n > 0)
+            path = owned = sched_heap_pop(pending).path;
+        else if (!(path = test_source_next(source)))
+            break;
+        if (!o->quiet)
+            fprintf(stderr, "[NORUN] %s (--max-time reached)\n", path);
+        result_reset(&res);
+        res.status = TEST_NORUN;
+        report_result(path, &res);
+        free(owned);
+        n++;
+    }
+    result_reset(&res);
+    if (n == 0)
+        return overall_rc;
+    char budget[32];
+    fprintf(stderr, "tikl: --max-time %s reached, %zu test%s not run\n",
+            format_duration(budget, sizeof(budget), max_time_ms), n,
+            n == 1 ? "" : "s");
+    return overall_rc ? overall_rc : 124;
+}
+
+#ifndef TIKL_FUZZ
+/* --async: the parent drives up to -j tests itself.  Each is a test_run
+ * whose current step is a step_proc; one poll() loop watches the SIGCHLD
+ * self-pipe, the output feeding in-process checks and the nearest step
+ * deadline, so no worker process sits between tikl and the commands. */
+typedef struct {
+    test_run run;
+    test_result res;
+    char *path;
+    unsigned long long start_ms;
+    unsigned long long expected_end;
+    unsigned slot;
+    step_proc sp;
+    unsigned long long step_start;
+    size_t waiting;
+    unsigned long long deadline;
+    int kill_phase;
+    bool expired;
+    bool cancelled;
+} async_test;
+
+/* Stops reading a check stage's input, e.g. once the step is past its
+ * deadline. */
+static void
+async_close_output(async_test *a)
+{
+    if (a->sp.out_fd < 0)
+        return;
+    close(a->sp.out_fd);
+    a->sp.out_fd = -1;
+    a->waiting--;
+}
+
+/* Starts the next step of a.  Steps that cannot start are settled on the
+ * spot; returns false once the test has nothing left to run. */
+static bool
+async_start_step(async_test *a, int verbosity)
+{
+    for (;;) {
+        int rc;
+        const char *cmd = NULL;
+        a->step_start = monotonic_ms();
+        if (abort_requested || a->cancelled) {
+            rc = 128 + (abort_requested ? (int)abort_requested : SIGTERM);
+        } else if (!(cmd = test_run_command(&a->run))) {
+            rc = 2;
+        } else if (step_start(&a->sp, cmd, &a->run.env, verbosity,
+                              &a->run.capture, &rc)) {
+            a->waiting = 0;
+            for (size_t i = 0; i < a->sp.n; i++)
+                if (a->sp.live[i] > 0)
+                    a->waiting++;
+            if (a->sp.out_fd >= 0) {
+                fcntl(a->sp.out_fd, F_SETFL,
+                      fcntl(a->sp.out_fd, F_GETFL) | O_NONBLOCK);
+                a->waiting++;
             }
+            a->deadline = step_deadline(&a->run.env, a->sp.start);
+            a->kill_phase = 0;
+            a->expired = false;
+            return true;
         }
+        unsigned long ms = (unsigned long)(monotonic_ms() - a->step_start);
+        step_outcome none = { .limit = -1 };
+        if (!test_run_step_done(&a->run, rc, ms, &none))
+            return false;
     }
-    if (WIFEXITED(st))
-        st = WEXITSTATUS(st);
-    else if (WIFSIGNALED(st))
-        st = 128 + WTERMSIG(st);
-    else
-        st = 127;
-    free(wrapped);
-    return st;
-#endif
 }
 
+/* Called once every process of the current step is reaped. */
 static bool
-probe_pipefail(const char *shell_path)
+async_finish_step(async_test *a, int verbosity)
 {
-#ifdef TIKL_FUZZ
-    (void)shell_path;
-    return true;
-#else
-    pid_t pid = fork();
-    if (pid < 0)
+    step_read_capture(&a->sp, true);
+    step_outcome out = { .timed_out = a->expired, .limit = -1 };
+    out.leaked = step_kill_leftovers(&a->sp);
+    int ec = step_finish(&a->sp, &a->run.env, verbosity, !a->expired,
+                         a->expired);
+    if (!a->expired)
+        out.limit = step_limit_hit(&a->sp, &a->run.env.limits, ec);
+    out.usage = a->sp.usage;
+    if (verbosity >= 1)
+        report_step_usage(&out.usage);
+    step_proc_free(&a->sp);
+    unsigned long ms = (unsigned long)(monotonic_ms() - a->step_start);
+    if (!test_run_step_done(&a->run, ec, ms, &out))
         return false;
-    if (pid == 0) {
-        execl(shell_path, shell_path, "-c", "set -o pipefail 2>/dev/null", (char *)0);
-        _exit(127);
+    return async_start_step(a, verbosity);
+}
+
+/* Escalates a step that ran past its deadline the way run_shell() does:
+ * SIGTERM and the kill grace period when one is set, then SIGKILL. */
+static void
+async_expire(async_test *a, unsigned long long now)
+{
+    if (a->kill_phase == 0) {
+        a->expired = true;
+        async_close_output(a);
+        if (kill_grace_ms > 0) {
+            step_signal(&a->sp, SIGTERM);
+            a->kill_phase = 1;
+            a->deadline = now + kill_grace_ms;
+            return;
+        }
     }
-    int st = 0;
-    while (waitpid(pid, &st, 0) < 0) {
-        if (errno == EINTR)
+    step_signal(&a->sp, SIGKILL);
+    a->kill_phase = 2;
+    a->deadline = 0;
+}
+
+static void
+async_test_free(async_test *a)
+{
+    step_proc_free(&a->sp);
+    result_reset(&a->res);
+    free(a->path);
+    free(a);
+}
+
+/* Descriptors one --async test may hold at once: its capture pipe, the
+ * input of an in-process check and the pipe and redirections of a stage
+ * being spawned. */
+#define ASYNC_TEST_FDS 6
+
+/* Whether n more descriptors can be opened right now. */
+static bool
+fds_available(int n)
+{
+    int got[ASYNC_TEST_FDS];
+    int k = 0;
+    while (k < n && k < ASYNC_TEST_FDS &&
+           (got[k] = dup(sigchld_pipe[0])) >= 0)
+        k++;
+    bool ok = k == n;
+    while (k > 0)
+        close(got[--k]);
+    return ok;
+}
+
+static int
+run_tests_async(test_source *source, const run_options *o)
+{
+    int overall_rc = 0;
+    sched_heap pending = {0};
+    size_t discovered = 0;
+    bool source_done = false;
+    bool stop = false;
+    bool term_sent = false;
+    async_test **active = NULL;
+    size_t nactive = 0;
+    struct pollfd *pfds = NULL;
+    async_test **pfd_owner = NULL;
+    unsigned jobs = o->jobs ? o->jobs : 1;
+    active = xrealloc(NULL, jobs * sizeof(*active));
+    pfds = xrealloc(NULL, (2 * jobs + 2) * sizeof(*pfds));
+    pfd_owner = xrealloc(NULL, (2 * jobs + 2) * sizeof(*pfd_owner));
+    /* when the descriptor limit cannot cover -j, a test only starts once
+     * there are enough to spare, and otherwise waits for one to end */
+    struct rlimit nofile;
+    bool fds_tight = getrlimit(RLIMIT_NOFILE, &nofile) == 0 &&
+                     nofile.rlim_cur != RLIM_INFINITY &&
+                     nofile.rlim_cur < (rlim_t)jobs * ASYNC_TEST_FDS + 64;
+    bool fds_wait = false;
+    for (;;) {
+        if (!stop && suite_expired())
+            stop = true;
+        if (abort_requested && !term_sent) {
+            stop = true;
+            term_sent = true;
+            for (size_t i = 0; i < nactive; i++) {
+                async_close_output(active[i]);
+                step_signal(&active[i]->sp, SIGTERM);
+            }
+        }
+        while (!stop && !source_done && pending.n < SCHED_LOOKAHEAD &&
+               ((nactive == 0 && pending.n == 0) ||
+                test_source_ready(source))) {
+            const char *found = test_source_next(source);
+            if (!found) {
+                source_done = true;
+                progress_source_done();
+                break;
+            }
+            sched_entry e = { .index = discovered++, .path = xstrdup(found) };
+            e.known = lookup_test_time(e.path, &e.ms);
+            progress_discovered(e.known, e.ms);
+            sched_heap_push(&pending, e);
+        }
+
+        /* start new tests, and settle those whose step has finished */
+        size_t i = 0;
+        for (;;) {
+            async_test *a = NULL;
+            int rc = -1;
+            if (i < nactive) {
+                a = active[i];
+                if (a->waiting > 0) {
+                    i++;
+                    continue;
+                }
+                progress_clear();
+                if (async_finish_step(a, o->verbosity))
+                    continue;
+                rc = test_run_end(&a->run);
+                active[i] = active[--nactive];
+                fds_wait = false;
+            } else if (!stop && nactive < jobs && pending.n > 0 && !fds_wait) {
+                if (fds_tight && nactive > 0 &&
+                    !fds_available(ASYNC_TEST_FDS)) {
+                    fds_wait = true;
+                    continue;
+                }
+                sched_entry e = sched_heap_pop(&pending);
+                progress_clear();
+                a = xrealloc(NULL, sizeof(*a));
+                memset(a, 0, sizeof(*a));
+                a->sp.out_fd = -1;
+                a->sp.cap_fd = -1;
+                a->path = e.path;
+                a->start_ms = monotonic_ms();
+                a->expected_end = progress_started(e.known, e.ms);
+                /* the lowest --trace slot no running test holds */
+                for (a->slot = 1;; a->slot++) {
+                    size_t j = 0;
+                    while (j < nactive && active[j]->slot != a->slot)
+                        j++;
+                    if (j == nactive)
+                        break;
+                }
+                rc = test_run_begin(&a->run, a->path, o->subs, o->features,
+                                    o->quiet, a->slot, &a->res);
+                if (rc < 0) {
+                    if (async_start_step(a, o->verbosity)) {
+                        active[nactive++] = a;
+                        continue;
+                    }
+                    rc = test_run_end(&a->run);
+                }
+            } else {
+                break;
+            }
+            if (!abort_requested && !a->cancelled) {
+                if (!a->res.cached) {
+                    record_test_time(a->path, (unsigned long)(monotonic_ms() -
+                                                              a->start_ms));
+                    history_append(a->path, &a->res);
+                }
+                report_result(a->path, &a->res);
+            }
+            progress_finished(a->expected_end, a->res.status,
+                              (unsigned long)(monotonic_ms() - a->start_ms));
+            if (rc != 0 && !a->cancelled) {
+                if (overall_rc == 0)
+                    overall_rc = rc;
+                if (!o->keep_going && !stop) {
+                    stop = true;
+                    for (size_t j = 0; j < nactive; j++) {
+                        active[j]->cancelled = true;
+                        async_close_output(active[j]);
+                        step_signal(&active[j]->sp, SIGTERM);
+                    }
+                }
+            }
+            async_test_free(a);
+        }
+        progress_draw(false);
+        if (nactive == 0) {
+            if (stop || (source_done && pending.n == 0))
+                break;
             continue;
-        return false;
+        }
+
+        nfds_t npfds = 0;
+        pfds[npfds++] = (struct pollfd) { .fd = sigchld_pipe[0], .events = POLLIN };
+        unsigned long long now = monotonic_ms();
+        unsigned long long next_deadline = 0;
+        for (i = 0; i < nactive; i++) {
+            async_test *a = active[i];
+            if (a->sp.out_fd >= 0) {
+                pfd_owner[npfds] = a;
+                pfds[npfds++] = (struct pollfd) {
+                    .fd = a->sp.out_fd, .events = POLLIN
+                };
+            }
+            if (a->sp.cap_fd >= 0) {
+                pfd_owner[npfds] = a;
+                pfds[npfds++] = (struct pollfd) {
+                    .fd = a->sp.cap_fd, .events = POLLIN
+                };
+            }
+            if (a->deadline && (!next_deadline || a->deadline < next_deadline))
+                next_deadline = a->deadline;
+        }
+        /* more paths on --from-stdin wake us up too */
+        nfds_t noutputs = npfds;
+        int input_fd = stop || source_done || pending.n == SCHED_LOOKAHEAD ?
+                       -1 : test_source_input_fd(source);
+        if (input_fd >= 0)
+            pfds[npfds++] = (struct pollfd) { .fd = input_fd, .events = POLLIN };
+        int wait_ms = -1;
+        if (next_deadline) {
+            unsigned long long left = next_deadline > now ? next_deadline - now : 0;
+            wait_ms = left > INT_MAX ? INT_MAX : (int)left;
+        }
+        int periodic_ms = periodic_wait_ms();
+        if (periodic_ms >= 0 && (wait_ms < 0 || periodic_ms < wait_ms))
+            wait_ms = periodic_ms;
+        int pr = poll(pfds, npfds, wait_ms);
+        if (pr < 0 && errno != EINTR)
+            die("poll: %s", strerror(errno));
+        periodic_tick();
+
+        if (pr > 0 && pfds[0].revents)
+            drain_child_wait();
+        int st;
+        pid_t pid;
+        struct rusage ru;
+        while ((pid = wait4(-1, &st, WNOHANG, &ru)) > 0) {
+            unsigned long long ended = monotonic_ms();
+            for (i = 0; i < nactive; i++) {
+                step_proc *sp = &active[i]->sp;
+                size_t k = 0;
+                while (k < sp->n && sp->live[k] != pid)
+                    k++;
+                if (k == sp->n)
+                    continue;
+                usage_add_rusage(&sp->usage, &ru);
+                sp->live[k] = 0;
+                sp->sts[k] = st;
+                sp->ended[k] = ended;
+                active[i]->waiting--;
+                break;
+            }
+        }
+        for (nfds_t p = 1; pr > 0 && p < noutputs; p++) {
+            if (!pfds[p].revents)
+                continue;
+            async_test *a = pfd_owner[p];
+            if (pfds[p].fd == a->sp.cap_fd) {
+                step_read_capture(&a->sp, false);
+                continue;
+            }
+            char buf[65536];
+            ssize_t r = read(a->sp.out_fd, buf, sizeof(buf));
+            if (r > 0)
+                strbuf_append(&a->sp.output, buf, (size_t)r);
+            else if (r == 0 || (errno != EINTR && errno != EAGAIN))
+                async_close_output(a);
+        }
+        now = monotonic_ms();
+        for (i = 0; i < nactive; i++) {
+            if (active[i]->deadline && now >= active[i]->deadline) {
+                progress_clear();
+                async_expire(active[i], now);
+            }
+        }
     }
-    return WIFEXITED(st) && WEXITSTATUS(st) == 0;
-#endif
+    free(active);
+    free(pfds);
+    free(pfd_owner);
+    overall_rc = report_unrun_tests(&pending, source, o, overall_rc);
+    sched_heap_free(&pending);
+    return overall_rc;
 }
+#endif
+
+/* -j workers write their stderr to an unlinked temporary file, and the
+ * parent copies each test's report out with a single write once the worker
+ * exits, so lines from concurrent tests never interleave.  With --ordered
+ * finished reports wait here until every test before them has reported. */
+typedef struct {
+    char *text;
+    size_t len;
+    bool done;
+} report_slot;
+typedef struct {
+    report_slot *v;
+    size_t n, next;
+    bool ordered;
+} report_queue;
 
+/* Takes ownership of text, the report of the test at position index. */
 static void
-init_run_shell(void)
+report_queue_put(report_queue *q, size_t index, char *text, size_t len)
 {
-    run_shell_path = "/bin/sh";
-    run_shell_has_pipefail = false;
-    const char *forced_shell = getenv("TIKL_SHELL");
-    if (forced_shell && *forced_shell) {
-        run_shell_path = forced_shell;
-        if (!lit_compat)
-            run_shell_has_pipefail = probe_pipefail(forced_shell);
+    progress_clear();
+    if (!q->ordered) {
+        write_all(STDERR_FILENO, text, len);
+        free(text);
         return;
     }
-    if (lit_compat)
-        return;
-    if (probe_pipefail("/bin/sh")) {
-        run_shell_has_pipefail = true;
-        return;
+    if (index >= q->n) {
+        size_t n = q->n ? q->n : 64;
+        while (n <= index)
+            n *= 2;
+        q->v = xrealloc(q->v, n * sizeof(*q->v));
+        memset(q->v + q->n, 0, (n - q->n) * sizeof(*q->v));
+        q->n = n;
     }
-    if (access("/bin/bash", X_OK) == 0 && probe_pipefail("/bin/bash")) {
-        run_shell_path = "/bin/bash";
-        run_shell_has_pipefail = true;
-        return;
+    q->v[index] = (report_slot) { .text = text, .len = len, .done = true };
+    while (q->next < q->n && q->v[q->next].done) {
+        report_slot *s = &q->v[q->next++];
+        write_all(STDERR_FILENO, s->text, s->len);
+        free(s->text);
+        s->text = NULL;
+    }
+}
+
+/* Emits whatever is left, e.g. after a run stopped at a failure. */
+static void
+report_queue_flush(report_queue *q)
+{
+    progress_clear();
+    for (; q->next < q->n; q->next++) {
+        report_slot *s = &q->v[q->next];
+        if (s->done)
+            write_all(STDERR_FILENO, s->text, s->len);
+        free(s->text);
+    }
+    free(q->v);
+    memset(q, 0, sizeof(*q));
+}
+
+/* Closes the run's reports and prints its summary. */
+static void
+finish_run(const run_options *o)
+{
+    unsigned jobs = o->jobs > 1 ? o->jobs : 1;
+    close_progress();
+    close_result_reports();
+    close_trace(jobs);
+    if (!abort_requested && (!o->quiet || o->time_tests))
+        report_summary(jobs);
+    close_metrics();
+}
+
+/* Runs every test the source yields, in this process or across forked
+ * workers, and returns the first nonzero test status. */
+static int
+run_tests(test_source *source, const run_options *o)
+{
+    open_result_reports(o->report_json, o->report_junit);
+    open_trace(o->trace);
+    open_metrics(o->metrics, o->time_tests);
+    open_progress(o->progress, o->jobs > 1 ? o->jobs : 1);
+    begin_result_cache(o->cache, o->subs, o->features);
+    suite_deadline = max_time_ms ? monotonic_ms() + max_time_ms : 0;
+    if (auto_timeout.on) {
+        /* reloaded per run so a daemon picks up what earlier runs learned */
+        history_db_free(&auto_history);
+        memset(&auto_history, 0, sizeof(auto_history));
+        load_history(&auto_history);
+    }
+#ifndef TIKL_FUZZ
+    if (o->async) {
+        int rc = run_tests_async(source, o);
+        finish_run(o);
+        return rc;
+    }
+#endif
+    int overall_rc = 0;
+    test_result result = {0};
+    if (o->jobs <= 1) {
+        become_subreaper();
+        /* --progress reads ahead, as -j does, to know the total */
+        sched_heap ahead = { .in_order = true };
+        size_t lookahead = o->progress ? SCHED_LOOKAHEAD : 1;
+        size_t discovered = 0;
+        bool source_done = false;
+        while (!suite_expired() && !abort_requested) {
+            while (!source_done && ahead.n < lookahead &&
+                   (ahead.n == 0 || test_source_ready(source))) {
+                const char *found = test_source_next(source);
+                if (!found) {
+                    source_done = true;
+                    progress_source_done();
+                    break;
+                }
+                sched_entry e = { .index = discovered++, .path = xstrdup(found) };
+                if (o->progress)
+                    e.known = lookup_test_time(e.path, &e.ms);
+                progress_discovered(e.known, e.ms);
+                sched_heap_push(&ahead, e);
+            }
+            if (ahead.n == 0)
+                break;
+            sched_entry e = sched_heap_pop(&ahead);
+            const char *test = e.path;
+            unsigned long long start = monotonic_ms();
+            unsigned long long expected_end = progress_started(e.known, e.ms);
+            /* the test's report lines go straight to stderr: a terminal
+             * line is taken down for them and put back once it is done */
+            if (progress.tty)
+                progress_clear();
+            else
+                progress_draw(false);
+            int rc = run_test_file(test, o->subs, o->features, o->verbosity,
+                                   o->quiet, 1, &result);
+            if (!abort_requested) {
+                unsigned long ms = (unsigned long)(monotonic_ms() - start);
+                progress_finished(expected_end, result.status, ms);
+                if (!result.cached) {
+                    record_test_time(test, ms);
+                    history_append(test, &result);
+                }
+                report_result(test, &result);
+                metrics_tick();
+                progress_draw(false);
+            }
+            free(e.path);
+            if (rc != 0) {
+                if (overall_rc == 0)
+                    overall_rc = rc;
+                if (!o->keep_going)
+                    break;
+            }
+        }
+        progress_clear();
+        overall_rc = report_unrun_tests(&ahead, source, o, overall_rc);
+        sched_heap_free(&ahead);
+    } else {
+        /* the steps of a worker that dies are adopted here, and killed
+         * once every worker is reaped */
+        become_subreaper();
+        sched_heap pending = {0};
+        report_queue reports = { .ordered = o->ordered };
+        size_t discovered = 0;
+        bool source_done = false;
+        unsigned active = 0;
+        bool stop_scheduling = false;
+        bool out_of_fds = false;
+        for (;;) {
+            if (abort_requested && !stop_scheduling) {
+                stop_scheduling = true;
+                kill_active_workers(SIGTERM);
+            }
+            /* workers share the --max-time deadline and stop by themselves */
+            if (!stop_scheduling && suite_expired())
+                stop_scheduling = true;
+            /* a pipe that has nothing to say yet only holds things up when
+             * there is nothing else to do */
+            while (!stop_scheduling && !source_done &&
+                   pending.n < SCHED_LOOKAHEAD &&
+                   ((active == 0 && pending.n == 0) ||
+                    test_source_ready(source))) {
+                const char *found = test_source_next(source);
+                if (!found) {
+                    source_done = true;
+                    progress_source_done();
+                    break;
+                }
+                char *gate_text = NULL;
+                size_t gate_len = 0;
+                FILE *gate_out = open_memstream(&gate_text, &gate_len);
+                if (!gate_out)
+                    die("open_memstream: %s", strerror(errno));
+                int gated = pregate_test_file(gate_out, found, o->features,
+                                              o->quiet, &result);
+                fclose(gate_out);
+                if (gated < 0) {
+                    free(gate_text);
+                } else {
+                    report_queue_put(&reports, discovered++, gate_text,
+                                     gate_len);
+                    if (result.status == TEST_SKIP)
+                        trace_instant("skip", 0, found, result.skip_reason);
+                    progress_settled(result.status);
+                    if (!abort_requested) {
+                        if (!result.cached)
+                            history_append(found, &result);
+                        report_result(found, &result);
+                    }
+                    if (gated != 0) {
+                        if (overall_rc == 0)
+                            overall_rc = gated;
+                        if (!o->keep_going) {
+                            stop_scheduling = true;
+                            kill_active_workers(SIGTERM);
+                        }
+                    }
+                    continue;
+                }
+                sched_entry e = { .index = discovered++, .path = xstrdup(found) };
+                e.known = lookup_test_time(e.path, &e.ms);
+                progress_discovered(e.known, e.ms);
+                sched_heap_push(&pending, e);
+            }
+            if (active < o->jobs && pending.n > 0 && !stop_scheduling &&
+                !out_of_fds) {
+                sched_entry e = sched_heap_pop(&pending);
+                const char *test = e.path;
+                unsigned long long start = monotonic_ms();
+                unsigned long long fork_start = trace_fd >= 0 ? monotonic_us() : 0;
+                unsigned slot = free_worker_slot();
+                int report_fd = open_report_file();
+                if (report_fd < 0 && active > 0 &&
+                    (errno == EMFILE || errno == ENFILE)) {
+                    /* wait for a running worker to give its file back */
+                    sched_heap_push(&pending, e);
+                    out_of_fds = true;
+                    continue;
+                }
+                if (report_fd < 0) {
+                    strbuf text = {0};
+                    if (!o->quiet)
+                        strbuf_printf(&text, "[ FAIL] %s (cannot create its report file: %s)\n",
+                                      test, strerror(errno));
+                    report_queue_put(&reports, e.index, text.v, text.n);
+                    result_reset(&result);
+                    result.status = TEST_FAIL;
+                    result.exit_code = 127;
+                    if (!abort_requested)
+                        report_result(test, &result);
+                    progress_finished(progress_started(e.known, e.ms), TEST_FAIL, 0);
+                    free(e.path);
+                    if (overall_rc == 0)
+                        overall_rc = 127;
+                    if (!o->keep_going) {
+                        stop_scheduling = true;
+                        kill_active_workers(SIGTERM);
+                    }
+                    continue;
+                }
+                pid_t pid = fork();
+                if (pid == 0) {
+                    setpgid(0, 0);
+                    /* CLOEXEC does not reach across fork(): without this
+                     * every worker holds the files of all the others */
+                    for (size_t i = 0; i < workers.n; i++)
+                        close(workers.v[i].report_fd);
+                    dup2(report_fd, STDERR_FILENO);
+                    close(report_fd);
+                    init_child_wait();
+                    become_subreaper();
+                    /* the parent already looked the test up */
+                    rcache.lookup = false;
+                    char *worker_scratch = NULL;
+                    if (!scratch_root_forced) {
+                        worker_scratch = make_temp_dir();
+                        if (!worker_scratch)
+                            _exit(127);
+                        scratch_root = worker_scratch;
+                    }
+                    int rc = run_test_file(test, o->subs, o->features,
+                                           o->verbosity, o->quiet, slot,
+                                           &result);
+                    if (!abort_requested)
+                        history_append(test, &result);
+                    write_worker_result(STDERR_FILENO, &result);
+                    result_reset(&result);
+                    free(worker_scratch);
+                    _exit(rc);
+                } else if (pid > 0) {
+                    trace_span("tikl", "fork", 0, fork_start, test, NULL);
+                    active++;
+                    vecworker_push(&workers, (worker) {
+                        .pid = pid, .path = e.path, .start_ms = start,
+                        .expected_end = progress_started(e.known, e.ms),
+                        .index = e.index, .slot = slot,
+                        .report_fd = report_fd
+                    });
+                    continue;
+                } else {
+                    perror("fork");
+                    close(report_fd);
+                    free(e.path);
+                    overall_rc = 127;
+                    stop_scheduling = true;
+                }
+            }
+            if (active == 0 && (stop_scheduling || (source_done && pending.n == 0)))
+                break;
+            int input_fd = stop_scheduling || source_done ||
+                           pending.n == SCHED_LOOKAHEAD ? -1 :
+                           test_source_input_fd(source);
+            if (active < o->jobs && !stop_scheduling && !out_of_fds &&
+                (pending.n > 0 || (!source_done && input_fd < 0)))
+                continue;
+            int st = 0;
+            pid_t w;
+            if (periodic_wait_ms() >= 0 || input_fd >= 0) {
+                /* also wake up for --metrics-interval and --progress, and
+                 * when more paths arrive */
+                struct pollfd pfd[2] = {
+                    { .fd = sigchld_pipe[0], .events = POLLIN },
+                    { .fd = input_fd, .events = POLLIN },
+                };
+                if (poll(pfd, input_fd >= 0 ? 2 : 1, periodic_wait_ms()) > 0)
+                    drain_child_wait();
+                periodic_tick();
+                w = waitpid(-1, &st, WNOHANG);
+                if (w == 0)
+                    continue;
+            } else {
+                w = wait(&st);
+            }
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("wait");
+                overall_rc = 127;
+                break;
+            }
+            worker done;
+            if (!vecworker_take(&workers, w, &done))
+                continue;
+            active--;
+            unsigned long elapsed = (unsigned long)(monotonic_ms() - done.start_ms);
+            int rc = 1;
+            if (WIFEXITED(st)) {
+                rc = WEXITSTATUS(st);
+                if (!abort_requested)
+                    record_test_time(done.path, elapsed);
+            }
+            strbuf text = {0};
+            bool have_result = read_worker_report(done.report_fd, &text.v,
+                                                  &text.n, &result);
+            text.cap = text.n;
+            out_of_fds = false;
+            /* a worker that crashed or was killed, before or after writing
+             * its result, still counts: as FAIL with its wait status */
+            bool died = WIFSIGNALED(st) || !have_result;
+            if (died && !done.cancelled && !abort_requested) {
+                if (!have_result) {
+                    result_reset(&result);
+                    result.total_ms = elapsed;
+                }
+                result.status = TEST_FAIL;
+                result.failed_step = 0;
+                result.exit_code = WIFSIGNALED(st) ? 128 + WTERMSIG(st) : rc;
+                if (!o->quiet && WIFSIGNALED(st))
+                    strbuf_printf(&text, "[ FAIL] %s (worker killed by signal %d)\n",
+                                  done.path, WTERMSIG(st));
+                else if (!o->quiet)
+                    strbuf_printf(&text, "[ FAIL] %s (worker exit %d without a result)\n",
+                                  done.path, rc);
+                report_result(done.path, &result);
+            } else if (have_result && WIFEXITED(st) && !abort_requested) {
+                report_result(done.path, &result);
+            }
+            report_queue_put(&reports, done.index, text.v, text.n);
+            progress_finished(done.expected_end,
+                              have_result && !died ? result.status : TEST_FAIL,
+                              elapsed);
+            progress_draw(false);
+            free(done.path);
+            if (rc != 0) {
+                if (overall_rc == 0)
+                    overall_rc = rc;
+                if (!o->keep_going) {
+                    stop_scheduling = true;
+                    kill_active_workers(SIGTERM);
+                }
+            }
+        }
+#ifndef TIKL_FUZZ
+        kill_adopted_children();
+#endif
+        report_queue_flush(&reports);
+        overall_rc = report_unrun_tests(&pending, source, o, overall_rc);
+        sched_heap_free(&pending);
     }
+    result_reset(&result);
+    finish_run(o);
+    return overall_rc;
 }
 
-static bool
-parse_comment_run(const char *line, char *out, size_t cap)
+/* Daemon mode.  `tikl --daemon SOCKET` parses the config, probes the shell
+ * and loads the state files once, then serves runs on a Unix socket.  A
+ * client (`tikl --connect SOCKET PATH...`) sends one request of "KEY VALUE"
+ * lines ending in "end":
+ *
+ *   tikl-daemon 2
+ *   cwd DIR
+ *   verbosity N / quiet 0|1 / keep-going 0|1 / ordered 0|1 / jobs N /
+ *   from-stdin 0|1
+ *   report-json FILE / report-junit FILE / trace FILE / metrics FILE
+ *                   (optional, relative to cwd)
+ *   time-tests N / progress 0|1 / cache 0|1|2 (off, --cache, --rerun) /
+ *   async 0|1
+ *   timeout SPEC / kill-grace D / max-time D / metrics-interval D /
+ *   limit SPEC / log-dir DIR / lit-compat 1
+ *                   (only when given, as the client's -t, --kill-grace, ...)
+ *   feature NAME    (per -D, added to the daemon's)
+ *   suffix S / include GLOB / exclude GLOB / filter RE / filter-out RE
+ *                   (when any is given they replace the daemon's filters)
+ *   arg PATH        (once per positional argument)
+ *   end
+ *
+ * with its stdin, stdout and stderr attached as SCM_RIGHTS.  The daemon
+ * forks a child per request that adopts those descriptors, so reports go
+ * straight to the client's terminal, and the child answers "exit N" when
+ * the run is over.  A client that goes away cancels its run.  Options fixed
+ * when the daemon starts (-b, -T, -s, --state-dir, --cgroup) are refused on
+ * the client's command line, and on Linux the daemon only serves its own
+ * user. */
+#define DAEMON_MAGIC "tikl-daemon 2"
+
+typedef struct {
+    pid_t pid;
+    int conn;
+    bool cancelled;
+} daemon_request;
+
+static const char *
+absolute_path(const char *path, char *buf, size_t cap)
 {
-    const char *p = line;
-    while (*p == ' ' || *p == '\t')
-        p++;
-    if (*p == '/' && p[1] == '/')
-        p += 2;
-    else if (*p == '#')
-        p++;
-    else if (*p == ';')
-        p++;
-    else
-        return false;
-    while (*p == ' ' || *p == '\t')
-        p++;
-    if (strncmp(p, "RUN:", 4) != 0)
-        return false;
-    p += 4;
-    while (*p == ' ' || *p == '\t')
-        p++;
-    snprintf(out, cap, "%s", p);
-    return true;
+    char cwd[PATH_MAX];
+    if (path[0] == '/')
+        return path;
+    if (!getcwd(cwd, sizeof(cwd)))
+        die("getcwd: %s", strerror(errno));
+    if (snprintf(buf, cap, "%s/%s", cwd, path) >= (int)cap)
+        die("path too long: %s/%s", cwd, path);
+    return buf;
 }
 
 static void
-parse_requires(const char *line, vecstr *reqs)
+daemon_socket_addr(struct sockaddr_un *sa, const char *path)
 {
-    const char *p = strstr(line, "REQUIRES:");
-    if (!p)
-        return;
-    p += 9;
-    char buf[1024];
-    snprintf(buf, sizeof(buf), "%s", p);
-    char *tok = strtok(buf, ", ");
-    while (tok) {
-        if (*tok)
-            vecstr_push(reqs, tok);
-        tok = strtok(NULL, ", ");
-    }
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa->sun_path))
+        die("socket path too long: %s", path);
+    memcpy(sa->sun_path, path, strlen(path) + 1);
 }
+
 static void
-parse_unsupported(const char *line, vecstr *uns)
+request_field(strbuf *req, const char *key, const char *val)
 {
-    const char *p = strstr(line, "UNSUPPORTED:");
-    if (!p)
-        return;
-    p += 12;
-    char buf[1024];
-    snprintf(buf, sizeof(buf), "%s", p);
-    char *tok = strtok(buf, ", ");
-    while (tok) {
-        if (*tok)
-            vecstr_push(uns, tok);
-        tok = strtok(NULL, ", ");
-    }
+    if (strchr(val, '\n'))
+        die("cannot pass a path containing a newline to the daemon: %s", val);
+    strbuf_append(req, key, strlen(key));
+    strbuf_append(req, " ", 1);
+    strbuf_append(req, val, strlen(val));
+    strbuf_append(req, "\n", 1);
 }
 
 static void
-parse_xfail(const char *line, bool *xfail, char **reason)
+request_number(strbuf *req, const char *key, long val)
 {
-    const char *p = strstr(line, "XFAIL:");
-    if (!p)
-        return;
-    p += strlen("XFAIL:");
-    char buf[1024];
-    snprintf(buf, sizeof(buf), "%s", p);
-    char *trim = ltrim(buf);
-    rtrim_inplace(trim);
-    free(*reason);
-    *reason = (*trim) ? xstrdup(trim) : NULL;
-    *xfail = true;
+    char num[32];
+    snprintf(num, sizeof(num), "%ld", val);
+    request_field(req, key, num);
 }
 
-static int
-parse_allow_retries(const char *line, unsigned *value)
+/* Records an option a --connect client passes on as a KEY VALUE pair. */
+static void
+forward_option(vecstr *fwd, const char *key, const char *val)
 {
-    const char *p = strstr(line, "ALLOW_RETRIES:");
-    if (!p)
-        return -1;
-    p += strlen("ALLOW_RETRIES:");
-    char buf[1024];
-    snprintf(buf, sizeof(buf), "%s", p);
-    char *trim = ltrim(buf);
-    rtrim_inplace(trim);
-    if (*trim == '\0')
-        return 0;
-    errno = 0;
-    char *end = NULL;
-    unsigned long v = strtoul(trim, &end, 10);
-    if (errno || end == trim)
-        return 0;
-    while (end && *end) {
-        if (!isspace((unsigned char) * end))
-            return 0;
-        end++;
-    }
-    if (v > UINT_MAX)
-        return 0;
-    *value = (unsigned)v;
-    return 1;
+    vecstr_push(fwd, key);
+    vecstr_push(fwd, val);
 }
 
 static int
-run_test_file(const char *path, mapkv *cfgsubs, vecstr *features,
-              int verbosity, bool quiet)
+run_daemon_client(const char *sock, char **args, int nargs,
+                  const run_options *o, bool jobs_set, bool from_stdin,
+                  const vecstr *forwarded)
 {
-    char testpath_abs_buf[PATH_MAX];
-    if (!resolve_test_path(path, testpath_abs_buf, sizeof(testpath_abs_buf))) {
-        if (source_root && path && *path != '/') {
-            fprintf(stderr, "realpath %s (or %s/%s): %s\n", path, source_root,
-                    path, strerror(errno));
-        } else {
-            fprintf(stderr, "realpath %s: %s\n", path, strerror(errno));
-        }
-        return 2;
-    }
-    const char *testpath_abs = testpath_abs_buf;
-    FILE *f = fopen(testpath_abs, "r");
-    if (!f) {
-        fprintf(stderr, "open %s: %s\n", testpath_abs, strerror(errno));
-        return 2;
-    }
-    if (lit_compat) {
-        unsetenv("TIKL_CHECK_SUBSTS");
-    } else {
-        char *check_env = build_check_subs_blob(cfgsubs, path, testpath_abs);
-        if (check_env) {
-            if (setenv("TIKL_CHECK_SUBSTS", check_env, 1) != 0) {
-                fprintf(stderr, "setenv TIKL_CHECK_SUBSTS: %s\n", strerror(errno));
-                free(check_env);
-                fclose(f);
-                unsetenv("TIKL_CHECK_SUBSTS");
-                unsetenv("TIKL_LIT_COMPAT");
-                return 2;
-            }
-            free(check_env);
-        } else {
-            unsetenv("TIKL_CHECK_SUBSTS");
-        }
-    }
-    if (lit_compat) {
-        if (setenv("TIKL_LIT_COMPAT", "1", 1) != 0) {
-            fprintf(stderr, "setenv TIKL_LIT_COMPAT: %s\n", strerror(errno));
-            fclose(f);
-            unsetenv("TIKL_CHECK_SUBSTS");
-            unsetenv("TIKL_LIT_COMPAT");
-            return 2;
-        }
-    } else {
-        unsetenv("TIKL_LIT_COMPAT");
-    }
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        die("getcwd: %s", strerror(errno));
+    strbuf req = {0};
+    strbuf_append(&req, DAEMON_MAGIC "\n", strlen(DAEMON_MAGIC "\n"));
+    request_field(&req, "cwd", cwd);
+    request_number(&req, "verbosity", o->verbosity);
+    request_number(&req, "quiet", o->quiet);
+    request_number(&req, "keep-going", o->keep_going);
+    request_number(&req, "ordered", o->ordered);
+    if (o->report_json)
+        request_field(&req, "report-json", o->report_json);
+    if (o->report_junit)
+        request_field(&req, "report-junit", o->report_junit);
+    if (o->trace)
+        request_field(&req, "trace", o->trace);
+    if (o->metrics)
+        request_field(&req, "metrics", o->metrics);
+    request_number(&req, "time-tests", (long)o->time_tests);
+    request_number(&req, "progress", o->progress);
+    request_number(&req, "cache", o->cache);
+    request_number(&req, "async", o->async);
+    if (jobs_set)
+        request_number(&req, "jobs", (long)o->jobs);
+    request_number(&req, "from-stdin", from_stdin);
+    for (size_t i = 0; i + 1 < forwarded->n; i += 2)
+        request_field(&req, forwarded->v[i], forwarded->v[i + 1]);
+    for (int i = 0; i < nargs; i++)
+        request_field(&req, "arg", args[i]);
+    strbuf_append(&req, "end\n", 4);
 
-    vecstr runs = {0};
-    vecstr reqs = {0};
-    vecstr uns  = {0};
-    bool xfail = false;
-    char *xfail_reason = NULL;
-    unsigned allow_retries = 0;
-    bool have_allow_retries = false;
+    struct sockaddr_un sa;
+    daemon_socket_addr(&sa, sock);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        die("socket: %s", strerror(errno));
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+        die("connect %s: %s", sock, strerror(errno));
+    signal(SIGPIPE, SIG_IGN);
 
-    char *line = NULL;
-    size_t cap = 0;
-    ssize_t n;
-    char pending[8192] = "";
-    bool have_pending = false;
-    while ((n = getline(&line, &cap, f)) != -1) {
-        rtrim_inplace(line);
-        parse_requires(line, &reqs);
-        parse_unsupported(line, &uns);
-        parse_xfail(line, &xfail, &xfail_reason);
-        unsigned retries_val = 0;
-        int retries_parse = parse_allow_retries(line, &retries_val);
-        if (retries_parse == 1) {
-            allow_retries = retries_val;
-            have_allow_retries = true;
-        } else if (retries_parse == 0) {
-            fprintf(stderr, "%s: invalid ALLOW_RETRIES directive\n", path);
-        }
-
-        char cmd[8192];
-        if (parse_comment_run(line, cmd, sizeof(cmd))) {
-            if (ends_with(cmd, "\\")) {
-                size_t len = strlen(cmd);
-                if (len > 0)
-                    cmd[len - 1] = '\0';
-                copy_str(pending, sizeof(pending), cmd, "continued command");
-                have_pending = true;
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    struct iovec iov = { .iov_base = req.v, .iov_len = req.n };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(c), fds, sizeof(fds));
+    size_t off = 0;
+    while (off < req.n) {
+        ssize_t w = off == 0 ? sendmsg(fd, &msg, 0) :
+                    write(fd, req.v + off, req.n - off);
+        if (w < 0) {
+            if (errno == EINTR)
                 continue;
-            } else {
-                if (have_pending) {
-                    char joined[8192];
-                    join_with_space(joined, sizeof(joined), pending, cmd, "joined command");
-                    vecstr_push(&runs, joined);
-                    have_pending = false;
-                    pending[0] = '\0';
-                } else {
-                    vecstr_push(&runs, cmd);
-                }
-            }
-        } else if (have_pending) {
-            char cont[8192];
-            const char *p = line;
-            join_with_space(cont, sizeof(cont), pending, p, "continued command");
-            if (ends_with(cont, "\\")) {
-                cont[strlen(cont) -1] = '\0';
-                copy_str(pending, sizeof(pending), cont, "continued command");
-            } else {
-                vecstr_push(&runs, cont);
-                have_pending = false;
-                pending[0] = '\0';
-            }
+            die("send to %s: %s", sock, strerror(errno));
         }
+        off += (size_t)w;
     }
-    free(line);
-    fclose(f);
-    if (have_pending) {
-        vecstr_push(&runs, pending);
-    }
+    free(req.v);
 
-    if (!quiet)
-        fprintf(stderr, "[ RUN ] %s\n", path);
+    char reply[64];
+    size_t got = 0;
+    for (;;) {
+        ssize_t r = read(fd, reply + got, sizeof(reply) - 1 - got);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        got += (size_t)r;
+        if (got == sizeof(reply) - 1)
+            break;
+    }
+    close(fd);
+    reply[got] = '\0';
+    int rc;
+    if (sscanf(reply, "exit %d", &rc) != 1) {
+        fprintf(stderr, "tikl: daemon at %s closed the connection without "
+                "a result\n", sock);
+        return 127;
+    }
+    return rc;
+}
 
-    for (size_t i = 0; i < reqs.n; i++) {
-        if (!has_feature(features, reqs.v[i])) {
-            if (!quiet)
-                fprintf(stderr, "[ SKIP] %s (missing feature: %s)\n", path,
-                        reqs.v[i]);
-            vecstr_free(&runs);
-            vecstr_free(&reqs);
-            vecstr_free(&uns);
-            unsetenv("TIKL_CHECK_SUBSTS");
-            unsetenv("TIKL_LIT_COMPAT");
-            return 0;
+/* Runs in the forked child: reads the request, adopts the client's
+ * descriptors and working directory and runs its tests. */
+static int
+serve_daemon_request(int conn, const run_options *base, test_filter *filter)
+{
+    init_child_wait();
+    strbuf req = {0};
+    int fds[3] = { -1, -1, -1 };
+    for (;;) {
+        char buf[4096];
+        union {
+            struct cmsghdr h;
+            char buf[CMSG_SPACE(sizeof(fds))];
+        } ctl;
+        struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = sizeof(ctl.buf);
+        ssize_t r = recvmsg(conn, &msg, 0);
+        if (r < 0 && errno == EINTR && !abort_requested)
+            continue;
+        if (r <= 0)
+            break;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c;
+             c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS &&
+                c->cmsg_len == CMSG_LEN(sizeof(fds)) && fds[0] < 0)
+                memcpy(fds, CMSG_DATA(c), sizeof(fds));
         }
+        strbuf_append(&req, buf, (size_t)r);
+        if (req.n >= 5 && strcmp(req.v + req.n - 5, "\nend\n") == 0)
+            break;
     }
-    for (size_t i = 0; i < uns.n; i++) {
-        if (has_feature(features, uns.v[i])) {
-            if (!quiet)
-                fprintf(stderr, "[ SKIP] %s (unsupported on feature: %s)\n", path,
-                        uns.v[i]);
-            vecstr_free(&runs);
-            vecstr_free(&reqs);
-            vecstr_free(&uns);
-            unsetenv("TIKL_CHECK_SUBSTS");
-            unsetenv("TIKL_LIT_COMPAT");
-            return 0;
-        }
+
+    run_options ro = *base;
+    vecstr features = {0};
+    for (size_t i = 0; i < base->features->n; i++)
+        vecstr_push(&features, base->features->v[i]);
+    ro.features = &features;
+    test_filter own_filter = {0};
+    bool from_stdin = false;
+    const char *cwd = NULL;
+    vecstr args = {0};
+    bool ok = fds[0] >= 0 && req.n > 0 &&
+              strncmp(req.v, DAEMON_MAGIC "\n", strlen(DAEMON_MAGIC "\n")) == 0;
+    bool ended = false;
+    for (char *line = req.v, *nl; ok && !ended && line && *line; line = nl) {
+        nl = strchr(line, '\n');
+        if (!nl)
+            break;
+        *nl++ = '\0';
+        char *val = strchr(line, ' ');
+        if (val)
+            *val++ = '\0';
+        else
+            val = "";
+        if (strcmp(line, "end") == 0)
+            ended = true;
+        else if (strcmp(line, "cwd") == 0)
+            cwd = val;
+        else if (strcmp(line, "arg") == 0)
+            vecstr_push(&args, val);
+        else if (strcmp(line, "verbosity") == 0)
+            ro.verbosity = atoi(val);
+        else if (strcmp(line, "quiet") == 0)
+            ro.quiet = atoi(val) != 0;
+        else if (strcmp(line, "keep-going") == 0)
+            ro.keep_going = atoi(val) != 0;
+        else if (strcmp(line, "ordered") == 0)
+            ro.ordered = atoi(val) != 0;
+        else if (strcmp(line, "report-json") == 0)
+            ro.report_json = val;
+        else if (strcmp(line, "report-junit") == 0)
+            ro.report_junit = val;
+        else if (strcmp(line, "trace") == 0)
+            ro.trace = val;
+        else if (strcmp(line, "metrics") == 0)
+            ro.metrics = val;
+        else if (strcmp(line, "time-tests") == 0)
+            ro.time_tests = atoi(val) > 0 ? (unsigned)atoi(val) : 0;
+        else if (strcmp(line, "progress") == 0)
+            ro.progress = atoi(val) != 0;
+        else if (strcmp(line, "cache") == 0)
+            ro.cache = atoi(val) == CACHE_RERUN ? CACHE_RERUN :
+                       atoi(val) == CACHE_ON ? CACHE_ON : CACHE_OFF;
+        else if (strcmp(line, "jobs") == 0)
+            ro.jobs = atoi(val) > 0 ? (unsigned)atoi(val) : base->jobs;
+        else if (strcmp(line, "from-stdin") == 0)
+            from_stdin = atoi(val) != 0;
+        else if (strcmp(line, "async") == 0)
+            ro.async = atoi(val) != 0;
+        /* this process serves only this request, so the globals are its own */
+        else if (strcmp(line, "timeout") == 0)
+            ok = parse_timeout_option(val);
+        else if (strcmp(line, "kill-grace") == 0)
+            ok = parse_duration_ms(val, &kill_grace_ms);
+        else if (strcmp(line, "max-time") == 0)
+            ok = parse_duration_ms(val, &max_time_ms);
+        else if (strcmp(line, "metrics-interval") == 0)
+            ok = parse_duration_ms(val, &metrics_interval_ms);
+        else if (strcmp(line, "limit") == 0)
+            ok = parse_limits(val, &default_limits);
+        else if (strcmp(line, "log-dir") == 0)
+            log_dir = val;
+        else if (strcmp(line, "lit-compat") == 0)
+            lit_compat = atoi(val) != 0;
+        else if (strcmp(line, "feature") == 0)
+            vecstr_push(&features, val);
+        else if (strcmp(line, "suffix") == 0)
+            vecstr_push(&own_filter.suffixes, val);
+        else if (strcmp(line, "include") == 0)
+            vecstr_push(&own_filter.includes, val);
+        else if (strcmp(line, "exclude") == 0)
+            vecstr_push(&own_filter.excludes, val);
+        else if (strcmp(line, "filter") == 0 || strcmp(line, "filter-out") == 0)
+            ok = test_filter_set_regex(&own_filter,
+                                       strcmp(line, "filter-out") == 0, val);
     }
+    bool use_own_filter = own_filter.suffixes.n > 0 ||
+                          own_filter.includes.n > 0 ||
+                          own_filter.excludes.n > 0 ||
+                          own_filter.have_filter || own_filter.have_filter_out;
 
-    if (runs.n == 0) {
-        if (!quiet) {
-            if (xfail) {
-                const char *sep = (xfail_reason && *xfail_reason) ? "; " : "";
-                const char *msg = (xfail_reason && *xfail_reason) ? xfail_reason : "";
-                fprintf(stderr, "[XFAIL] %s (no RUN directives%s%s)\n", path, sep, msg);
-            } else {
-                fprintf(stderr, "[FAIL] %s (no RUN directives)\n", path);
-            }
+    int rc = 2;
+    if (req.n == 0) {
+        /* a connect without a request, e.g. a liveness probe */
+    } else if (!ok || !ended || !cwd) {
+        fprintf(stderr, "tikl: malformed daemon request\n");
+    } else {
+        for (int i = 0; i < 3; i++)
+            dup2(fds[i], i);
+        if (chdir(cwd) != 0) {
+            fprintf(stderr, "tikl: chdir %s: %s\n", cwd, strerror(errno));
+        } else {
+            test_source source = {
+                .args = args.v,
+                .nargs = (int)args.n,
+                .from_stdin = from_stdin,
+                .filter = use_own_filter ? &own_filter : filter,
+            };
+            rc = run_tests(&source, &ro);
+            test_source_free(&source);
+            save_test_times(ro.verbosity);
+            if (abort_requested && rc == 0)
+                rc = 128 + abort_requested;
         }
-        vecstr_free(&runs);
-        vecstr_free(&reqs);
-        vecstr_free(&uns);
-        free(xfail_reason);
-        unsetenv("TIKL_CHECK_SUBSTS");
-        unsetenv("TIKL_LIT_COMPAT");
-        return xfail ? 0 : 1;
     }
+    for (int i = 0; i < 3; i++)
+        if (fds[i] > STDERR_FILENO)
+            close(fds[i]);
+    fflush(stdout);
+    fflush(stderr);
+    char reply[32];
+    int n = snprintf(reply, sizeof(reply), "exit %d\n", rc);
+    ssize_t w = write(conn, reply, (size_t)n);
+    (void)w;
+    vecstr_free(&args);
+    vecstr_free(&features);
+    test_filter_free(&own_filter);
+    free(req.v);
+    return rc;
+}
 
-    char *shared_tdir = NULL;
-    char shared_tfile[PATH_MAX];
-    const char *shared_scratch_T = NULL;
-    prepare_shared_scratch(&shared_tdir, shared_tfile, sizeof(shared_tfile),
-                           &shared_scratch_T);
+/* Picks up durations and index records the request children wrote, so the
+ * next request starts from warm caches. */
+static void
+daemon_refresh_state(void)
+{
+    load_test_times();
+    index_free();
+    load_directive_index();
+}
 
-    int rc = 0;
-    bool xfail_hit = false;
-    for (size_t i = 0; i < runs.n; i++) {
-        char *cmd = perform_substitutions(runs.v[i], cfgsubs, path, testpath_abs,
-                                          shared_tfile, shared_scratch_T);
-        unsigned attempts = have_allow_retries ? (allow_retries + 1) : 1;
-        if (attempts == 0)
-            attempts = 1;
-        bool success = false;
-        int ec = 0;
-        bool timed_out = false;
-        unsigned used_attempts = 0;
-        for (unsigned attempt = 0; attempt < attempts; attempt++) {
-            bool this_timeout = false;
-            ec = run_shell(cmd, verbosity, &this_timeout);
-            used_attempts = attempt + 1;
-            timed_out = this_timeout;
-            if (ec == 0) {
-                success = true;
-                break;
-            }
-            if (attempt + 1 < attempts && !quiet) {
-                if (this_timeout) {
-                    fprintf(stderr, "[RETRY] %s (step %zu timed out, retry %u/%u)\n",
-                            path, i + 1, attempt + 2, attempts);
-                } else {
-                    fprintf(stderr, "[RETRY] %s (step %zu exit %d, retry %u/%u)\n",
-                            path, i + 1, ec, attempt + 2, attempts);
-                }
+static int
+run_daemon(const char *sock, const run_options *o, test_filter *filter)
+{
+    struct sockaddr_un sa;
+    daemon_socket_addr(&sa, sock);
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0)
+        die("socket: %s", strerror(errno));
+    if (bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        if (errno != EADDRINUSE)
+            die("bind %s: %s", sock, strerror(errno));
+        /* replace a stale socket, but never one a live daemon answers on */
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe >= 0 && connect(probe, (struct sockaddr *)&sa, sizeof(sa)) == 0)
+            die("a daemon is already listening on %s", sock);
+        if (probe >= 0)
+            close(probe);
+        unlink(sock);
+        if (bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+            die("bind %s: %s", sock, strerror(errno));
+    }
+    if (listen(lfd, 64) != 0)
+        die("listen %s: %s", sock, strerror(errno));
+    fcntl(lfd, F_SETFD, FD_CLOEXEC);
+    if (o->verbosity >= 1)
+        fprintf(stderr, "tikl: daemon listening on %s\n", sock);
+    fflush(stdout);
+    fflush(stderr);
+
+    daemon_request *reqs = NULL;
+    size_t nreqs = 0, cap = 0;
+    struct pollfd *pfds = NULL;
+    while (!abort_requested) {
+        pfds = xrealloc(pfds, (nreqs + 2) * sizeof(*pfds));
+        pfds[0] = (struct pollfd) { .fd = lfd, .events = POLLIN };
+        pfds[1] = (struct pollfd) { .fd = sigchld_pipe[0], .events = POLLIN };
+        for (size_t i = 0; i < nreqs; i++) {
+            /* no events: the request bytes belong to the child, only a
+             * hangup matters here */
+            pfds[i + 2] = (struct pollfd) {
+                .fd = reqs[i].cancelled ? -1 : reqs[i].conn, .events = 0
+            };
+        }
+        if (poll(pfds, (nfds_t)(nreqs + 2), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            die("poll: %s", strerror(errno));
+        }
+        /* the client hung up before its run finished */
+        for (size_t i = 0; i < nreqs; i++) {
+            if ((pfds[i + 2].revents & (POLLHUP | POLLERR)) &&
+                !reqs[i].cancelled) {
+                kill(-reqs[i].pid, SIGTERM);
+                reqs[i].cancelled = true;
             }
         }
-        if (!success) {
-            if (!quiet) {
-                if (xfail) {
-                    const char *sep = (xfail_reason && *xfail_reason) ? "; " : "";
-                    const char *msg = (xfail_reason && *xfail_reason) ? xfail_reason : "";
-                    if (timed_out) {
-                        fprintf(stderr, "[XFAIL] %s (step %zu timed out%s%s)\n", path,
-                                i + 1, sep, msg);
-                    } else {
-                        fprintf(stderr, "[XFAIL] %s (step %zu exit %d%s%s)\n", path, i + 1,
-                                ec, sep, msg);
-                    }
-                } else {
-                    const char *attempt_note = (used_attempts > 1) ? " after retries" : "";
-                    if (timed_out) {
-                        fprintf(stderr, "[ TIME] %s (step %zu exceeded %u s%s)\n", path,
-                                i + 1, timeout_secs, attempt_note);
-                    } else {
-                        fprintf(stderr, "[ FAIL] %s (step %zu exit %d%s)\n", path, i + 1,
-                                ec, attempt_note);
+        if (pfds[1].revents) {
+            drain_child_wait();
+            bool reaped = false;
+            int st;
+            pid_t pid;
+            while ((pid = waitpid(-1, &st, WNOHANG)) > 0) {
+                for (size_t i = 0; i < nreqs; i++) {
+                    if (reqs[i].pid == pid) {
+                        close(reqs[i].conn);
+                        reqs[i] = reqs[--nreqs];
+                        break;
                     }
                 }
+                reaped = true;
             }
-            free(cmd);
-            if (xfail) {
-                xfail_hit = true;
-                rc = 0;
-            } else {
-                rc = ec ? ec : 1;
-            }
-            break;
+            if (reaped)
+                daemon_refresh_state();
         }
-        free(cmd);
-    }
-    free(shared_tdir);
-    if (rc == 0) {
-        if (xfail) {
-            if (!xfail_hit) {
-                if (!quiet) {
-                    const char *sep = (xfail_reason && *xfail_reason) ? ": " : "";
-                    const char *msg = (xfail_reason && *xfail_reason) ? xfail_reason : "";
-                    fprintf(stderr, "[XPASS] %s%s%s\n", path, sep, msg);
-                }
-                rc = 1;
-            }
-        } else {
-            if (!quiet)
-                fprintf(stderr, "[  OK ] %s\n", path);
+        if (!(pfds[0].revents & POLLIN))
+            continue;
+        int conn = accept(lfd, NULL, NULL);
+        if (conn < 0)
+            continue;
+        fcntl(conn, F_SETFD, FD_CLOEXEC);
+#ifdef __linux__
+        /* requests run as the daemon's user: refuse everybody else */
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+            cred.uid != geteuid()) {
+            if (o->verbosity >= 1)
+                fprintf(stderr, "tikl: refused a connection from another user\n");
+            close(conn);
+            continue;
+        }
+#endif
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(lfd);
+            for (size_t i = 0; i < nreqs; i++)
+                close(reqs[i].conn);
+            setpgid(0, 0);
+            _exit(serve_daemon_request(conn, o, filter));
         }
+        if (pid < 0) {
+            perror("fork");
+            close(conn);
+            continue;
+        }
+        setpgid(pid, pid);
+        if (nreqs == cap) {
+            cap = cap ? cap * 2 : 8;
+            reqs = xrealloc(reqs, cap * sizeof(*reqs));
+        }
+        reqs[nreqs++] = (daemon_request) { .pid = pid, .conn = conn };
     }
 
-    vecstr_free(&runs);
-    vecstr_free(&reqs);
-    vecstr_free(&uns);
-    free(xfail_reason);
-    unsetenv("TIKL_CHECK_SUBSTS");
-    unsetenv("TIKL_LIT_COMPAT");
-    return rc;
+    for (size_t i = 0; i < nreqs; i++)
+        kill(-reqs[i].pid, SIGTERM);
+    for (size_t i = 0; i < nreqs; i++) {
+        while (waitpid(reqs[i].pid, NULL, 0) < 0 && errno == EINTR)
+            ;
+        close(reqs[i].conn);
+    }
+    free(reqs);
+    free(pfds);
+    close(lfd);
+    unlink(sock);
+    return 0;
 }
 
 static void
 usage(const char *arg0)
 {
     fprintf(stderr,
-            "Usage: %s [-v|-q] [-k] [-c config] [-D feature]... [-t seconds] "
-            "[-T scratch] [-b binroot] [-s srcroot] [-j jobs] [-L] FILE...\n"
+            "Usage: %s [-v|-q] [-k] [-c config] [-D feature]... [-t duration] "
+            "[-T scratch] [-b binroot] [-s srcroot] [-j jobs] [-L] PATH...\n"
+            "  PATH is a test file, a directory to search recursively, or @LISTFILE\n"
             "  -v           verbose: print shell commands (repeat for command output)\n"
             "  -q           quiet (only pass/fail)\n"
             "  -k           keep going after failures\n"
             "  -c FILE      substitution config (lines: key = value)\n"
             "  -D feature   enable feature for REQUIRES/UNSUPPORTED\n"
-            "  -t SECONDS   timeout for each RUN command (0 disables)\n"
+            "  -t DURATION  timeout for each RUN command, e.g. 2, 0.25, 250ms (0 disables)\n"
+            "  -t auto[,factor=K,floor=DURATION,cap=DURATION]\n"
+            "               derive each step's timeout from its history (default 3x p99,\n"
+            "               floor 1 s); steps without history use the plain -t value\n"
             "  -T DIR       scratch directory root for %%t/%%T (default /tmp)\n"
             "  -b DIR       base directory used when expanding %%b/%%B (default bin)\n"
             "  -s DIR       source tree root when invoking tikl from a build directory\n"
             "  -j JOBS      run up to JOBS workers in parallel\n"
+            "  --async      run the -j tests from one event loop, without workers\n"
+            "  --ordered    with -j, report tests in the order they were given\n"
             "  -L           force lit-compatible behaviour (disable tikl extras)\n"
-            "  -V           print tikl version and exit\n", arg0);
+            "  -V           print tikl version and exit\n"
+            "  --kill-grace DURATION\n"
+            "               on timeout, send SIGTERM and wait DURATION before SIGKILL\n"
+            "  --max-time DURATION\n"
+            "               stop the whole run after DURATION; tests not started are\n"
+            "               reported as NORUN\n"
+            "  --limit SPEC default limits for each RUN command, e.g.\n"
+            "               mem=512M,cpu=10,fsize=1G,nproc=64 (tests may set LIMIT:)\n"
+            "  --cgroup DIR enforce mem and nproc limits in cgroup v2 leaves of DIR\n"
+            "  --state-dir DIR\n"
+            "               keep durations and run history in DIR (default BINROOT/.tikl,\n"
+            "               empty disables)\n"
+            "  --log-dir DIR\n"
+            "               also write each test's command output to DIR/TEST.log\n"
+            "  --report-json FILE, --report-junit FILE\n"
+            "               write per-test results as JSON Lines or JUnit XML\n"
+            "  --trace FILE write a Chrome/Perfetto trace of the run: a track per -j\n"
+            "               slot with test and step spans and tikl's own overhead\n"
+            "  --metrics FILE\n"
+            "               write run statistics for node_exporter's textfile collector\n"
+            "  --metrics-interval DURATION\n"
+            "               also rewrite the --metrics file this often during the run\n"
+            "  --time-tests[=N]\n"
+            "               list the N (default 10) slowest tests and steps at the end\n"
+            "  --progress   show done/total, running, failed and an ETA while running\n"
+            "  --cache      report tests whose inputs are unchanged since they last\n"
+            "               passed as OK without running them\n"
+            "  --rerun      run every test, refreshing what --cache knows\n"
+            "  --suffix SUF run only files ending in SUF when walking directories\n"
+            "  --include GLOB, --exclude GLOB\n"
+            "               keep or drop tests (and directories) matching GLOB\n"
+            "  --filter REGEX, --filter-out REGEX\n"
+            "               keep or drop tests whose path matches REGEX\n"
+            "  --from-stdin read additional test paths from standard input\n"
+            "  --daemon SOCKET\n"
+            "               keep config and caches warm and serve runs on SOCKET\n"
+            "  --connect SOCKET\n"
+            "               run PATH... in the daemon listening on SOCKET\n"
+            "\n"
+            "       %s [--state-dir DIR] [--slowdown FACTOR] history [FILE...]\n"
+            "  show p50/p95 durations from the run history and flag tests whose\n"
+            "  recent runs are FACTOR (default 2) times slower than before\n",
+            arg0, arg0);
 }
 
+enum {
+    OPT_KILL_GRACE = 256,
+    OPT_STATE_DIR,
+    OPT_SLOWDOWN,
+    OPT_SUFFIX,
+    OPT_INCLUDE,
+    OPT_EXCLUDE,
+    OPT_FILTER,
+    OPT_FILTER_OUT,
+    OPT_FROM_STDIN,
+    OPT_DAEMON,
+    OPT_CONNECT,
+    OPT_ASYNC,
+    OPT_LOG_DIR,
+    OPT_ORDERED,
+    OPT_REPORT_JSON,
+    OPT_REPORT_JUNIT,
+    OPT_TRACE,
+    OPT_METRICS,
+    OPT_METRICS_INTERVAL,
+    OPT_TIME_TESTS,
+    OPT_PROGRESS,
+    OPT_CACHE,
+    OPT_RERUN,
+    OPT_LIMIT,
+    OPT_CGROUP,
+    OPT_MAX_TIME,
+};
+
+static const struct option long_options[] = {
+    { "kill-grace", required_argument, NULL, OPT_KILL_GRACE },
+    { "state-dir", required_argument, NULL, OPT_STATE_DIR },
+    { "slowdown", required_argument, NULL, OPT_SLOWDOWN },
+    { "suffix", required_argument, NULL, OPT_SUFFIX },
+    { "include", required_argument, NULL, OPT_INCLUDE },
+    { "exclude", required_argument, NULL, OPT_EXCLUDE },
+    { "filter", required_argument, NULL, OPT_FILTER },
+    { "filter-out", required_argument, NULL, OPT_FILTER_OUT },
+    { "from-stdin", no_argument, NULL, OPT_FROM_STDIN },
+    { "daemon", required_argument, NULL, OPT_DAEMON },
+    { "connect", required_argument, NULL, OPT_CONNECT },
+    { "async", no_argument, NULL, OPT_ASYNC },
+    { "log-dir", required_argument, NULL, OPT_LOG_DIR },
+    { "ordered", no_argument, NULL, OPT_ORDERED },
+    { "report-json", required_argument, NULL, OPT_REPORT_JSON },
+    { "report-junit", required_argument, NULL, OPT_REPORT_JUNIT },
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { "metrics", required_argument, NULL, OPT_METRICS },
+    { "metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL },
+    { "time-tests", optional_argument, NULL, OPT_TIME_TESTS },
+    { "progress", no_argument, NULL, OPT_PROGRESS },
+    { "cache", no_argument, NULL, OPT_CACHE },
+    { "rerun", no_argument, NULL, OPT_RERUN },
+    { "limit", required_argument, NULL, OPT_LIMIT },
+    { "cgroup", required_argument, NULL, OPT_CGROUP },
+    { "max-time", required_argument, NULL, OPT_MAX_TIME },
+    { NULL, 0, NULL, 0 },
+};
+
 int
 main(int argc, char **argv)
 {
@@ -1422,9 +7925,23 @@ main(int argc, char **argv)
     vecstr env_args = {0};
     const char *cfgpath = NULL;
     const char *source_root_arg = NULL;
+    const char *state_dir_arg = NULL;
+    double slowdown_factor = 2.0;
+    test_filter filter = {0};
+    bool from_stdin = false;
     unsigned jobs = 1;
-
-    prepend_own_dir_to_path(argv[0]);
+    bool jobs_set = false;
+    bool async = false;
+    bool ordered = false;
+    const char *report_json = NULL;
+    const char *report_junit = NULL;
+    const char *trace = NULL;
+    const char *metrics = NULL;
+    unsigned time_tests = 0;
+    bool progress_line = false;
+    cache_mode cache = CACHE_OFF;
+    const char *daemon_path = NULL;
+    const char *connect_path = NULL;
 
     parse_env_options(&env_args, getenv("TIKL_OPTIONS"));
 
@@ -1453,26 +7970,34 @@ main(int argc, char **argv)
     if (cfgpath)
         parse_config(cfgpath, &subs, &config_args);
 
-    /* merge config args before user args (excluding -c) */
-    vecstr merged = {0};
-    vecstr_push(&merged, argv[0]);
+    /* merge config args before user args (excluding -c); the merged vector
+     * only borrows the strings, so long file lists are not copied */
+    char **pargv = xrealloc(NULL, (config_args.n + env_args.n + (size_t)argc + 1) *
+                            sizeof(*pargv));
+    int parc = 0;
+    pargv[parc++] = argv[0];
     for (size_t i = 0; i < config_args.n; i++)
-        vecstr_push(&merged, config_args.v[i]);
+        pargv[parc++] = config_args.v[i];
     for (size_t i = 0; i < env_args.n; i++)
-        vecstr_push(&merged, env_args.v[i]);
+        pargv[parc++] = env_args.v[i];
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-c") == 0) {
             i++;
             continue;
         }
-        vecstr_push(&merged, argv[i]);
+        pargv[parc++] = argv[i];
     }
-
-    char **pargv = merged.v;
-    int parc = (int)merged.n;
+    pargv[parc] = NULL;
+    /* --connect passes per-run options on to the daemon and refuses the
+     * ones fixed when it started, unless they come from the config file
+     * or TIKL_OPTIONS, which the daemon may well share */
+    int first_cmdline_arg = 1 + (int)(config_args.n + env_args.n);
+    vecstr forwarded = {0};
+    const char *daemon_only = NULL;
 
     optind = 1;
-    while ((opt = getopt(parc, pargv, "vqkc:D:t:T:b:s:j:VL")) != -1) {
+    while ((opt = getopt_long(parc, pargv, "vqkc:D:t:T:b:s:j:VL", long_options,
+                              NULL)) != -1) {
         switch (opt) {
             case 'v':
                 if (verbosity < 2)
@@ -1488,29 +8013,140 @@ main(int argc, char **argv)
                 cfgpath = optarg;
                 break;
             case 'D':
-                if (optarg && *optarg)
+                if (optarg && *optarg) {
                     vecstr_push(&features, optarg);
+                    forward_option(&forwarded, "feature", optarg);
+                }
+                break;
+            case 't':
+                if (!parse_timeout_option(optarg))
+                    die("invalid timeout: %s", optarg);
+                forward_option(&forwarded, "timeout", optarg);
+                break;
+            case OPT_KILL_GRACE:
+                if (!parse_duration_ms(optarg, &kill_grace_ms))
+                    die("invalid kill grace period: %s", optarg);
+                forward_option(&forwarded, "kill-grace", optarg);
+                break;
+            case OPT_MAX_TIME:
+                if (!parse_duration_ms(optarg, &max_time_ms))
+                    die("invalid run time limit: %s", optarg);
+                forward_option(&forwarded, "max-time", optarg);
+                break;
+            case OPT_STATE_DIR:
+                state_dir_arg = optarg;
+                if (optind > first_cmdline_arg)
+                    daemon_only = "--state-dir";
                 break;
-            case 't': {
+            case OPT_SUFFIX:
+                vecstr_push(&filter.suffixes, optarg);
+                forward_option(&forwarded, "suffix", optarg);
+                break;
+            case OPT_INCLUDE:
+                vecstr_push(&filter.includes, optarg);
+                forward_option(&forwarded, "include", optarg);
+                break;
+            case OPT_EXCLUDE:
+                vecstr_push(&filter.excludes, optarg);
+                forward_option(&forwarded, "exclude", optarg);
+                break;
+            case OPT_FILTER:
+            case OPT_FILTER_OUT:
+                if (!test_filter_set_regex(&filter, opt == OPT_FILTER_OUT, optarg))
+                    die("invalid regex: %s", optarg);
+                forward_option(&forwarded, opt == OPT_FILTER ? "filter" :
+                               "filter-out", optarg);
+                break;
+            case OPT_FROM_STDIN:
+                from_stdin = true;
+                break;
+            case OPT_DAEMON:
+                daemon_path = optarg;
+                break;
+            case OPT_CONNECT:
+                connect_path = optarg;
+                break;
+            case OPT_ASYNC:
+                async = true;
+                break;
+            case OPT_LOG_DIR:
+                log_dir = optarg;
+                forward_option(&forwarded, "log-dir", optarg);
+                break;
+            case OPT_ORDERED:
+                ordered = true;
+                break;
+            case OPT_REPORT_JSON:
+                report_json = optarg;
+                break;
+            case OPT_REPORT_JUNIT:
+                report_junit = optarg;
+                break;
+            case OPT_TRACE:
+                trace = optarg;
+                break;
+            case OPT_METRICS:
+                metrics = optarg;
+                break;
+            case OPT_METRICS_INTERVAL:
+                if (!parse_duration_ms(optarg, &metrics_interval_ms))
+                    die("invalid metrics interval: %s", optarg);
+                forward_option(&forwarded, "metrics-interval", optarg);
+                break;
+            case OPT_TIME_TESTS: {
+                    time_tests = 10;
+                    if (!optarg)
+                        break;
                     errno = 0;
                     char *end = NULL;
                     unsigned long v = strtoul(optarg, &end, 10);
-                    if (errno || !end || *end != '\0')
-                        die("invalid timeout: %s", optarg);
-                    if (v > UINT_MAX)
-                        die("timeout too large: %s", optarg);
-                    timeout_secs = (unsigned)v;
+                    if (errno || !end || *end != '\0' || v == 0 || v > 100000)
+                        die("invalid --time-tests count: %s", optarg);
+                    time_tests = (unsigned)v;
+                    break;
+                }
+            case OPT_PROGRESS:
+                progress_line = true;
+                break;
+            case OPT_CACHE:
+                if (cache == CACHE_OFF)
+                    cache = CACHE_ON;
+                break;
+            case OPT_RERUN:
+                cache = CACHE_RERUN;
+                break;
+            case OPT_LIMIT:
+                if (!parse_limits(optarg, &default_limits))
+                    die("invalid limit: %s", optarg);
+                forward_option(&forwarded, "limit", optarg);
+                break;
+            case OPT_CGROUP:
+                cgroup_dir = (optarg && *optarg) ? optarg : NULL;
+                if (optind > first_cmdline_arg)
+                    daemon_only = "--cgroup";
+                break;
+            case OPT_SLOWDOWN: {
+                    char *end = NULL;
+                    slowdown_factor = strtod(optarg, &end);
+                    if (end == optarg || *end != '\0' || !(slowdown_factor > 1.0))
+                        die("invalid slowdown factor: %s", optarg);
                     break;
                 }
             case 'T':
                 scratch_root = (optarg && *optarg) ? optarg : default_scratch_root;
                 scratch_root_forced = (optarg && *optarg);
+                if (optind > first_cmdline_arg)
+                    daemon_only = "-T";
                 break;
             case 'b':
                 bin_root = (optarg && *optarg) ? optarg : default_bin_root;
+                if (optind > first_cmdline_arg)
+                    daemon_only = "-b";
                 break;
             case 's':
                 source_root_arg = (optarg && *optarg) ? optarg : NULL;
+                if (optind > first_cmdline_arg)
+                    daemon_only = "-s";
                 break;
             case 'j': {
                     errno = 0;
@@ -1521,6 +8157,7 @@ main(int argc, char **argv)
                     if (v > UINT_MAX)
                         die("jobs too large: %s", optarg);
                     jobs = (unsigned)v;
+                    jobs_set = true;
                     break;
                 }
             case 'V':
@@ -1528,18 +8165,21 @@ main(int argc, char **argv)
                 vecstr_free(&features);
                 vecstr_free(&config_args);
                 vecstr_free(&env_args);
-                vecstr_free(&merged);
+                vecstr_free(&forwarded);
+                free(pargv);
                 mapkv_free(&subs);
                 return 0;
             case 'L':
                 lit_compat = true;
+                forward_option(&forwarded, "lit-compat", "1");
                 break;
             default:
                 usage(pargv[0]);
                 vecstr_free(&features);
                 vecstr_free(&config_args);
                 vecstr_free(&env_args);
-                vecstr_free(&merged);
+                vecstr_free(&forwarded);
+                free(pargv);
                 mapkv_free(&subs);
                 return 2;
         }
@@ -1550,6 +8190,33 @@ main(int argc, char **argv)
         }
         source_root = source_root_buf;
     }
+    /* daemon requests run in the client's directory */
+    static char daemon_bin_root[PATH_MAX], daemon_scratch_root[PATH_MAX];
+    static char daemon_state_dir[PATH_MAX], daemon_log_dir[PATH_MAX];
+    static char daemon_cgroup_dir[PATH_MAX];
+    if (daemon_path) {
+        if (cgroup_dir)
+            cgroup_dir = absolute_path(cgroup_dir, daemon_cgroup_dir,
+                                       sizeof(daemon_cgroup_dir));
+        if (log_dir && *log_dir)
+            log_dir = absolute_path(log_dir, daemon_log_dir,
+                                    sizeof(daemon_log_dir));
+        bin_root = absolute_path(bin_root, daemon_bin_root,
+                                 sizeof(daemon_bin_root));
+        scratch_root = absolute_path(scratch_root, daemon_scratch_root,
+                                     sizeof(daemon_scratch_root));
+        if (state_dir_arg && *state_dir_arg)
+            state_dir_arg = absolute_path(state_dir_arg, daemon_state_dir,
+                                          sizeof(daemon_state_dir));
+    }
+    if (!state_dir_arg) {
+        const char *root = (bin_root && *bin_root) ? bin_root : default_bin_root;
+        if (build_temp_path(state_dir_buf, sizeof(state_dir_buf), root, ".tikl"))
+            state_dir = state_dir_buf;
+    } else if (*state_dir_arg) {
+        copy_str(state_dir_buf, sizeof(state_dir_buf), state_dir_arg, "state dir");
+        state_dir = state_dir_buf;
+    }
     if (quiet && verbosity > 0)
         quiet = false;
 
@@ -1558,8 +8225,23 @@ main(int argc, char **argv)
         const char *src_root = source_root ? source_root : "(none)";
         const char *bin_root_print = bin_root ? bin_root : "(default)";
         const char *scratch = scratch_root ? scratch_root : default_scratch_root;
-        fprintf(stderr, "[opts] -c=%s -b=%s -s=%s -T=%s -t=%u -j=%u -L=%s\n",
-                cfg, bin_root_print, src_root, scratch, timeout_secs, jobs,
+        char tbuf[32], gbuf[32], abuf[128];
+        const char *tdesc = format_duration(tbuf, sizeof(tbuf), timeout_ms);
+        if (auto_timeout.on) {
+            char fl[32], cp[32];
+            snprintf(abuf, sizeof(abuf),
+                     "auto(%gx p99, floor %s, cap %s, fallback %s)",
+                     auto_timeout.factor,
+                     format_duration(fl, sizeof(fl), auto_timeout.floor_ms),
+                     auto_timeout.cap_ms ? format_duration(cp, sizeof(cp),
+                                                           auto_timeout.cap_ms)
+                                         : "none", tbuf);
+            tdesc = abuf;
+        }
+        fprintf(stderr,
+                "[opts] -c=%s -b=%s -s=%s -T=%s -t=%s --kill-grace=%s -j=%u -L=%s\n",
+                cfg, bin_root_print, src_root, scratch, tdesc,
+                format_duration(gbuf, sizeof(gbuf), kill_grace_ms), jobs,
                 lit_compat ? "on" : "off");
         fputs("[features]", stderr);
         for (size_t i = 0; i < features.n; i++) {
@@ -1568,103 +8250,137 @@ main(int argc, char **argv)
         fputc('\n', stderr);
     }
 
-    if (optind >= parc) {
+    if (daemon_path && connect_path)
+        die("--daemon and --connect are mutually exclusive");
+    if (connect_path && daemon_only)
+        die("%s is set when the daemon starts; pass it to --daemon", daemon_only);
+    if (async && ordered)
+        die("--ordered cannot be combined with --async");
+    if (daemon_path && (optind < parc || from_stdin))
+        die("--daemon takes no test paths; pass them to --connect");
+    if (optind >= parc && !from_stdin && !daemon_path) {
         usage(pargv[0]);
         vecstr_free(&config_args);
         vecstr_free(&env_args);
-        vecstr_free(&merged);
+        vecstr_free(&forwarded);
+        free(pargv);
         mapkv_free(&subs);
         return 2;
     }
 
+    /* "history" is a test path after "--" or when such a file exists */
+    if (optind < parc && strcmp(pargv[optind], "history") == 0 &&
+        strcmp(pargv[optind - 1], "--") != 0 && access("history", F_OK) != 0) {
+        int rc = run_history_query(pargv + optind + 1, parc - optind - 1,
+                                   slowdown_factor);
+        vecstr_free(&features);
+        vecstr_free(&config_args);
+        vecstr_free(&env_args);
+        vecstr_free(&forwarded);
+        free(pargv);
+        mapkv_free(&subs);
+        return rc;
+    }
+
+    if (connect_path) {
+        run_options ro = {
+            .verbosity = verbosity,
+            .quiet = quiet,
+            .keep_going = keep_going,
+            .jobs = jobs,
+            .ordered = ordered,
+            .report_json = report_json,
+            .report_junit = report_junit,
+            .trace = trace,
+            .metrics = metrics,
+            .async = async,
+            .time_tests = time_tests,
+            .progress = progress_line,
+            .cache = cache,
+        };
+        int rc = run_daemon_client(connect_path, pargv + optind, parc - optind,
+                                   &ro, jobs_set, from_stdin, &forwarded);
+        test_filter_free(&filter);
+        vecstr_free(&features);
+        vecstr_free(&config_args);
+        vecstr_free(&env_args);
+        vecstr_free(&forwarded);
+        free(pargv);
+        mapkv_free(&subs);
+        return rc;
+    }
+
+    prepend_own_dir_to_path(argv[0]);
+    /* --cache keys results on both binaries */
+    char self_path[PATH_MAX];
+    if (!resolve_program_path(argv[0], self_path) ||
+        !realpath(self_path, tikl_exe_path))
+        tikl_exe_path[0] = '\0';
+    if (!resolve_program_path("tikl-check", self_path) ||
+        !realpath(self_path, tikl_check_exe_path))
+        tikl_check_exe_path[0] = '\0';
+    if (cgroup_dir)
+        setup_cgroup();
+
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
     sa.sa_handler = handle_sig;
     sigemptyset(&sa.sa_mask);
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    init_child_wait();
+    raise_fd_limit();
 
     init_run_shell();
+    load_test_times();
+    open_history();
+    open_directive_index();
 
-    int overall_rc = 0;
-    int nfiles = parc - optind;
-    if (jobs <= 1 || nfiles <= 1) {
-        for (int i = optind; i < parc; i++) {
-            int rc = run_test_file(pargv[i], &subs, &features, verbosity, quiet);
-            if (rc != 0) {
-                if (overall_rc == 0)
-                    overall_rc = rc;
-                if (!keep_going)
-                    break;
-            }
-        }
-    } else {
-        int next = optind;
-        unsigned active = 0;
-        bool stop_scheduling = false;
-        while ((next < parc && !stop_scheduling) || active > 0) {
-            if (abort_requested) {
-                stop_scheduling = true;
-                kill_active_workers(SIGTERM);
-            }
-            while (active < jobs && next < parc && !stop_scheduling) {
-                pid_t pid = fork();
-                if (pid == 0) {
-                    setpgid(0, 0);
-                    char *worker_scratch = NULL;
-                    if (!scratch_root_forced) {
-                        worker_scratch = make_temp_dir();
-                        if (!worker_scratch)
-                            _exit(127);
-                        scratch_root = worker_scratch;
-                    }
-                    int rc = run_test_file(pargv[next], &subs, &features,
-                                           verbosity, quiet);
-                    free(worker_scratch);
-                    _exit(rc);
-                } else if (pid > 0) {
-                    active++;
-                    next++;
-                    vecpid_push(&worker_pids, pid);
-                } else {
-                    perror("fork");
-                    overall_rc = 127;
-                    break;
-                }
-            }
-            if (active == 0)
-                break;
-            int st = 0;
-            pid_t w = wait(&st);
-            if (w < 0) {
-                if (errno == EINTR)
-                    continue;
-                perror("wait");
-                overall_rc = 127;
-                break;
-            }
-            vecpid_remove(&worker_pids, w);
-            active--;
-            int rc = 1;
-            if (WIFEXITED(st))
-                rc = WEXITSTATUS(st);
-            if (rc != 0) {
-                if (overall_rc == 0)
-                    overall_rc = rc;
-                if (!keep_going) {
-                    stop_scheduling = true;
-                    kill_active_workers(SIGTERM);
-                }
-            }
-        }
-    }
+    test_source source = {
+        .args = pargv + optind,
+        .nargs = parc - optind,
+        .from_stdin = from_stdin,
+        .filter = &filter,
+    };
+    run_options ro = {
+        .subs = &subs,
+        .features = &features,
+        .verbosity = verbosity,
+        .quiet = quiet,
+        .keep_going = keep_going,
+        .jobs = jobs,
+        .async = async,
+        .ordered = ordered,
+        .report_json = report_json,
+        .report_junit = report_junit,
+        .trace = trace,
+        .metrics = metrics,
+        .time_tests = time_tests,
+        .progress = progress_line,
+        .cache = cache,
+    };
+    int overall_rc = daemon_path ? run_daemon(daemon_path, &ro, &filter) :
+                     run_tests(&source, &ro);
+    test_source_free(&source);
+    test_filter_free(&filter);
 
+    save_test_times(verbosity);
+    strmap_free(&test_times);
+    if (history_fd >= 0) {
+        close(history_fd);
+        compact_history();
+    }
+    compact_directive_index();
+    compact_result_cache();
+    index_free();
+    strmap_free(&feature_expr_cache);
     mapkv_free(&subs);
     vecstr_free(&features);
     vecstr_free(&config_args);
     vecstr_free(&env_args);
-    vecstr_free(&merged);
-    vecpid_free(&worker_pids);
+    vecstr_free(&forwarded);
+    free(pargv);
+    vecworker_free(&workers);
     if (abort_requested && overall_rc == 0)
         overall_rc = 128 + abort_requested;
     return overall_rc;
@@ -0,0 +1,4 @@
+#ifndef TIKL_VERSION_H
+#define TIKL_VERSION_H
+#define TIKL_VERSION "e72f9e2-dirty"
+#endif